@@ -3,13 +3,22 @@
 
 #include <ctype.h>
 #include <float.h>
+#include <math.h>
 #include <setjmp.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
 #if defined(_MSC_VER)
+#  include <intrin.h>
 #  define _Thread_local __declspec(thread)
+#  define atomic_add(p, v) _InterlockedExchangeAdd64((p), (v))
+#  define atomic_load(p) (*(p))
+#  define atomic_store(p, v) (*(p) = (v))
+#else
+#  define atomic_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#  define atomic_load(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#  define atomic_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
 #endif
 
 #if !defined(PYPY_VERSION)
@@ -17,2027 +26,5831 @@
 #else
 #  define CACHE_SIZE (0)
 #endif
-#define MAX_CACHE_MPZ_LIMBS (64)
+#define CACHE_CLASSES (12)
+#define MAX_CACHE_MPZ_LIMBS (((zz_size_t)1 << CACHE_CLASSES) - 1)
+
+/* Results in range [-NSMALLNEGINTS, NSMALLPOSINTS) are shared objects,
+   like small integers in CPython. */
+#if !defined(PYPY_VERSION)
+#  define NSMALLNEGINTS (5)
+#  define NSMALLPOSINTS (257)
+#else
+#  define NSMALLNEGINTS (0)
+#  define NSMALLPOSINTS (0)
+#endif
+
+/* Maximal number of scratch values, borrowed at once. */
+#define SCRATCH_SIZE (4)
 
+/* Number of thread-local objects for int operands, see MPZ_borrow_int(). */
+#define INT_OPERANDS (3)
+
+typedef struct {
+    PyTypeObject *CacheInfo_Type;
+} gmp_state;
+
+/* Freed objects and their limb buffers are cached separately, as short
+   values are kept in the inline storage of objects.  Buffers are cached in
+   size classes: the k-th class holds buffers with 2**k <= alloc < 2**(k + 1)
+   limbs.  Classes for big buffers are kept shallower, to bound memory
+   retained by the cache. */
 typedef struct {
     MPZ_Object *gmp_cache[CACHE_SIZE + 1];
     size_t gmp_cache_size;
+    zz_t gmp_limbs[CACHE_CLASSES][CACHE_SIZE + 1];
+    size_t gmp_limbs_size[CACHE_CLASSES];
+    /* statistics */
+    size_t gmp_cache_hits;
+    size_t gmp_cache_misses;
+    size_t gmp_cache_evictions;
+    /* scratch values, see scratch_get() */
+    zz_t scratch[SCRATCH_SIZE];
+    size_t scratch_used;
+    size_t scratch_ready;
+    /* holders for values of int operands, see MPZ_borrow_int() */
+    MPZ_Object *int_operands[INT_OPERANDS];
 } gmp_global;
 
 _Thread_local gmp_global global = {
     .gmp_cache_size = 0,
+    .gmp_limbs_size = {0},
+    .int_operands = {NULL},
 };
 
-static MPZ_Object *
-MPZ_new(void)
-{
-    MPZ_Object *res;
+/* Runtime limits for the cache (shared by all threads), see
+   gmp.cache_config(). */
+static size_t cache_size = CACHE_SIZE;
+static zz_size_t cache_max_limbs = MAX_CACHE_MPZ_LIMBS;
+
+/* Memory limit (in bytes) for limbs of mpz values, shared by all threads,
+   see gmp.set_memory_limit().  Zero means no limit.  While the limit is set,
+   limbs of results are charged to memory_used, until objects are freed. */
+static int64_t memory_limit = 0;
+static int64_t memory_used = 0;
+
+/* Limb buffers of results are reported to tracemalloc in a dedicated
+   domain, until objects are freed.  That's cheap, if tracemalloc is not
+   tracing: PyTraceMalloc_Track() and PyTraceMalloc_Untrack() just return
+   then. */
+#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON)
+#  define TRACEMALLOC_DOMAIN (0x676d70) /* "gmp" */
+#endif
 
-    if (global.gmp_cache_size) {
-        res = global.gmp_cache[--(global.gmp_cache_size)];
-        if (zz_from_sl(0, &res->z)) {
-            /* LCOV_EXCL_START */
-            global.gmp_cache[(global.gmp_cache_size)++] = res;
-            return (MPZ_Object *)PyErr_NoMemory();
-            /* LCOV_EXCL_STOP */
-        }
-        Py_XINCREF((PyObject *)res);
+/* Return true, if a new value with given (estimated) number of bits fits
+   into the memory limit.  Else, set MemoryError. */
+static bool
+memory_allows(double bits)
+{
+    if (!memory_limit) {
+        return true;
     }
-    else {
-        res = PyObject_New(MPZ_Object, &MPZ_Type);
-        if (!res) {
-            return NULL; /* LCOV_EXCL_LINE */
-        }
-        if (zz_init(&res->z)) {
-            return (MPZ_Object *)PyErr_NoMemory(); /* LCOV_EXCL_LINE */
-        }
+
+    int64_t used = atomic_load(&memory_used);
+
+    if (bits/8 <= (double)(memory_limit - used)) {
+        return true;
     }
-    res->hash_cache = -1;
-    return res;
+    PyErr_NoMemory();
+    return false;
 }
 
-static const char *MPZ_TAG = "mpz(";
-static int OPT_TAG = 0x1;
-int OPT_PREFIX = 0x2;
+/* The GIL is released around zz functions, if their work (estimated in limb
+   multiplications) is at least that of multiplying two numbers with
+   nogil_limbs limbs, see gmp.thread_config(). */
+static zz_size_t nogil_limbs = 64;
+
+/* Multiplication (and other algorithms, that are built on it) is done on
+   parallel_threads threads, if both operands have at least parallel_limbs
+   limbs, see gmp.thread_config(). */
+static size_t parallel_threads = 1;
+static zz_size_t parallel_limbs = 8192;
+
+/* Run the statement without the GIL, if cond is true.  Operands must be kept
+   alive by the caller and their values must not change meanwhile. */
+#define NOGIL_IF(cond, stmt)   \
+    if (cond) {                \
+        Py_BEGIN_ALLOW_THREADS \
+        stmt;                  \
+        Py_END_ALLOW_THREADS   \
+    }                          \
+    else {                     \
+        stmt;                  \
+    }
+
+/* Return true, if the GIL can be released for a zz function with the given
+   work on values of u and v (may be NULL).  Values of mpz objects can't
+   change, unlike xmpz ones, which may be changed by other threads. */
+static inline bool
+MPZ_nogil(const MPZ_Object *u, const MPZ_Object *v, double work)
+{
+    return (work >= (double)nogil_limbs*(double)nogil_limbs
+            && (!u || MPZ_CheckExact(u)) && (!v || MPZ_CheckExact(v)));
+}
 
-PyObject *
-MPZ_to_str(MPZ_Object *u, int base, int options)
+static inline size_t
+cache_depth(size_t k)
 {
-    size_t len;
-    bool negative = zz_isneg(&u->z), cast_abs = false;
+    return k > 6 ? cache_size >> (k - 6) : cache_size;
+}
 
-    if ((base < INT8_MIN || base > INT8_MAX)
-        || zz_sizeinbase(&u->z, (int8_t)base, &len))
-    {
-        PyErr_SetString(PyExc_ValueError,
-                        "mpz base must be >= 2 and <= 36");
-        return NULL;
-    }
-    len += negative;
-    if (options & OPT_TAG) {
-        len += strlen(MPZ_TAG) + 1;
-    }
-    if (options & OPT_PREFIX) {
-        len += 2;
+/* Return the smallest class, holding buffers with at least size limbs. */
+static inline size_t
+cache_class(zz_size_t size)
+{
+    size_t k = 0;
+
+    while (k < CACHE_CLASSES && ((zz_size_t)1 << k) < size) {
+        k++;
     }
-    len++;
+    return k;
+}
 
-    int8_t *buf = malloc(len), *p = buf;
+/* On free-threaded builds, objects are often freed by a thread other than
+   the one that created them (e.g. in producer/consumer pipelines).  Then
+   the cache of one thread overflows, while another one keeps missing.
+   So, thread caches are rebalanced through a shared depot: a thread with a
+   full cache moves a magazine of MAGAZINE_SIZE items to the depot, and
+   a thread with an empty cache takes one from the depot.  Thus, the lock is
+   taken at most once per MAGAZINE_SIZE allocations.
+
+   The depot has a slot for objects and one for each class of buffers.
+   Only classes with depth at least MAGAZINE_SIZE take part. */
+#if defined(Py_GIL_DISABLED) && !defined(PYPY_VERSION)
+#  define CACHE_DEPOT
+#endif
+#define MAGAZINE_SIZE (16)
+#define DEPOT_SIZE (64) /* maximal number of full magazines per slot */
+
+#if defined(CACHE_DEPOT)
+typedef struct gmp_magazine {
+    struct gmp_magazine *next;
+    unsigned char items[MAGAZINE_SIZE*sizeof(zz_t)];
+} gmp_magazine;
+
+static struct {
+    PyMutex mutex;
+    gmp_magazine *full[CACHE_CLASSES + 1];
+    size_t nfull[CACHE_CLASSES + 1];
+    gmp_magazine *empty;
+} depot;
+
+/* Move MAGAZINE_SIZE items (of itemsize bytes each) from the top of the
+   stack to the depot slot.  Return false, if the depot slot is full. */
+static bool
+depot_put(size_t slot, void *stack, size_t *size, size_t itemsize)
+{
+    bool ok = false;
 
-    if (!buf) {
-        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
-    }
-    if (options & OPT_TAG) {
-        strcpy((char *)p, MPZ_TAG);
-        p += strlen(MPZ_TAG);
-    }
-    if (options & OPT_PREFIX) {
-        if (negative) {
-            *(p++) = '-';
-            cast_abs = true;
-        }
-        if (base == 2) {
-            *(p++) = '0';
-            *(p++) = 'b';
-        }
-        else if (base == 8) {
-            *(p++) = '0';
-            *(p++) = 'o';
+    PyMutex_Lock(&depot.mutex);
+    if (depot.nfull[slot] < DEPOT_SIZE) {
+        gmp_magazine *m = depot.empty;
+
+        if (m) {
+            depot.empty = m->next;
         }
-        else if (base == 16) {
-            *(p++) = '0';
-            *(p++) = 'x';
+        else {
+            m = PyMem_RawMalloc(sizeof(gmp_magazine));
         }
-        else if (base == -16) {
-            *(p++) = '0';
-            *(p++) = 'X';
+        if (m) {
+            *size -= MAGAZINE_SIZE;
+            memcpy(m->items, (unsigned char *)stack + *size*itemsize,
+                   MAGAZINE_SIZE*itemsize);
+            m->next = depot.full[slot];
+            depot.full[slot] = m;
+            depot.nfull[slot]++;
+            ok = true;
         }
     }
-    if (cast_abs) {
-        (void)zz_abs(&u->z, &u->z);
-    }
+    PyMutex_Unlock(&depot.mutex);
+    return ok;
+}
 
-    zz_err ret = zz_to_str(&u->z, (int8_t)base, p, &len);
+/* Move MAGAZINE_SIZE items from the depot slot to the top of the stack.
+   Return false, if the depot slot is empty. */
+static bool
+depot_get(size_t slot, void *stack, size_t *size, size_t itemsize)
+{
+    bool ok = false;
 
-    if (cast_abs) {
-        (void)zz_neg(&u->z, &u->z);
-    }
-    if (ret) {
-        /* LCOV_EXCL_START */
-        free(buf);
-        return PyErr_NoMemory();
-        /* LCOV_EXCL_STOP */
+    PyMutex_Lock(&depot.mutex);
+
+    gmp_magazine *m = depot.full[slot];
+
+    if (m) {
+        depot.full[slot] = m->next;
+        depot.nfull[slot]--;
+        memcpy((unsigned char *)stack + *size*itemsize, m->items,
+               MAGAZINE_SIZE*itemsize);
+        *size += MAGAZINE_SIZE;
+        m->next = depot.empty;
+        depot.empty = m;
+        ok = true;
     }
-    p += len;
-    if (options & OPT_TAG) {
-        *(p++) = ')';
+    PyMutex_Unlock(&depot.mutex);
+    return ok;
+}
+
+/* Free all items, held by the depot. */
+static void
+depot_clear(void)
+{
+    PyMutex_Lock(&depot.mutex);
+    for (size_t slot = 0; slot <= CACHE_CLASSES; slot++) {
+        while (depot.full[slot]) {
+            gmp_magazine *m = depot.full[slot];
+
+            depot.full[slot] = m->next;
+            for (size_t i = 0; i < MAGAZINE_SIZE; i++) {
+                if (slot) {
+                    zz_clear((zz_t *)m->items + i);
+                }
+                else {
+                    PyObject_Free(((MPZ_Object **)m->items)[i]);
+                }
+            }
+            PyMem_RawFree(m);
+        }
+        depot.nfull[slot] = 0;
     }
-    *(p++) = '\0';
+    while (depot.empty) {
+        gmp_magazine *m = depot.empty;
 
-    PyObject *res = PyUnicode_FromString((char *)buf);
+        depot.empty = m->next;
+        PyMem_RawFree(m);
+    }
+    PyMutex_Unlock(&depot.mutex);
+}
+#else
+static inline bool
+depot_put(size_t Py_UNUSED(slot), void *Py_UNUSED(stack),
+          size_t *Py_UNUSED(size), size_t Py_UNUSED(itemsize))
+{
+    return false;
+}
 
-    free(buf);
-    return res;
+static inline bool
+depot_get(size_t Py_UNUSED(slot), void *Py_UNUSED(stack),
+          size_t *Py_UNUSED(size), size_t Py_UNUSED(itemsize))
+{
+    return false;
 }
 
-static MPZ_Object *
-MPZ_from_str(PyObject *obj, int base)
+static inline void
+depot_clear(void)
 {
-    Py_ssize_t len;
-    int8_t *str = (int8_t *)PyUnicode_AsUTF8AndSize(obj, &len);
+}
+#endif
 
-    if (!str) {
-        return NULL; /* LCOV_EXCL_LINE */
+/* Setup u with a limb buffer from the cache, if there is one with at least
+   size limbs.  Else, init u. */
+static zz_err
+cache_get_limbs(zz_size_t size, zz_t *u)
+{
+    size_t k = cache_class(size);
+
+    /* Look also one class up: better to waste a little memory, than to
+       realloc. */
+    for (size_t i = k; i < k + 2 && i < CACHE_CLASSES; i++) {
+        if (global.gmp_limbs_size[i]) {
+            *u = global.gmp_limbs[i][--(global.gmp_limbs_size[i])];
+            u->negative = false;
+            u->size = 0;
+            global.gmp_cache_hits++;
+            return ZZ_OK;
+        }
     }
-    if (base < 0 || base > INT8_MAX) {
-        goto bad_base;
+    if (k < CACHE_CLASSES && cache_depth(k) >= MAGAZINE_SIZE
+        && depot_get(k + 1, global.gmp_limbs[k], &global.gmp_limbs_size[k],
+                     sizeof(zz_t)))
+    {
+        *u = global.gmp_limbs[k][--(global.gmp_limbs_size[k])];
+        u->negative = false;
+        u->size = 0;
+        global.gmp_cache_hits++;
+        return ZZ_OK;
     }
+    global.gmp_cache_misses++;
+    return zz_init(u);
+}
 
-    MPZ_Object *res = MPZ_new();
+/* Put limb buffer of u to the cache or free it. */
+static void
+cache_put_limbs(zz_t *u)
+{
+    if (!u->alloc) {
+        return;
+    }
+    if (u->alloc <= cache_max_limbs) {
+        size_t k = cache_class(u->alloc + 1) - 1;
+        size_t depth = cache_depth(k);
 
-    if (!res) {
-        return (MPZ_Object *)PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        if (global.gmp_limbs_size[k] < depth
+            || (depth >= MAGAZINE_SIZE
+                && depot_put(k + 1, global.gmp_limbs[k],
+                             &global.gmp_limbs_size[k], sizeof(zz_t))))
+        {
+            global.gmp_limbs[k][(global.gmp_limbs_size[k])++] = *u;
+            return;
+        }
     }
-    while (len && isspace(*str)) {
-        str++;
-        len--;
+    global.gmp_cache_evictions++;
+    zz_clear(u);
+}
+
+/* Borrow a temporary value from the per-thread scratch arena.  Such values
+   keep their buffers between calls, so internal helpers do no heap work
+   in the steady state.  Values must be returned by scratch_put() in the
+   reverse order.  Return NULL on memory errors. */
+static zz_t *
+scratch_get(void)
+{
+    assert(global.scratch_used < SCRATCH_SIZE);
+
+    zz_t *u = &global.scratch[global.scratch_used];
+
+    if (global.scratch_used == global.scratch_ready) {
+        if (zz_init(u)) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+        global.scratch_ready++;
     }
+    global.scratch_used++;
+    u->negative = false;
+    u->size = 0;
+    return u;
+}
 
-    bool cast_negative = (str[0] == '-');
+/* Free unused scratch values. */
+static void
+scratch_clear(void)
+{
+    while (global.scratch_ready > global.scratch_used) {
+        zz_clear(&global.scratch[--(global.scratch_ready)]);
+    }
+}
 
-    str += cast_negative;
-    len -= cast_negative;
-    if (len && str[0] == '+') {
-        str++;
-        len--;
+static void
+scratch_put(zz_t *u)
+{
+    assert(global.scratch_used
+           && u == &global.scratch[global.scratch_used - 1]);
+    global.scratch_used--;
+    /* Don't hold big buffers, same as the cache. */
+    if (u->alloc > cache_max_limbs) {
+        scratch_clear();
     }
-    if (str[0] == '0' && len >= 2) {
-        if (base == 0) {
-            if (tolower(str[1]) == 'b') {
-                base = 2;
-            }
-            else if (tolower(str[1]) == 'o') {
-                base = 8;
-            }
-            else if (tolower(str[1]) == 'x') {
-                base = 16;
-            }
-            else {
-                goto err;
-            }
-        }
-        if ((tolower(str[1]) == 'b' && base == 2)
-            || (tolower(str[1]) == 'o' && base == 8)
-            || (tolower(str[1]) == 'x' && base == 16))
-        {
-            str += 2;
-            len -= 2;
-            if (len && str[0] == '_') {
-                str++;
-                len--;
-            }
-        }
-        else {
-            goto skip_negation;
-        }
+}
+
+/* Objects, that are referenced only by the caller, can be reused for
+   results of in-place operations or to hold temporary values. */
+#if defined(Py_GIL_DISABLED)
+#  if PY_VERSION_HEX >= 0x030E0000
+#    define MPZ_IsUnique(u) PyUnstable_Object_IsUniquelyReferenced(u)
+#  else
+#    define MPZ_IsUnique(u) 0
+#  endif
+#else
+#  define MPZ_IsUnique(u) (Py_REFCNT(u) == 1)
+#endif
+
+/* Same for operands of number slots.  Since CPython 3.14, the interpreter
+   may keep borrowed references to them on the stack, so the only counted
+   reference must be a temporary. */
+#if PY_VERSION_HEX >= 0x030E0000
+#  define MPZ_IsTemporary(u) PyUnstable_Object_IsUniqueReferencedTemporary(u)
+#elif defined(Py_GIL_DISABLED)
+#  define MPZ_IsTemporary(u) 0
+#else
+#  define MPZ_IsTemporary(u) (Py_REFCNT(u) == 1)
+#endif
+
+static inline bool
+MPZ_is_inline(const MPZ_Object *u)
+{
+    return u->z.digits == u->limbs;
+}
+
+/* Return a new mpz object with uninitialized value, taken from the cache,
+   if possible. */
+static inline MPZ_Object *
+MPZ_alloc(void)
+{
+    MPZ_Object *res;
+
+    if (global.gmp_cache_size
+        || (cache_size >= MAGAZINE_SIZE
+            && depot_get(0, global.gmp_cache, &global.gmp_cache_size,
+                         sizeof(MPZ_Object *))))
+    {
+        res = global.gmp_cache[--(global.gmp_cache_size)];
+        (void)PyObject_Init((PyObject *)res, &MPZ_Type);
+        global.gmp_cache_hits++;
     }
     else {
-skip_negation:
-        str -= cast_negative;
-        len += cast_negative;
-        cast_negative = false;
-    }
-    if (base == 0) {
-        base = 10;
+        global.gmp_cache_misses++;
+        res = PyObject_New(MPZ_Object, &MPZ_Type);
+        if (!res) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
     }
+    res->hash_cache = -1;
+    res->charge = 0;
+    return res;
+}
 
-    int8_t *end = str + len - 1;
+/* Return a new mpz object.  The size is an estimate for the number of limbs
+   in the result, used to pick a cached buffer of adequate size.
 
-    while (len > 0 && isspace(*end)) {
-        end--;
-        len--;
+   The value of such object is never kept in the inline storage, so it's
+   safe to pass it as an output to zz functions, which may realloc the
+   buffer.  Short values are moved to the inline storage by MPZ_finish(). */
+static MPZ_Object *
+MPZ_new(zz_size_t size)
+{
+    if (!memory_allows((double)size*ZZ_LIMB_T_BITS)) {
+        return NULL;
     }
 
-    zz_err ret = zz_from_str(str, (size_t)len, (int8_t)base, &res->z);
+    MPZ_Object *res = MPZ_alloc();
 
-    if (ret == ZZ_MEM) {
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    if (cache_get_limbs(size, &res->z)) {
         /* LCOV_EXCL_START */
+        res->z.digits = res->limbs;
         Py_DECREF(res);
         return (MPZ_Object *)PyErr_NoMemory();
         /* LCOV_EXCL_STOP */
     }
-    else if (ret == ZZ_VAL) {
-        Py_DECREF(res);
-        if (2 <= base && base <= 36) {
-err:
-            PyErr_Format(PyExc_ValueError,
-                         "invalid literal for mpz() with base %d: %.200R",
-                         base, obj);
-        }
-        else {
-bad_base:
-            PyErr_SetString(PyExc_ValueError,
-                            "mpz base must be >= 2 and <= 36, or 0");
-        }
-        return NULL;
-    }
-    if (cast_negative) {
-        (void)zz_neg(&res->z, &res->z);
-    }
     return res;
 }
 
+/* Shared objects for small values.  The table is filled by gmp_exec() in
+   the main interpreter and kept for the lifetime of the process.  Other
+   interpreters may run with their own GIL, so they get new objects. */
+static MPZ_Object *small_ints[NSMALLNEGINTS + NSMALLPOSINTS + 1];
+static PyInterpreterState *small_ints_interp;
+
+/* Return a new object for the small value. */
 static MPZ_Object *
-MPZ_from_int(PyObject *obj)
+MPZ_new_small(zz_slimb_t value)
 {
-#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON) \
-    && !defined(Py_LIMITED_API)
-    PyLongExport long_export = {0, 0, 0, 0, 0};
-    const zz_layout *int_layout = (zz_layout *)PyLong_GetNativeLayout();
-    MPZ_Object *res = NULL;
+    MPZ_Object *res = PyObject_New(MPZ_Object, &MPZ_Type);
 
-    if (PyLong_Export(obj, &long_export) < 0) {
-        return res; /* LCOV_EXCL_LINE */
-    }
-    if (long_export.digits) {
-        res = MPZ_new();
-        if (!res || zz_import((size_t)long_export.ndigits,
-                              long_export.digits, *int_layout, &res->z))
-        {
-            return (MPZ_Object *)PyErr_NoMemory(); /* LCOV_EXCL_LINE */
-        }
-        if (long_export.negative) {
-            (void)zz_neg(&res->z, &res->z);
-        }
-        PyLong_FreeExport(&long_export);
-    }
-    else {
-        res = MPZ_new();
-        if (res && zz_from_sl(long_export.value, &res->z)) {
-            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
-        }
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
     }
+    res->z.negative = value < 0;
+    res->z.alloc = MPZ_INLINE_LIMBS;
+    res->z.size = value != 0;
+    res->z.digits = res->limbs;
+    res->limbs[0] = value < 0 ? -(zz_limb_t)value : (zz_limb_t)value;
+    res->charge = 0;
+    /* Shared objects are read-only, hash is computed in advance. */
+    res->hash_cache = value == -1 ? -2 : (Py_hash_t)value;
     return res;
-#else
-    int64_t value;
+}
 
-    if (!PyLong_AsInt64(obj, &value)) {
-        MPZ_Object *res = MPZ_new();
+/* Return a new reference to the shared object for the small value. */
+static MPZ_Object *
+MPZ_small(zz_slimb_t value)
+{
+#if !defined(PYPY_VERSION)
+    assert(-NSMALLNEGINTS <= value && value < NSMALLPOSINTS);
+    if (small_ints_interp == PyInterpreterState_Get()) {
+        return (MPZ_Object *)Py_NewRef(small_ints[value + NSMALLNEGINTS]);
+    }
+#endif
+    return MPZ_new_small(value); /* LCOV_EXCL_LINE */
+}
 
-        if (res && zz_from_sl(value, &res->z)) {
-            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
-        }
-        return res;
+/* Return a new (finished) mpz object with the given value. */
+static MPZ_Object *
+MPZ_from_sl(zz_slimb_t value)
+{
+    if (-NSMALLNEGINTS <= value && value < NSMALLPOSINTS) {
+        return MPZ_small(value);
     }
-    PyErr_Clear();
 
-    PyObject *str = PyNumber_ToBase(obj, 16);
+    MPZ_Object *res = MPZ_alloc();
 
-    if (!str) {
+    if (!res) {
         return NULL; /* LCOV_EXCL_LINE */
     }
-
-    MPZ_Object *res = MPZ_from_str(str, 16);
-
-    Py_DECREF(str);
+    res->z.negative = value < 0;
+    res->z.alloc = MPZ_INLINE_LIMBS;
+    res->z.size = 1;
+    res->z.digits = res->limbs;
+    res->limbs[0] = value < 0 ? -(zz_limb_t)value : (zz_limb_t)value;
     return res;
-#endif
 }
 
-static PyObject *
-MPZ_to_int(MPZ_Object *u)
+/* Get the value of u, if it fits into zz_slimb_t. */
+static inline bool
+MPZ_to_sl(const MPZ_Object *u, zz_slimb_t *value)
 {
-    zz_slimb_t value;
-
-    if (zz_to_sl(&u->z, &value) == ZZ_OK) {
-        return PyLong_FromInt64(value);
+    if (u->z.size > 1) {
+        return false;
     }
 
-#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON) \
-    && !defined(Py_LIMITED_API)
-    const zz_layout *int_layout = (zz_layout *)PyLong_GetNativeLayout();
-    size_t size = (zz_bitlen(&u->z) + int_layout->bits_per_limb
-                   - 1)/int_layout->bits_per_limb;
-    void *digits;
-    PyLongWriter *writer = PyLongWriter_Create(zz_isneg(&u->z),
-                                               (Py_ssize_t)size, &digits);
+    zz_limb_t digit = u->z.size ? u->z.digits[0] : 0;
 
-    if (!writer) {
-        return NULL; /* LCOV_EXCL_LINE */
+    if (digit > ZZ_SLIMB_T_MAX) {
+        return false;
     }
-    (void)zz_export(&u->z, *int_layout, size, digits);
-    return PyLongWriter_Finish(writer);
-#else
-    size_t len;
-
-    (void)zz_sizeinbase(&u->z, 16, &len);
-    len += zz_isneg(&u->z);
+    *value = u->z.negative ? -(zz_slimb_t)digit : (zz_slimb_t)digit;
+    return true;
+}
 
-    int8_t *buf = malloc(len + 1);
+/* Move the value of u to a buffer of fitting size. */
+static void
+MPZ_shrink(MPZ_Object *u)
+{
+    zz_t tmp;
 
-    if (zz_to_str(&u->z, 16, buf, &len)) {
+    if (cache_get_limbs(u->z.size, &tmp)) {
+        return; /* LCOV_EXCL_LINE */
+    }
+    if (zz_copy(&u->z, &tmp)) {
         /* LCOV_EXCL_START */
-        free(buf);
-        return NULL;
+        cache_put_limbs(&tmp);
+        return;
         /* LCOV_EXCL_STOP */
     }
-    buf[len] = '\0';
-
-    PyObject *res = PyLong_FromString((char *)buf, NULL, 16);
-
-    free(buf);
-    return res;
-#endif
+    cache_put_limbs(&u->z);
+    u->z = tmp;
 }
 
-static void
-revstr(unsigned char *s, Py_ssize_t l, Py_ssize_t r)
-{
-    while (l < r) {
-        unsigned char tmp = s[l];
+/* Results with alloc >= SHRINK_RATIO*size are shrinked to fit. */
+#define SHRINK_RATIO (8)
 
-        s[l] = s[r];
-        s[r] = tmp;
-        l++;
-        r--;
+/* Finish the result (a new object) before returning it: return the shared
+   object instead, if the value is small, or move a short value to the inline
+   storage.  Buffers of other values are shrinked, if oversized, and charged
+   to the memory limit.  Steals a reference to u. */
+static MPZ_Object *
+MPZ_finish(MPZ_Object *u)
+{
+    if (!u) {
+        return u;
     }
-}
+    if (u->z.size <= 1) {
+        zz_limb_t digit = u->z.size ? u->z.digits[0] : 0;
 
-static PyObject *
-MPZ_to_bytes(MPZ_Object *u, Py_ssize_t length, int is_little, int is_signed)
-{
-    PyObject *bytes = PyBytes_FromStringAndSize(NULL, length);
+        if (u->z.negative ? digit <= NSMALLNEGINTS : digit < NSMALLPOSINTS) {
+            zz_slimb_t value = (u->z.negative ? -(zz_slimb_t)digit
+                                : (zz_slimb_t)digit);
+            MPZ_Object *res = MPZ_small(value);
 
-    if (!bytes) {
-        return NULL; /* LCOV_EXCL_LINE */
+            if (res) {
+                Py_DECREF(u);
+                return res;
+            }
+            PyErr_Clear(); /* LCOV_EXCL_LINE */
+        }
     }
+    if (MPZ_is_inline(u)) {
+        return u;
+    }
+    if (u->z.size <= MPZ_INLINE_LIMBS) {
+        zz_t tmp = u->z;
 
-    uint8_t *buffer = (uint8_t *)PyBytes_AS_STRING(bytes);
-    zz_err ret = zz_to_bytes(&u->z, (size_t)length, is_signed, &buffer);
-
-    if (ret == ZZ_OK) {
-        if (is_little && length) {
-            revstr(buffer, 0, length - 1);
+        if (tmp.size) {
+            memcpy(u->limbs, tmp.digits, (size_t)tmp.size*sizeof(zz_limb_t));
         }
-        return bytes;
+        u->z.alloc = MPZ_INLINE_LIMBS;
+        u->z.digits = u->limbs;
+        cache_put_limbs(&tmp);
     }
-    if (ret == ZZ_BUF) {
-        if (zz_isneg(&u->z) && !is_signed) {
-            PyErr_SetString(PyExc_OverflowError,
-                            "can't convert negative mpz to unsigned");
+    else {
+        if (u->z.alloc >= SHRINK_RATIO*u->z.size) {
+            MPZ_shrink(u);
         }
-        else {
-#if (PY_VERSION_HEX < 0x030D08F0 || (PY_VERSION_HEX >= 0x030E0000 \
-                                     && PY_VERSION_HEX < 0x030E00C3))
-            if (!length && zz_cmp_sl(&u->z, -1) == ZZ_EQ) {
-                return bytes;
-            }
-#endif
-            PyErr_SetString(PyExc_OverflowError, "int too big to convert");
+        if (memory_limit) {
+            atomic_add(&memory_used, ((int64_t)(u->z.alloc - u->charge)
+                                      * (int64_t)sizeof(zz_limb_t)));
+            u->charge = u->z.alloc;
         }
-        Py_DECREF(bytes);
-        return NULL;
+#if defined(TRACEMALLOC_DOMAIN)
+        (void)PyTraceMalloc_Track(TRACEMALLOC_DOMAIN, (uintptr_t)u->z.digits,
+                                  (size_t)u->z.alloc*sizeof(zz_limb_t));
+#endif
     }
-    /* LCOV_EXCL_START */
-    Py_DECREF(bytes);
-    return PyErr_NoMemory();
-    /* LCOV_EXCL_STOP */
+    return u;
 }
 
-static MPZ_Object *
-MPZ_from_bytes(PyObject *obj, int is_little, int is_signed)
+/* Prepare a finished object u, which is not referenced elsewhere, to take
+   the result of an in-place operation.  The size is an estimate for the
+   number of limbs in the result.  The value is moved out of the inline
+   storage, as zz functions may realloc the output.  Use MPZ_finish()
+   afterwards.  Return -1 and set an exception on errors. */
+static int
+MPZ_unfinish(MPZ_Object *u, zz_size_t size)
 {
-    PyObject *bytes = PyObject_Bytes(obj);
-    uint8_t *buffer;
-    Py_ssize_t length;
-
-    if (bytes == NULL) {
-        return NULL;
-    }
-    if (PyBytes_AsStringAndSize(bytes, (char **)&buffer, &length) == -1) {
-        return NULL; /* LCOV_EXCL_LINE */
-    }
-    if (!length) {
-        is_little = 0;
+    if (!memory_allows((double)size*ZZ_LIMB_T_BITS)) {
+        return -1;
     }
-    if (is_little) {
-        uint8_t *tmp = malloc((size_t)length);
+    if (MPZ_is_inline(u)) {
+        zz_t tmp;
 
-        if (!tmp) {
+        if (cache_get_limbs(Py_MAX(size, u->z.size), &tmp)) {
+            return PyErr_NoMemory(), -1; /* LCOV_EXCL_LINE */
+        }
+        if (zz_copy(&u->z, &tmp)) {
             /* LCOV_EXCL_START */
-            Py_DECREF(bytes);
-            return (MPZ_Object *)PyErr_NoMemory();
+            cache_put_limbs(&tmp);
+            return PyErr_NoMemory(), -1;
             /* LCOV_EXCL_STOP */
         }
-        memcpy(tmp, buffer, (size_t)length);
-        revstr(tmp, 0, length - 1);
-        buffer = tmp;
+        u->z = tmp;
+    }
+    else {
+#if defined(TRACEMALLOC_DOMAIN)
+        (void)PyTraceMalloc_Untrack(TRACEMALLOC_DOMAIN, (uintptr_t)u->z.digits);
+#endif
     }
+    if (u->charge) {
+        atomic_add(&memory_used,
+                   -(int64_t)u->charge*(int64_t)sizeof(zz_limb_t));
+        u->charge = 0;
+    }
+    u->hash_cache = -1;
+    return 0;
+}
 
-    MPZ_Object *res = MPZ_new();
+static MPZ_Object *
+MPZ_copy(MPZ_Object *u)
+{
+    MPZ_Object *res = MPZ_new(u->z.size);
 
-    if (!res || zz_from_bytes(buffer, (size_t)length, is_signed, &res->z)) {
+    if (res && zz_copy(&u->z, &res->z)) {
         /* LCOV_EXCL_START */
-        Py_DECREF(bytes);
-        if (is_little) {
-            free(buffer);
-        }
-        Py_XDECREF(res);
+        Py_DECREF(res);
         return (MPZ_Object *)PyErr_NoMemory();
         /* LCOV_EXCL_STOP */
     }
-    if (is_little) {
-        free(buffer);
-    }
     return res;
 }
 
-static PyObject *
-new_impl(PyTypeObject *Py_UNUSED(type), PyObject *arg, PyObject *base_arg)
+/* Parallel multiplication.  Operands are split in halves (only the bigger
+   one, if it's at least twice longer, else both, like in the Karatsuba
+   method) until there are enough independent products for all threads.
+   Such products are computed in parallel, then they are combined to the
+   result level by level, again in parallel. */
+
+typedef struct {
+    zz_t a, b, w;    /* a*b = w, where a is the bigger operand */
+    bool own_a, own_b, own_w;
+    int arity;       /* number of children (0 for leaves) */
+    size_t child;    /* index of the first child */
+    zz_size_t half;  /* split point of operands (in limbs) */
+    zz_err ret;
+} mul_node;
+
+typedef struct {
+    mul_node *nodes;
+    const size_t *index;
+} mul_data;
+
+/* Return a view of the absolute value of limbs [start, end) of u. */
+static zz_t
+zz_view(const zz_t *u, zz_size_t start, zz_size_t end)
 {
-    int base = 10;
+    end = Py_MIN(end, u->size);
+    start = Py_MIN(start, end);
+    while (end > start && !u->digits[end - 1]) {
+        end--;
+    }
+    return (zz_t){false, end - start, end - start, u->digits + start};
+}
 
-    if (Py_IsNone(base_arg)) {
-        if (PyLong_Check(arg)) {
-            return (PyObject *)MPZ_from_int(arg);
-        }
-        if (MPZ_CheckExact(arg)) {
-            return Py_NewRef(arg);
-        }
-        if (PyNumber_Check(arg)) {
-            PyObject *integer = NULL;
+static zz_err
+mul_node_init(mul_node *node, zz_t a, zz_t b, bool own_a, bool own_b)
+{
+    bool swap = a.size < b.size;
+
+    node->a = swap ? b : a;
+    node->b = swap ? a : b;
+    node->own_a = swap ? own_b : own_a;
+    node->own_b = swap ? own_a : own_b;
+    node->arity = 0;
+    node->ret = zz_init(&node->w);
+    node->own_w = node->ret == ZZ_OK;
+    return node->ret;
+}
 
-            if (Py_TYPE(arg)->tp_as_number->nb_int) {
-                integer = Py_TYPE(arg)->tp_as_number->nb_int(arg);
-                if (!integer) {
-                    return NULL;
-                }
-                if (!PyLong_Check(integer)) {
-                    PyErr_Format(PyExc_TypeError,
-                                 "__int__ returned non-int (type %.200s)",
-                                 Py_TYPE(integer)->tp_name);
-                    Py_DECREF(integer);
-                    return NULL;
-                }
-                if (!PyLong_CheckExact(integer)
-                    && PyErr_WarnFormat(PyExc_DeprecationWarning, 1,
-                                        "__int__ returned non-int (type %.200s).  "
-                                        "The ability to return an instance of a "
-                                        "strict subclass of int "
-                                        "is deprecated, and may be removed "
-                                        "in a future version of Python.",
-                                        Py_TYPE(integer)->tp_name))
-                {
-                    Py_DECREF(integer);
-                    return NULL;
-                }
-            }
-            else {
-                integer = PyNumber_Index(arg);
-                if (!integer) {
-                    return NULL;
-                }
-            }
-            if (integer) {
-                Py_SETREF(integer, (PyObject *)MPZ_from_int(integer));
-                return integer;
-            }
-        }
-        goto str;
+static void
+mul_node_clear(mul_node *node)
+{
+    if (node->own_a) {
+        zz_clear(&node->a);
+        node->own_a = false;
     }
-    else {
-        base = PyLong_AsInt(base_arg);
-        if (base == -1 && PyErr_Occurred()) {
-            return NULL;
-        }
+    if (node->own_b) {
+        zz_clear(&node->b);
+        node->own_b = false;
     }
-str:
-    if (PyUnicode_Check(arg)) {
-        PyObject *asciistr = gmp_PyUnicode_TransformDecimalAndSpaceToASCII(arg);
+    if (node->own_w) {
+        zz_clear(&node->w);
+        node->own_w = false;
+    }
+}
 
-        if (!asciistr) {
-            return NULL; /* LCOV_EXCL_LINE */
+static int
+mul_arity(const mul_node *node)
+{
+    if (node->a.size < 2) {
+        return 0;
+    }
+    return node->a.size >= 2*node->b.size ? 2 : 3;
+}
+
+/* Split the node, appending children to nodes[*n]. */
+static zz_err
+mul_split(mul_node *nodes, size_t i, size_t *n)
+{
+    mul_node *node = &nodes[i], *child = &nodes[*n];
+    const zz_t *a = &node->a, *b = &node->b;
+    zz_size_t h = (a->size + 1)/2;
+    zz_t a0 = zz_view(a, 0, h), a1 = zz_view(a, h, a->size);
+
+    node->arity = mul_arity(node);
+    node->half = h;
+    node->child = *n;
+    /* Children are counted before initialization, to be cleared on
+       failures. */
+    if (node->arity == 2) {
+        *n += 2;
+        if (mul_node_init(&child[0], a0, *b, false, false)
+            || mul_node_init(&child[1], a1, *b, false, false))
+        {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
         }
+        return ZZ_OK;
+    }
 
-        PyObject *res = (PyObject *)MPZ_from_str(asciistr, base);
+    zz_t b0 = zz_view(b, 0, h), b1 = zz_view(b, h, b->size), sa, sb;
 
-        Py_DECREF(asciistr);
-        return res;
+    if (zz_init(&sa)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
     }
-    else if (PyByteArray_Check(arg) || PyBytes_Check(arg)) {
-        const char *string;
-
-        if (PyByteArray_Check(arg)) {
-            string = PyByteArray_AS_STRING(arg);
-        }
-        else {
-            string = PyBytes_AS_STRING(arg);
+    if (zz_init(&sb)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&sa);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_add(&a0, &a1, &sa) || zz_add(&b0, &b1, &sb)) {
+        /* LCOV_EXCL_START */
+        zz_clear(&sa);
+        zz_clear(&sb);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    *n += 3;
+    if (mul_node_init(&child[0], a0, b0, false, false)
+        || mul_node_init(&child[1], a1, b1, false, false)
+        || mul_node_init(&child[2], sa, sb, true, true))
+    {
+        /* LCOV_EXCL_START */
+        if (!child[2].own_a) { /* else sums are cleared with the child */
+            zz_clear(&sa);
+            zz_clear(&sb);
         }
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    return ZZ_OK;
+}
 
-        PyObject *str = PyUnicode_FromString(string);
+static void
+mul_leaf_task(void *data, size_t i)
+{
+    const mul_data *d = data;
+    mul_node *node = &d->nodes[d->index[i]];
 
-        if (!str) {
-            return NULL; /* LCOV_EXCL_LINE */
-        }
+    node->ret = zz_mul(&node->a, &node->b, &node->w);
+}
+
+static void
+mul_combine_task(void *data, size_t i)
+{
+    const mul_data *d = data;
+    mul_node *node = &d->nodes[d->index[i]];
+    mul_node *c = &d->nodes[node->child];
+    zz_bitcnt_t shift = (zz_bitcnt_t)node->half*ZZ_LIMB_T_BITS;
+    zz_t *w = &node->w;
 
-        PyObject *res = (PyObject *)MPZ_from_str(str, base);
+    /*                    shift                shift
+       w = w0 + w1 * 2        for arity 2, or
 
-        Py_DECREF(str);
-        return res;
-    }
-    if (Py_IsNone(base_arg)) {
-        PyErr_SetString(PyExc_TypeError,
-                        "argument must be a number or a string");
+                                        shift         2*shift
+       w = w0 + (w2 - w0 - w1) * 2      +  w1 * 2        for arity 3. */
+    if (node->arity == 2) {
+        node->ret = (zz_mul_2exp(&c[1].w, shift, &c[1].w)
+                     || zz_add(&c[1].w, &c[0].w, w)) ? ZZ_MEM : ZZ_OK;
     }
     else {
-        PyErr_SetString(PyExc_TypeError,
-                        "can't convert non-string with explicit base");
+        node->ret = (zz_sub(&c[2].w, &c[0].w, &c[2].w)
+                     || zz_sub(&c[2].w, &c[1].w, &c[2].w)
+                     || zz_mul_2exp(&c[2].w, shift, &c[2].w)
+                     || zz_mul_2exp(&c[1].w, 2*shift, &c[1].w)
+                     || zz_add(&c[1].w, &c[2].w, w)
+                     || zz_add(w, &c[0].w, w)) ? ZZ_MEM : ZZ_OK;
+    }
+    for (int k = 0; k < node->arity; k++) {
+        mul_node_clear(&c[k]);
     }
-    return NULL;
 }
 
-static PyObject *
-new(PyTypeObject *type, PyObject *args, PyObject *keywds)
+/* Run the task in parallel for leaves (or other nodes) in [start, end).
+   Return ZZ_MEM, if it failed for some node. */
+static zz_err
+mul_run(mul_node *nodes, size_t *index, size_t start, size_t end,
+        bool leaves, void (*task)(void *, size_t), size_t threads)
 {
-    static char *kwlist[] = {"", "base", NULL};
-    Py_ssize_t argc = PyTuple_GET_SIZE(args);
-    PyObject *arg, *base = Py_None;
+    size_t k = 0;
 
-    if (type != &MPZ_Type) {
-        MPZ_Object *tmp = (MPZ_Object *)new(&MPZ_Type, args, keywds);
+    for (size_t i = start; i < end; i++) {
+        if ((nodes[i].arity == 0) == leaves) {
+            index[k++] = i;
+        }
+    }
 
-        if (!tmp) {
-            return NULL; /* LCOV_EXCL_LINE */
+    mul_data data = {nodes, index};
+
+    gmp_parallel_for(k, threads, task, &data);
+    for (size_t i = 0; i < k; i++) {
+        if (nodes[index[i]].ret) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
         }
+    }
+    return ZZ_OK;
+}
 
-        MPZ_Object *newobj = (MPZ_Object *)type->tp_alloc(type, 0);
+/* Multiplication on (at most) the given number of threads.  Doesn't use the
+   Python C-API. */
+static zz_err
+zz_mul_threads(const zz_t *u, const zz_t *v, zz_t *w, size_t threads)
+{
+    if (threads < 2 || zz_iszero(u) || zz_iszero(v)) {
+        return zz_mul(u, v, w);
+    }
 
-        if (!newobj) {
-            /* LCOV_EXCL_START */
-            Py_DECREF(tmp);
-            return NULL;
-            /* LCOV_EXCL_STOP */
+    /* The tree is grown level by level, while the number of leaves fits
+       into the number of threads.  At least three leaves are allowed. */
+    size_t max_leaves = Py_MAX(threads, 3), cap = 4*max_leaves + 1;
+    mul_node *nodes = calloc(cap, sizeof(mul_node));
+    size_t *levels = calloc(cap + 1, sizeof(size_t));
+    size_t *index = calloc(cap, sizeof(size_t));
+    size_t n = 1, depth = 1;
+    zz_err ret = ZZ_MEM;
+    bool negative = zz_isneg(u) != zz_isneg(v);
+
+    if (!nodes || !levels || !index) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    if (mul_node_init(&nodes[0], zz_view(u, 0, u->size),
+                      zz_view(v, 0, v->size), false, false))
+    {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    levels[1] = 1;
+    while (1) {
+        size_t next = 0;
+
+        for (size_t i = levels[depth - 1]; i < n; i++) {
+            next += (size_t)mul_arity(&nodes[i]);
         }
-        if (zz_init(&newobj->z) || zz_copy(&tmp->z, &newobj->z)) {
-            /* LCOV_EXCL_START */
-            Py_DECREF(tmp);
-            return PyErr_NoMemory();
-            /* LCOV_EXCL_STOP */
+        if (!next || next > max_leaves || n + next > cap) {
+            break;
         }
-        Py_DECREF(tmp);
-        return (PyObject *)newobj;
+        for (size_t i = levels[depth - 1], end = n; i < end; i++) {
+            if (mul_arity(&nodes[i]) && mul_split(nodes, i, &n)) {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+        }
+        levels[++depth] = n;
     }
-    if (argc == 0) {
-        return (PyObject *)MPZ_new();
+    if (mul_run(nodes, index, 0, n, true, mul_leaf_task, threads)) {
+        goto end; /* LCOV_EXCL_LINE */
     }
-    if (argc == 1 && !keywds) {
-        arg = PyTuple_GET_ITEM(args, 0);
-        return new_impl(type, arg, Py_None);
+    /* Operands aren't needed anymore. */
+    for (size_t i = 0; i < n; i++) {
+        if (nodes[i].own_a) {
+            zz_clear(&nodes[i].a);
+            nodes[i].own_a = false;
+        }
+        if (nodes[i].own_b) {
+            zz_clear(&nodes[i].b);
+            nodes[i].own_b = false;
+        }
     }
-    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|O",
-                                     kwlist, &arg, &base))
-    {
-        return NULL;
+    for (size_t d = depth - 1; d-- > 0;) {
+        if (mul_run(nodes, index, levels[d], levels[d + 1], false,
+                    mul_combine_task, threads))
+        {
+            goto end; /* LCOV_EXCL_LINE */
+        }
     }
-    return new_impl(type, arg, base);
+
+    zz_t tmp = *w;
+
+    *w = nodes[0].w;
+    nodes[0].w = tmp;
+    ret = negative ? zz_neg(w, w) : ZZ_OK;
+end:
+    for (size_t i = 0; nodes && i < n; i++) {
+        mul_node_clear(&nodes[i]);
+    }
+    free(nodes);
+    free(levels);
+    free(index);
+    return ret;
+}
+
+/* Same as zz_mul_threads(), but operands with less than parallel_limbs
+   limbs are multiplied on one thread. */
+static zz_err
+mul_threads(const zz_t *u, const zz_t *v, zz_t *w, size_t threads)
+{
+    if (Py_MIN(u->size, v->size) < parallel_limbs) {
+        threads = 1;
+    }
+    return zz_mul_threads(u, v, w, threads);
 }
 
+typedef struct {
+    zz_t *items;
+    zz_err *rets;
+    size_t threads;  /* for each multiplication */
+} prod_data;
+
 static void
-dealloc(PyObject *self)
+prod_pair_task(void *data, size_t i)
 {
-    MPZ_Object *u = (MPZ_Object *)self;
-    PyTypeObject *type = Py_TYPE(self);
+    const prod_data *d = data;
+    zz_t *u = &d->items[2*i], *v = &d->items[2*i + 1];
 
-    if (global.gmp_cache_size < CACHE_SIZE
-        && (u->z).alloc <= MAX_CACHE_MPZ_LIMBS
-        && MPZ_CheckExact(self))
-    {
-        global.gmp_cache[(global.gmp_cache_size)++] = u;
-    }
-    else {
-        zz_clear(&u->z);
-        type->tp_free(self);
-    }
+    d->rets[i] = mul_threads(u, v, u, d->threads);
+    zz_clear(v);
 }
 
-static PyObject *
-vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
-           PyObject *kwnames)
+/* Multiply n > 0 values of items with a balanced product tree on (at most)
+   the given number of threads.  Values are multiplied in adjacent pairs,
+   level by level, each level in parallel.  The product is left in
+   items[0], other values are cleared (even on failures).  Doesn't use the
+   Python C-API. */
+static zz_err
+zz_prod_threads(zz_t *items, size_t n, size_t threads)
 {
-    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
-    static const char *const keywords[] = {"", "base"};
-    const static gmp_pyargs fnargs = {
-        .keywords = keywords,
-        .maxpos = 2,
-        .minargs = 0,
-        .maxargs = 2,
-        .fname = "mpz",
-    };
-    Py_ssize_t argidx[2] = {-1, -1};
+    zz_err *rets = malloc((n/2 + 1)*sizeof(zz_err));
+    zz_err ret = rets ? ZZ_OK : ZZ_MEM;
 
-    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
-        return NULL;
-    }
-    if (argidx[1] >= 0) {
-        return new_impl((PyTypeObject *)type, args[argidx[0]],
-                        args[argidx[1]]);
-    }
-    else if (argidx[0] >= 0) {
-        return new_impl((PyTypeObject *)type, args[argidx[0]], Py_None);
+    while (ret == ZZ_OK && n > 1) {
+        size_t pairs = n/2, level_threads = threads;
+        prod_data data = {items, rets, Py_MAX(threads/pairs, 1)};
+        zz_size_t limbs = 0;
+
+        /* Small levels aren't worth starting threads. */
+        for (size_t i = 0; i < n; i++) {
+            limbs += items[i].size;
+        }
+        if (limbs < parallel_limbs) {
+            level_threads = 1;
+        }
+        gmp_parallel_for(pairs, level_threads, prod_pair_task, &data);
+        for (size_t i = 0; i < pairs; i++) {
+            if (rets[i]) {
+                ret = ZZ_MEM; /* LCOV_EXCL_LINE */
+            }
+            items[i] = items[2*i];
+        }
+        if (n % 2) {
+            items[pairs] = items[n - 1];
+        }
+        n = pairs + n % 2;
     }
-    else {
-        return (PyObject *)MPZ_new();
+    while (n-- > 1) {
+        zz_clear(&items[n]); /* LCOV_EXCL_LINE */
     }
+    free(rets);
+    return ret;
 }
 
-static PyObject *
-repr(PyObject *self)
+/* Parallel conversion to and from strings.  Values are split (or joined)
+   along a complete binary tree of depth t with powers pw[i] = base**(d*2**i)
+   of the base, where leaves have d digits and are converted by zz functions.
+   The t is picked to have at least two leaves per thread.  Nodes are kept in
+   an array, children of the node k are 2*k + 1 (high part) and 2*k + 2 (low
+   part). */
+
+/* Set t and d for the given number of digits, return false if it's too
+   small for splitting. */
+static bool
+str_split(size_t digits, size_t threads, size_t *t, size_t *d)
 {
-    return MPZ_to_str((MPZ_Object *)self, 10, OPT_TAG);
+    *t = 0;
+    while (((size_t)1 << *t) < 2*threads && ((size_t)2 << *t) <= digits) {
+        (*t)++;
+    }
+    *d = (digits + ((size_t)1 << *t) - 1) >> *t;
+    return *t > 0;
 }
 
-static PyObject *
-str(PyObject *self)
+typedef struct {
+    zz_t x;
+    bool own;       /* x is initialized */
+    bool leading;   /* digits aren't padded with zeros */
+    bool empty;     /* no digits (zeros before leading ones) */
+    size_t len;     /* number of digits for the leading leaf */
+    zz_err ret;
+} str_node;
+
+typedef struct {
+    str_node *nodes;
+    const zz_t *pw;  /* the power of the base for the current level */
+    int8_t base;
+    int8_t *str;
+    size_t first;    /* the first node of the current level */
+    size_t leaves;
+    size_t width;    /* digits in leaves */
+    size_t digits;
+    size_t threads;  /* for each multiplication */
+} str_data;
+
+static void
+str_nodes_clear(str_node *nodes, size_t n)
 {
-    return MPZ_to_str((MPZ_Object *)self, 10, 0);
+    for (size_t i = 0; i < n; i++) {
+        if (nodes[i].own) {
+            zz_clear(&nodes[i].x);
+            nodes[i].own = false;
+        }
+    }
 }
 
-#define Number_Check(op) (PyFloat_Check((op)) || PyComplex_Check((op)))
+/* Allocate nodes and powers of the base, return false on failures. */
+static bool
+str_tree_init(size_t t, size_t d, int8_t base, size_t threads,
+              str_node **nodes, zz_t **pw)
+{
+    size_t k = 0;
 
-#define CHECK_OP(u, a)          \
-    if (MPZ_Check(a)) {         \
-        u = (MPZ_Object *)a;    \
-        Py_INCREF(u);           \
-    }                           \
-    else if (PyLong_Check(a)) { \
-        u = MPZ_from_int(a);    \
-        if (!u) {               \
-            goto end;           \
-        }                       \
-    }                           \
-    else if (Number_Check(a)) { \
-        goto numbers;           \
-    }                           \
-    else {                      \
-        goto fallback;          \
+    *nodes = calloc(((size_t)2 << t) - 1, sizeof(str_node));
+    *pw = calloc(t, sizeof(zz_t));
+    if (!*nodes || !*pw) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    for (; k < t; k++) {
+        if (zz_init(&(*pw)[k])) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
     }
+    zz_t tmp;
 
-PyObject *
-to_float(PyObject *self)
-{
-    double d;
-    MPZ_Object *u = (MPZ_Object *)self;
-    zz_err ret = zz_to_double(&u->z, &d);
+    if (zz_init(&tmp)) {
+        goto err; /* LCOV_EXCL_LINE */
+    }
+    if (zz_from_sl(base < 0 ? -base : base, &tmp)
+        || zz_pow(&tmp, d, &(*pw)[0]))
+    {
+        /* LCOV_EXCL_START */
+        zz_clear(&tmp);
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    zz_clear(&tmp);
+    for (size_t i = 1; i < t; i++) {
+        if (mul_threads(&(*pw)[i - 1], &(*pw)[i - 1], &(*pw)[i], threads)) {
+            goto err; /* LCOV_EXCL_LINE */
+        }
+    }
+    return true;
+    /* LCOV_EXCL_START */
+err:
+    while (*pw && k--) {
+        zz_clear(&(*pw)[k]);
+    }
+    free(*nodes);
+    free(*pw);
+    return false;
+    /* LCOV_EXCL_STOP */
+}
 
-    if (ret == ZZ_BUF) {
-        PyErr_SetString(PyExc_OverflowError,
-                        "integer too large to convert to float");
-        return NULL;
+static void
+str_tree_clear(size_t t, str_node *nodes, zz_t *pw)
+{
+    str_nodes_clear(nodes, ((size_t)2 << t) - 1);
+    for (size_t i = 0; i < t; i++) {
+        zz_clear(&pw[i]);
     }
-    return PyFloat_FromDouble(d);
+    free(nodes);
+    free(pw);
 }
 
-static inline zz_slimb_t
-PyLong_AsSlimb_t(PyObject *obj, int *error)
+static void
+to_str_split_task(void *data, size_t i)
 {
-#if SIZEOF_LONG == 8
-    long value = PyLong_AsLongAndOverflow(obj, error);
-#else
-    long long value = PyLong_AsLongLongAndOverflow(obj, error);
-#endif
-    Py_BUILD_ASSERT(sizeof(value) == sizeof(int64_t));
-    if (!error && (ZZ_SLIMB_T_MIN > value || value > ZZ_SLIMB_T_MAX)) {
-        *error = 1;
+    const str_data *d = data;
+    size_t k = d->first + i;
+    str_node *node = &d->nodes[k];
+    str_node *hi = &d->nodes[2*k + 1], *lo = &d->nodes[2*k + 2];
+
+    hi->empty = lo->empty = node->empty;
+    node->ret = ZZ_OK;
+    if (node->empty) {
+        return;
+    }
+    if (zz_init(&hi->x)) {
+        node->ret = ZZ_MEM; /* LCOV_EXCL_LINE */
+        return; /* LCOV_EXCL_LINE */
+    }
+    hi->own = true;
+    if (zz_init(&lo->x)) {
+        node->ret = ZZ_MEM; /* LCOV_EXCL_LINE */
+        return; /* LCOV_EXCL_LINE */
+    }
+    lo->own = true;
+    node->ret = zz_div(&node->x, d->pw, &hi->x, &lo->x);
+    if (node->leading) {
+        hi->empty = zz_iszero(&hi->x);
+        hi->leading = !hi->empty;
+        lo->leading = hi->empty;
+    }
+    if (node->own) {
+        zz_clear(&node->x);
+        node->own = false;
     }
-    return (zz_slimb_t)value;
 }
 
-static PyObject *
-richcompare(PyObject *self, PyObject *other, int op)
+static void
+to_str_leaf_task(void *data, size_t j)
 {
-    MPZ_Object *u = (MPZ_Object *)self;
-    zz_ord r;
+    const str_data *d = data;
+    str_node *node = &d->nodes[d->first + j];
+    int8_t *p = d->str + d->digits - (d->leaves - j)*d->width;
+    size_t len;
 
-    if (MPZ_Check(other)) {
-        r = zz_cmp(&u->z, &((MPZ_Object *)other)->z);
+    node->ret = ZZ_OK;
+    if (node->empty) {
+        return;
     }
-    else if (PyLong_Check(other)) {
-        int error;
-        zz_slimb_t temp = PyLong_AsSlimb_t(other, &error);
+    if (node->leading) {
+        node->ret = zz_to_str(&node->x, d->base, d->str, &node->len);
+        return;
+    }
+    node->ret = zz_to_str(&node->x, d->base, p, &len);
+    if (node->ret == ZZ_OK && len < d->width) {
+        memmove(p + d->width - len, p, len);
+        memset(p, '0', d->width - len);
+    }
+}
 
-        if (!error) {
-            r = zz_cmp_sl(&u->z, temp);
-        }
-        else {
-            MPZ_Object *v = MPZ_from_int(other);
+/* Same as zz_to_str(), but on (at most) the given number of threads.
+   Nonnegative leaves are converted to their places in the str, except for
+   the leading one, written to the beginning of the str and followed by
+   others at the end.  Doesn't use the Python C-API. */
+static zz_err
+zz_to_str_threads(const zz_t *u, int8_t base, int8_t *str, size_t *len,
+                  size_t threads)
+{
+    size_t digits, t, d;
+    str_node *nodes;
+    zz_t *pw;
 
-            if (!v) {
+    if (threads < 2 || zz_sizeinbase(u, base, &digits)
+        || !str_split(digits, threads, &t, &d)
+        || !str_tree_init(t, d, base, threads, &nodes, &pw))
+    {
+        return zz_to_str(u, base, str, len);
+    }
+
+    zz_err ret = ZZ_MEM;
+    size_t leaves = (size_t)1 << t;
+    str_data data = {nodes, NULL, base, str + zz_isneg(u), 0, leaves, d,
+                     digits, 1};
+
+    if (zz_isneg(u)) {
+        str[0] = '-';
+    }
+    nodes[0].x = *u;
+    nodes[0].x.negative = false;
+    nodes[0].leading = true;
+    for (size_t l = 0; l < t; l++) {
+        data.pw = &pw[t - 1 - l];
+        data.first = ((size_t)1 << l) - 1;
+        gmp_parallel_for((size_t)1 << l, threads, to_str_split_task, &data);
+        for (size_t k = data.first; k < 2*data.first + 1; k++) {
+            if (nodes[k].ret) {
                 goto end; /* LCOV_EXCL_LINE */
             }
-            r = zz_cmp(&u->z, &v->z);
-            Py_DECREF(v);
         }
     }
-    else if (Number_Check(other)) {
-        goto numbers;
-    }
-    else {
-        goto fallback;
-    }
-    switch (op) {
-        case Py_LT:
-            return PyBool_FromLong(r == ZZ_LT);
-        case Py_LE:
-            return PyBool_FromLong(r != ZZ_GT);
-        case Py_GT:
-            return PyBool_FromLong(r == ZZ_GT);
-        case Py_GE:
-            return PyBool_FromLong(r != ZZ_LT);
-        case Py_EQ:
-            return PyBool_FromLong(r == ZZ_EQ);
-        case Py_NE:
-            return PyBool_FromLong(r != ZZ_EQ);
-    }
-    /* LCOV_EXCL_START */
-end:
-    return NULL;
-    /* LCOV_EXCL_STOP */
-fallback:
-    Py_RETURN_NOTIMPLEMENTED;
-numbers:
-    self = to_float(self);
-    if (!self) {
-        return NULL; /* LCOV_EXCL_LINE */
+    data.first = leaves - 1;
+    gmp_parallel_for(leaves, threads, to_str_leaf_task, &data);
+
+    size_t j = 0;
+
+    for (; j < leaves; j++) {
+        const str_node *node = &nodes[data.first + j];
+
+        if (node->ret) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        if (node->leading) {
+            break;
+        }
     }
 
-    PyObject *res = PyObject_RichCompare(self, other, op);
+    /* Move trailing digits to the leading ones. */
+    size_t tail = (leaves - j - 1)*d, lead = nodes[data.first + j].len;
 
-    Py_DECREF(self);
-    return res;
+    memmove(data.str + lead, data.str + digits - tail, tail);
+    *len = lead + tail + zz_isneg(u);
+    ret = ZZ_OK;
+end:
+    str_tree_clear(t, nodes, pw);
+    return ret;
 }
 
-static Py_hash_t
-hash(PyObject *self)
+static void
+from_str_leaf_task(void *data, size_t j)
 {
-    MPZ_Object *u = (MPZ_Object *)self;
+    const str_data *d = data;
+    str_node *node = &d->nodes[d->first + j];
+    size_t after = (d->leaves - j - 1)*d->width; /* digits after the leaf */
+
+    node->ret = zz_init(&node->x);
+    node->own = node->ret == ZZ_OK;
+    if (node->own && after < d->digits) {
+        size_t end = d->digits - after;
+        size_t start = end > d->width ? end - d->width : 0;
+
+        node->ret = zz_from_str(d->str + start, end - start, d->base,
+                                &node->x);
+    }
+}
 
-    if (u->hash_cache != -1) {
-        return u->hash_cache;
+static void
+from_str_join_task(void *data, size_t i)
+{
+    const str_data *d = data;
+    size_t k = d->first + i;
+    str_node *node = &d->nodes[k], *hi = &d->nodes[2*k + 1];
+
+    node->ret = zz_init(&node->x);
+    node->own = node->ret == ZZ_OK;
+    if (node->own && (mul_threads(&hi[0].x, d->pw, &node->x, d->threads)
+                      || zz_add(&node->x, &hi[1].x, &node->x)))
+    {
+        node->ret = ZZ_MEM; /* LCOV_EXCL_LINE */
     }
+    str_nodes_clear(hi, 2);
+}
 
-    bool negative = zz_isneg(&u->z);
+/* Return the first error of nodes in [start, end). */
+static zz_err
+str_nodes_ret(const str_node *nodes, size_t start, size_t end)
+{
+    for (size_t k = start; k < end; k++) {
+        if (nodes[k].ret) {
+            return nodes[k].ret;
+        }
+    }
+    return ZZ_OK;
+}
 
-    if (negative) {
-        (void)zz_abs(&u->z, &u->z);
+/* Same as zz_from_str(), but on (at most) the given number of threads.
+   Strings with underscores or signs (except for the leading minus) aren't
+   split.  Doesn't use the Python C-API. */
+static zz_err
+zz_from_str_threads(const int8_t *str, size_t len, int8_t base, zz_t *u,
+                    size_t threads)
+{
+    bool negative = len && str[0] == '-';
+    size_t digits = len - negative, t, d;
+    const int8_t *p = str + negative;
+    str_node *nodes;
+    zz_t *pw;
+
+    if (threads < 2 || memchr(p, '_', digits) || memchr(p, '-', digits)
+        || memchr(p, '+', digits) || !str_split(digits, threads, &t, &d)
+        || !str_tree_init(t, d, base, threads, &nodes, &pw))
+    {
+        return zz_from_str(str, len, base, u);
     }
 
-    zz_limb_t digits[1];
-    zz_t w = {false, 1, 1, digits};
+    size_t leaves = (size_t)1 << t;
+    str_data data = {nodes, NULL, base, (int8_t *)p, leaves - 1, leaves, d,
+                     digits, 1};
 
-    assert((int64_t)INT64_MAX > PyHASH_MODULUS);
-    (void)zz_div_sl(&u->z, (zz_slimb_t)PyHASH_MODULUS, NULL, &w);
+    gmp_parallel_for(leaves, threads, from_str_leaf_task, &data);
 
-    Py_hash_t r = w.size ? (Py_hash_t)w.digits[0] : 0;
+    zz_err ret = str_nodes_ret(nodes, leaves - 1, 2*leaves - 1);
 
-    if (negative) {
-        (void)zz_neg(&u->z, &u->z);
-        r = -r;
-    }
-    if (r == -1) {
-        r = -2;
+    for (size_t l = t; ret == ZZ_OK && l-- > 0;) {
+        data.pw = &pw[t - 1 - l];
+        data.first = ((size_t)1 << l) - 1;
+        data.threads = Py_MAX(threads >> l, 1);
+        gmp_parallel_for((size_t)1 << l, threads, from_str_join_task,
+                         &data);
+        ret = str_nodes_ret(nodes, data.first, 2*data.first + 1);
     }
-    return u->hash_cache = r;
-}
+    if (ret == ZZ_OK) {
+        zz_t tmp = *u;
 
-#define UNOP(suff, func)                           \
-    static PyObject *                              \
-    func(PyObject *self)                           \
-    {                                              \
-        MPZ_Object *u = (MPZ_Object *)self;        \
-        MPZ_Object *res = MPZ_new();               \
-                                                   \
-        if (res && zz_##suff(&u->z, &res->z)) {    \
-            PyErr_NoMemory(); /* LCOV_EXCL_LINE */ \
-        }                                          \
-        return (PyObject *)res;                    \
+        *u = nodes[0].x;
+        nodes[0].x = tmp;
+        if (negative) {
+            ret = zz_neg(u, u);
+        }
     }
+    str_tree_clear(t, nodes, pw);
+    return ret;
+}
 
-UNOP(copy, plus)
-UNOP(neg, nb_negative)
-UNOP(abs, nb_absolute)
-UNOP(invert, nb_invert)
+static const char *MPZ_TAG = "mpz(";
+static int OPT_TAG = 0x1;
+int OPT_PREFIX = 0x2;
 
 PyObject *
-to_int(PyObject *self)
-{
-    return MPZ_to_int((MPZ_Object *)self);
-}
-
-static int
-to_bool(PyObject *self)
+MPZ_to_str(MPZ_Object *u, int base, int options)
 {
-    return !zz_iszero(&((MPZ_Object *)self)->z);
-}
+    size_t len;
+    bool negative = zz_isneg(&u->z), cast_abs = false;
 
-#define CHECK_OPv2(u, a)        \
-    if (MPZ_Check(a)) {         \
-        u = (MPZ_Object *)a;    \
-        Py_INCREF(u);           \
-    }                           \
-    else if (PyLong_Check(a)) { \
-        ;                       \
-    }                           \
-    else if (Number_Check(a)) { \
-        goto numbers;           \
-    }                           \
-    else {                      \
-        goto fallback;          \
+    if ((base < INT8_MIN || base > INT8_MAX)
+        || zz_sizeinbase(&u->z, (int8_t)base, &len))
+    {
+        PyErr_SetString(PyExc_ValueError,
+                        "mpz base must be >= 2 and <= 36");
+        return NULL;
     }
-
-#define BINOP(suff, slot)                                       \
-    static PyObject *                                           \
-    nb_##suff(PyObject *self, PyObject *other)                  \
-    {                                                           \
-        MPZ_Object *u = NULL, *v = NULL, *res = NULL;           \
-                                                                \
-        CHECK_OPv2(u, self);                                    \
-        CHECK_OPv2(v, other);                                   \
-                                                                \
-        res = MPZ_new();                                        \
-        if (!res) {                                             \
-            goto end;                                           \
-        }                                                       \
-                                                                \
-        zz_err ret = ZZ_OK;                                     \
-                                                                \
-        if (!u) {                                               \
-            int error;                                          \
-            zz_slimb_t temp = PyLong_AsSlimb_t(self, &error);   \
-                                                                \
-            if (!error) {                                       \
-                ret = zz_sl_##suff(temp, &v->z, &res->z);       \
-                goto done;                                      \
-            }                                                   \
-            u = MPZ_from_int(self);                             \
-            if (!u) {                                           \
-                goto end;                                       \
-            }                                                   \
-        }                                                       \
-        if (!v) {                                               \
-            int error;                                          \
-            zz_slimb_t temp = PyLong_AsSlimb_t(other, &error);  \
-                                                                \
-            if (!error) {                                       \
-                ret = zz_##suff##_sl(&u->z, temp, &res->z);     \
-                goto done;                                      \
-            }                                                   \
-            v = MPZ_from_int(other);                            \
-            if (!v) {                                           \
-                goto end;                                       \
-            }                                                   \
-        }                                                       \
-        ret = zz_##suff(&u->z, &v->z, &res->z);                 \
-done:                                                           \
-        if (ret == ZZ_OK) {                                     \
-            goto end;                                           \
-        }                                                       \
-        if (ret == ZZ_VAL) {                                    \
-            Py_CLEAR(res);                                      \
-            PyErr_SetString(PyExc_ZeroDivisionError,            \
-                            "division by zero");                \
-        }                                                       \
-        else {                                                  \
-            Py_CLEAR(res);                                      \
-            PyErr_NoMemory();                                   \
-        }                                                       \
-    end:                                                        \
-        Py_XDECREF(u);                                          \
-        Py_XDECREF(v);                                          \
-        return (PyObject *)res;                                 \
-    fallback:                                                   \
-        Py_XDECREF(u);                                          \
-        Py_XDECREF(v);                                          \
-        Py_RETURN_NOTIMPLEMENTED;                               \
-    numbers:                                                    \
-        Py_XDECREF(u);                                          \
-        Py_XDECREF(v);                                          \
-                                                                \
-        PyObject *uf, *vf, *rf;                                 \
-                                                                \
-        if (Number_Check(self)) {                               \
-            uf = self;                                          \
-            Py_INCREF(uf);                                      \
-        }                                                       \
-        else {                                                  \
-            uf = to_float(self);                                \
-            if (!uf) {                                          \
-                return NULL;                                    \
-            }                                                   \
-        }                                                       \
-        if (Number_Check(other)) {                              \
-            vf = other;                                         \
-            Py_INCREF(vf);                                      \
-        }                                                       \
-        else {                                                  \
-            vf = to_float(other);                               \
-            if (!vf) {                                          \
-                Py_DECREF(uf);                                  \
-                return NULL;                                    \
-            }                                                   \
-        }                                                       \
-        rf = slot(uf, vf);                                      \
-        Py_DECREF(uf);                                          \
-        Py_DECREF(vf);                                          \
-        return rf;                                              \
+    len += negative;
+    if (options & OPT_TAG) {
+        len += strlen(MPZ_TAG) + 1;
     }
+    if (options & OPT_PREFIX) {
+        len += 2;
+    }
+    len++;
 
-#define zz_sl_add(x, y, r) zz_add_sl((y), (x), (r))
-#define zz_sl_mul(x, y, r) zz_mul_sl((y), (x), (r))
-
-BINOP(add, PyNumber_Add)
-BINOP(sub, PyNumber_Subtract)
-BINOP(mul, PyNumber_Multiply)
+    int8_t *buf = malloc(len), *p = buf;
 
-static inline zz_err
-zz_quo_(const zz_t *u, const zz_t *v, zz_t *w)
-{
-    return zz_div(u, v, w, NULL);
-}
+    if (!buf) {
+        return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+    if (options & OPT_TAG) {
+        strcpy((char *)p, MPZ_TAG);
+        p += strlen(MPZ_TAG);
+    }
+    if (options & OPT_PREFIX) {
+        if (negative) {
+            *(p++) = '-';
+            cast_abs = true;
+        }
+        if (base == 2) {
+            *(p++) = '0';
+            *(p++) = 'b';
+        }
+        else if (base == 8) {
+            *(p++) = '0';
+            *(p++) = 'o';
+        }
+        else if (base == 16) {
+            *(p++) = '0';
+            *(p++) = 'x';
+        }
+        else if (base == -16) {
+            *(p++) = '0';
+            *(p++) = 'X';
+        }
+    }
 
-static inline zz_err
-zz_rem_(const zz_t *u, const zz_t *v, zz_t *w)
-{
-    return zz_div(u, v, NULL, w);
-}
+    zz_err ret;
+    size_t threads = u->z.size < parallel_limbs ? 1 : parallel_threads;
 
-static inline zz_err
-zz_sl_quo_(zz_slimb_t u, const zz_t *v, zz_t *w)
-{
-    return zz_sl_div(u, v, w, NULL);
-}
+    if (cast_abs) {
+        /* The sign was already written, but zz_to_str() puts it in front
+           of digits.  Let it overwrite the last character of the prefix
+           and then restore one. */
+        int8_t c = *(--p);
 
-static inline zz_err
-zz_quo__sl(const zz_t *u, zz_slimb_t v, zz_t *w)
-{
-    return zz_div_sl(u, v, w, NULL);
+        NOGIL_IF(MPZ_nogil(u, NULL, (double)u->z.size*(double)u->z.size),
+                 ret = zz_to_str_threads(&u->z, (int8_t)base, p, &len,
+                                         threads))
+        *p = c;
+    }
+    else {
+        NOGIL_IF(MPZ_nogil(u, NULL, (double)u->z.size*(double)u->z.size),
+                 ret = zz_to_str_threads(&u->z, (int8_t)base, p, &len,
+                                         threads))
+    }
+    if (ret) {
+        /* LCOV_EXCL_START */
+        free(buf);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    p += len;
+    if (options & OPT_TAG) {
+        *(p++) = ')';
+    }
+    *(p++) = '\0';
+
+    PyObject *res = PyUnicode_FromString((char *)buf);
+
+    free(buf);
+    return res;
+}
+
+static MPZ_Object *
+MPZ_from_str(PyObject *obj, int base)
+{
+    Py_ssize_t len;
+    int8_t *str = (int8_t *)PyUnicode_AsUTF8AndSize(obj, &len);
+
+    if (!str) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    if (base < 0 || base > INT8_MAX) {
+        goto bad_base;
+    }
+    while (len && isspace(*str)) {
+        str++;
+        len--;
+    }
+
+    bool cast_negative = (str[0] == '-');
+
+    str += cast_negative;
+    len -= cast_negative;
+    if (len && str[0] == '+') {
+        str++;
+        len--;
+    }
+    if (str[0] == '0' && len >= 2) {
+        if (base == 0) {
+            if (tolower(str[1]) == 'b') {
+                base = 2;
+            }
+            else if (tolower(str[1]) == 'o') {
+                base = 8;
+            }
+            else if (tolower(str[1]) == 'x') {
+                base = 16;
+            }
+            else {
+                goto err;
+            }
+        }
+        if ((tolower(str[1]) == 'b' && base == 2)
+            || (tolower(str[1]) == 'o' && base == 8)
+            || (tolower(str[1]) == 'x' && base == 16))
+        {
+            str += 2;
+            len -= 2;
+            if (len && str[0] == '_') {
+                str++;
+                len--;
+            }
+        }
+        else {
+            goto skip_negation;
+        }
+    }
+    else {
+skip_negation:
+        str -= cast_negative;
+        len += cast_negative;
+        cast_negative = false;
+    }
+    if (base == 0) {
+        base = 10;
+    }
+
+    int8_t *end = str + len - 1;
+
+    while (len > 0 && isspace(*end)) {
+        end--;
+        len--;
+    }
+
+    int bits_per_digit = 1;
+
+    while ((1 << bits_per_digit) < base) {
+        bits_per_digit++;
+    }
+
+    MPZ_Object *res = MPZ_new((zz_size_t)((size_t)len*(size_t)bits_per_digit
+                                          / ZZ_LIMB_T_BITS) + 1);
+
+    if (!res) {
+        return (MPZ_Object *)PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+
+    zz_err ret;
+    size_t threads = parallel_threads;
+
+    if ((size_t)len*(size_t)bits_per_digit/ZZ_LIMB_T_BITS
+        < (size_t)parallel_limbs)
+    {
+        threads = 1;
+    }
+    /* The string is owned by an immutable object. */
+    NOGIL_IF(MPZ_nogil(NULL, NULL, (double)res->z.alloc*(double)res->z.alloc),
+             ret = zz_from_str_threads(str, (size_t)len, (int8_t)base,
+                                       &res->z, threads))
+
+    if (ret == ZZ_MEM) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return (MPZ_Object *)PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    else if (ret == ZZ_VAL) {
+        Py_DECREF(res);
+        if (2 <= base && base <= 36) {
+err:
+            PyErr_Format(PyExc_ValueError,
+                         "invalid literal for mpz() with base %d: %.200R",
+                         base, obj);
+        }
+        else {
+bad_base:
+            PyErr_SetString(PyExc_ValueError,
+                            "mpz base must be >= 2 and <= 36, or 0");
+        }
+        return NULL;
+    }
+    if (cast_negative) {
+        (void)zz_neg(&res->z, &res->z);
+    }
+    return res;
+}
+
+#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON) \
+    && !defined(Py_LIMITED_API)
+#  define HAVE_LONG_EXPORT 1
+
+/* Number of limbs for the value of an exported int. */
+static zz_size_t
+export_size(const PyLongExport *long_export)
+{
+    if (long_export->digits) {
+        const zz_layout *int_layout = (zz_layout *)PyLong_GetNativeLayout();
+
+        return (zz_size_t)(((size_t)long_export->ndigits
+                            * int_layout->bits_per_limb)
+                           / ZZ_LIMB_T_BITS) + 1;
+    }
+    return 1;
+}
+
+/* Set u to the value of an exported int.  Releases the export. */
+static zz_err
+zz_from_export(PyLongExport *long_export, zz_t *u)
+{
+    zz_err ret;
+
+    if (long_export->digits) {
+        const zz_layout *int_layout = (zz_layout *)PyLong_GetNativeLayout();
+
+        ret = zz_import((size_t)long_export->ndigits, long_export->digits,
+                        *int_layout, u);
+        if (ret == ZZ_OK && long_export->negative) {
+            (void)zz_neg(u, u);
+        }
+        PyLong_FreeExport(long_export);
+    }
+    else {
+        ret = zz_from_sl(long_export->value, u);
+    }
+    return ret;
+}
+#endif
+
+static MPZ_Object *
+MPZ_from_int(PyObject *obj)
+{
+#if defined(HAVE_LONG_EXPORT)
+    PyLongExport long_export = {0, 0, 0, 0, 0};
+
+    if (PyLong_Export(obj, &long_export) < 0) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    MPZ_Object *res = MPZ_new(export_size(&long_export));
+
+    if (!res) {
+        /* LCOV_EXCL_START */
+        if (long_export.digits) {
+            PyLong_FreeExport(&long_export);
+        }
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_from_export(&long_export, &res->z)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return (MPZ_Object *)PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    return res;
+#else
+    int64_t value;
+
+    if (!PyLong_AsInt64(obj, &value)) {
+        MPZ_Object *res = MPZ_new(1);
+
+        if (res && zz_from_sl(value, &res->z)) {
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        }
+        return res;
+    }
+    PyErr_Clear();
+
+    PyObject *str = PyNumber_ToBase(obj, 16);
+
+    if (!str) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    MPZ_Object *res = MPZ_from_str(str, 16);
+
+    Py_DECREF(str);
+    return res;
+#endif
+}
+
+/* Return a new reference to an mpz with the value of obj (an int operand),
+   as MPZ_from_int() does.  The value is kept in one of few thread-local
+   objects, which aren't referenced elsewhere, so the import reuses their
+   limb buffers and no object is created.  The result must not outlive the
+   operation: it's not shared with the caller, if it escapes somewhere, but
+   its limbs are reused by the next operation otherwise. */
+static MPZ_Object *
+MPZ_borrow_int(PyObject *obj)
+{
+#if defined(HAVE_LONG_EXPORT) \
+    && (!defined(Py_GIL_DISABLED) || PY_VERSION_HEX >= 0x030E0000)
+    if (!PyLong_Check(obj)) {
+        return MPZ_from_int(obj);
+    }
+
+    PyLongExport long_export = {0, 0, 0, 0, 0};
+
+    if (PyLong_Export(obj, &long_export) < 0) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    zz_size_t size = export_size(&long_export);
+    MPZ_Object *res = NULL;
+
+    /* Don't hold big buffers, same as the cache. */
+    for (size_t i = 0; i < INT_OPERANDS && size <= cache_max_limbs; i++) {
+        MPZ_Object **p = &global.int_operands[i];
+
+        if (!*p) {
+            *p = MPZ_new(size);
+            if (!*p) {
+                PyErr_Clear(); /* LCOV_EXCL_LINE */
+                break; /* LCOV_EXCL_LINE */
+            }
+        }
+        if (MPZ_IsUnique((PyObject *)*p)) {
+            res = (MPZ_Object *)Py_NewRef(*p);
+            break;
+        }
+    }
+    if (!res) {
+        res = MPZ_new(size);
+    }
+    if (!res) {
+        /* LCOV_EXCL_START */
+        if (long_export.digits) {
+            PyLong_FreeExport(&long_export);
+        }
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_from_export(&long_export, &res->z)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return (MPZ_Object *)PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    return res;
+#else
+    return MPZ_from_int(obj);
+#endif
+}
+
+/* Same as MPZ_copy(), but u is locked while being copied, as an xmpz may
+   be changed by other threads. */
+static MPZ_Object *
+MPZ_copy_locked(PyObject *u)
+{
+    MPZ_Object *res;
+
+    Py_BEGIN_CRITICAL_SECTION(u);
+    res = MPZ_copy((MPZ_Object *)u);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+/* Return a new reference to an (immutable) mpz with the value of the integer
+   obj.  Unlike MPZ_borrow_int(), the result can be kept. */
+static MPZ_Object *
+MPZ_own(PyObject *obj)
+{
+    if (MPZ_CheckExact(obj)) {
+        return (MPZ_Object *)Py_NewRef(obj);
+    }
+    if (MPZ_Check(obj)) {
+        return MPZ_finish(MPZ_copy_locked(obj));
+    }
+    return MPZ_finish(MPZ_from_int(obj));
+}
+
+/* Return a new reference to the mpz operand a, which value is not changed
+   until released.  With the GIL, an xmpz operand can't be changed by other
+   threads while it's used by a function, which doesn't release the GIL;
+   otherwise it's copied. */
+static MPZ_Object *
+MPZ_operand(PyObject *a)
+{
+#if defined(Py_GIL_DISABLED)
+    if (XMPZ_Check(a)) {
+        return MPZ_finish(MPZ_copy_locked(a));
+    }
+#endif
+    return (MPZ_Object *)Py_NewRef(a);
+}
+
+/* Free thread-local objects for int operands. */
+static void
+int_operands_clear(void)
+{
+    for (size_t i = 0; i < INT_OPERANDS; i++) {
+        MPZ_Object **p = &global.int_operands[i];
+
+        if (*p && MPZ_IsUnique((PyObject *)*p)) {
+            Py_CLEAR(*p);
+        }
+    }
+}
+
+static PyObject *
+MPZ_to_int(MPZ_Object *u)
+{
+    zz_slimb_t value;
+
+    if (zz_to_sl(&u->z, &value) == ZZ_OK) {
+        return PyLong_FromInt64(value);
+    }
+
+#if !defined(PYPY_VERSION) && !defined(GRAALVM_PYTHON) \
+    && !defined(Py_LIMITED_API)
+    const zz_layout *int_layout = (zz_layout *)PyLong_GetNativeLayout();
+    size_t size = (zz_bitlen(&u->z) + int_layout->bits_per_limb
+                   - 1)/int_layout->bits_per_limb;
+    void *digits;
+    PyLongWriter *writer = PyLongWriter_Create(zz_isneg(&u->z),
+                                               (Py_ssize_t)size, &digits);
+
+    if (!writer) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    (void)zz_export(&u->z, *int_layout, size, digits);
+    return PyLongWriter_Finish(writer);
+#else
+    size_t len;
+
+    (void)zz_sizeinbase(&u->z, 16, &len);
+    len += zz_isneg(&u->z);
+
+    int8_t *buf = malloc(len + 1);
+
+    if (zz_to_str(&u->z, 16, buf, &len)) {
+        /* LCOV_EXCL_START */
+        free(buf);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    buf[len] = '\0';
+
+    PyObject *res = PyLong_FromString((char *)buf, NULL, 16);
+
+    free(buf);
+    return res;
+#endif
+}
+
+static void
+revstr(unsigned char *s, Py_ssize_t l, Py_ssize_t r)
+{
+    while (l < r) {
+        unsigned char tmp = s[l];
+
+        s[l] = s[r];
+        s[r] = tmp;
+        l++;
+        r--;
+    }
+}
+
+static PyObject *
+MPZ_to_bytes(MPZ_Object *u, Py_ssize_t length, int is_little, int is_signed)
+{
+    PyObject *bytes = PyBytes_FromStringAndSize(NULL, length);
+
+    if (!bytes) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    uint8_t *buffer = (uint8_t *)PyBytes_AS_STRING(bytes);
+    zz_err ret = zz_to_bytes(&u->z, (size_t)length, is_signed, &buffer);
+
+    if (ret == ZZ_OK) {
+        if (is_little && length) {
+            revstr(buffer, 0, length - 1);
+        }
+        return bytes;
+    }
+    if (ret == ZZ_BUF) {
+        if (zz_isneg(&u->z) && !is_signed) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "can't convert negative mpz to unsigned");
+        }
+        else {
+#if (PY_VERSION_HEX < 0x030D08F0 || (PY_VERSION_HEX >= 0x030E0000 \
+                                     && PY_VERSION_HEX < 0x030E00C3))
+            if (!length && zz_cmp_sl(&u->z, -1) == ZZ_EQ) {
+                return bytes;
+            }
+#endif
+            PyErr_SetString(PyExc_OverflowError, "int too big to convert");
+        }
+        Py_DECREF(bytes);
+        return NULL;
+    }
+    /* LCOV_EXCL_START */
+    Py_DECREF(bytes);
+    return PyErr_NoMemory();
+    /* LCOV_EXCL_STOP */
+}
+
+static MPZ_Object *
+MPZ_from_bytes(PyObject *obj, int is_little, int is_signed)
+{
+    PyObject *bytes = PyObject_Bytes(obj);
+    uint8_t *buffer;
+    Py_ssize_t length;
+
+    if (bytes == NULL) {
+        return NULL;
+    }
+    if (PyBytes_AsStringAndSize(bytes, (char **)&buffer, &length) == -1) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    if (!length) {
+        is_little = 0;
+    }
+    if (is_little) {
+        uint8_t *tmp = malloc((size_t)length);
+
+        if (!tmp) {
+            /* LCOV_EXCL_START */
+            Py_DECREF(bytes);
+            return (MPZ_Object *)PyErr_NoMemory();
+            /* LCOV_EXCL_STOP */
+        }
+        memcpy(tmp, buffer, (size_t)length);
+        revstr(tmp, 0, length - 1);
+        buffer = tmp;
+    }
+
+    MPZ_Object *res = MPZ_new((zz_size_t)((size_t)length
+                                          / sizeof(zz_limb_t)) + 1);
+
+    if (!res || zz_from_bytes(buffer, (size_t)length, is_signed, &res->z)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(bytes);
+        if (is_little) {
+            free(buffer);
+        }
+        Py_XDECREF(res);
+        return (MPZ_Object *)PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    if (is_little) {
+        free(buffer);
+    }
+    return res;
+}
+
+static PyObject *
+new_impl(PyTypeObject *Py_UNUSED(type), PyObject *arg, PyObject *base_arg)
+{
+    int base = 10;
+
+    if (Py_IsNone(base_arg)) {
+        if (PyLong_Check(arg)) {
+            return (PyObject *)MPZ_finish(MPZ_from_int(arg));
+        }
+        if (MPZ_CheckExact(arg)) {
+            return Py_NewRef(arg);
+        }
+        if (XMPZ_Check(arg)) {
+            return (PyObject *)MPZ_finish(MPZ_copy_locked(arg));
+        }
+        if (PyNumber_Check(arg)) {
+            PyObject *integer = NULL;
+
+            if (Py_TYPE(arg)->tp_as_number->nb_int) {
+                integer = Py_TYPE(arg)->tp_as_number->nb_int(arg);
+                if (!integer) {
+                    return NULL;
+                }
+                if (!PyLong_Check(integer)) {
+                    PyErr_Format(PyExc_TypeError,
+                                 "__int__ returned non-int (type %.200s)",
+                                 Py_TYPE(integer)->tp_name);
+                    Py_DECREF(integer);
+                    return NULL;
+                }
+                if (!PyLong_CheckExact(integer)
+                    && PyErr_WarnFormat(PyExc_DeprecationWarning, 1,
+                                        "__int__ returned non-int (type %.200s).  "
+                                        "The ability to return an instance of a "
+                                        "strict subclass of int "
+                                        "is deprecated, and may be removed "
+                                        "in a future version of Python.",
+                                        Py_TYPE(integer)->tp_name))
+                {
+                    Py_DECREF(integer);
+                    return NULL;
+                }
+            }
+            else {
+                integer = PyNumber_Index(arg);
+                if (!integer) {
+                    return NULL;
+                }
+            }
+            if (integer) {
+                Py_SETREF(integer,
+                          (PyObject *)MPZ_finish(MPZ_from_int(integer)));
+                return integer;
+            }
+        }
+        goto str;
+    }
+    else {
+        base = PyLong_AsInt(base_arg);
+        if (base == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+str:
+    if (PyUnicode_Check(arg)) {
+        PyObject *asciistr = gmp_PyUnicode_TransformDecimalAndSpaceToASCII(arg);
+
+        if (!asciistr) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+
+        PyObject *res = (PyObject *)MPZ_finish(MPZ_from_str(asciistr,
+                                                            base));
+
+        Py_DECREF(asciistr);
+        return res;
+    }
+    else if (PyByteArray_Check(arg) || PyBytes_Check(arg)) {
+        const char *string;
+
+        if (PyByteArray_Check(arg)) {
+            string = PyByteArray_AS_STRING(arg);
+        }
+        else {
+            string = PyBytes_AS_STRING(arg);
+        }
+
+        PyObject *str = PyUnicode_FromString(string);
+
+        if (!str) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+
+        PyObject *res = (PyObject *)MPZ_finish(MPZ_from_str(str, base));
+
+        Py_DECREF(str);
+        return res;
+    }
+    if (Py_IsNone(base_arg)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "argument must be a number or a string");
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError,
+                        "can't convert non-string with explicit base");
+    }
+    return NULL;
+}
+
+static PyObject *
+new(PyTypeObject *type, PyObject *args, PyObject *keywds)
+{
+    static char *kwlist[] = {"", "base", NULL};
+    Py_ssize_t argc = PyTuple_GET_SIZE(args);
+    PyObject *arg, *base = Py_None;
+
+    if (type != &MPZ_Type) {
+        MPZ_Object *tmp = (MPZ_Object *)new(&MPZ_Type, args, keywds);
+
+        if (!tmp) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+
+        MPZ_Object *newobj = (MPZ_Object *)type->tp_alloc(type, 0);
+
+        if (!newobj) {
+            /* LCOV_EXCL_START */
+            Py_DECREF(tmp);
+            return NULL;
+            /* LCOV_EXCL_STOP */
+        }
+        if (zz_init(&newobj->z) || zz_copy(&tmp->z, &newobj->z)) {
+            /* LCOV_EXCL_START */
+            Py_DECREF(tmp);
+            return PyErr_NoMemory();
+            /* LCOV_EXCL_STOP */
+        }
+        Py_DECREF(tmp);
+        return (PyObject *)newobj;
+    }
+    if (argc == 0) {
+        return (PyObject *)MPZ_small(0);
+    }
+    if (argc == 1 && !keywds) {
+        arg = PyTuple_GET_ITEM(args, 0);
+        return new_impl(type, arg, Py_None);
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O|O",
+                                     kwlist, &arg, &base))
+    {
+        return NULL;
+    }
+    return new_impl(type, arg, base);
+}
+
+static void
+dealloc(PyObject *self)
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    PyTypeObject *type = Py_TYPE(self);
+
+    if (u->charge) {
+        atomic_add(&memory_used,
+                   -(int64_t)u->charge*(int64_t)sizeof(zz_limb_t));
+    }
+    if (!MPZ_is_inline(u)) {
+#if defined(TRACEMALLOC_DOMAIN)
+        (void)PyTraceMalloc_Untrack(TRACEMALLOC_DOMAIN, (uintptr_t)u->z.digits);
+#endif
+        cache_put_limbs(&u->z);
+    }
+    if (MPZ_CheckExact(self)
+        && (global.gmp_cache_size < cache_size
+            || (cache_size >= MAGAZINE_SIZE
+                && depot_put(0, global.gmp_cache, &global.gmp_cache_size,
+                             sizeof(MPZ_Object *)))))
+    {
+        global.gmp_cache[(global.gmp_cache_size)++] = u;
+    }
+    else {
+        if (MPZ_CheckExact(self)) {
+            global.gmp_cache_evictions++;
+        }
+        type->tp_free(self);
+    }
+}
+
+static PyObject *
+vectorcall(PyObject *type, PyObject *const *args, size_t nargsf,
+           PyObject *kwnames)
+{
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    static const char *const keywords[] = {"", "base"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 2,
+        .minargs = 0,
+        .maxargs = 2,
+        .fname = "mpz",
+    };
+    Py_ssize_t argidx[2] = {-1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+    if (argidx[1] >= 0) {
+        return new_impl((PyTypeObject *)type, args[argidx[0]],
+                        args[argidx[1]]);
+    }
+    else if (argidx[0] >= 0) {
+        return new_impl((PyTypeObject *)type, args[argidx[0]], Py_None);
+    }
+    else {
+        return (PyObject *)MPZ_small(0);
+    }
+}
+
+static PyObject *
+repr(PyObject *self)
+{
+    return MPZ_to_str((MPZ_Object *)self, 10, OPT_TAG);
+}
+
+static PyObject *
+str(PyObject *self)
+{
+    return MPZ_to_str((MPZ_Object *)self, 10, 0);
+}
+
+#define Number_Check(op) (PyFloat_Check((op)) || PyComplex_Check((op)))
+
+#define CHECK_OP(u, a)          \
+    if (MPZ_Check(a)) {         \
+        u = MPZ_operand(a);     \
+        if (!u) {               \
+            goto end;           \
+        }                       \
+    }                           \
+    else if (PyLong_Check(a)) { \
+        u = MPZ_borrow_int(a);  \
+        if (!u) {               \
+            goto end;           \
+        }                       \
+    }                           \
+    else if (Number_Check(a)) { \
+        goto numbers;           \
+    }                           \
+    else {                      \
+        goto fallback;          \
+    }
+
+/* Same as zz_to_double() for the value of an mpz a, which is locked, as an
+   xmpz may be changed by other threads. */
+static zz_err
+MPZ_to_double(PyObject *a, double *d)
+{
+    zz_err ret;
+
+    Py_BEGIN_CRITICAL_SECTION(a);
+    ret = zz_to_double(&((MPZ_Object *)a)->z, d);
+    Py_END_CRITICAL_SECTION();
+    return ret;
+}
+
+PyObject *
+to_float(PyObject *self)
+{
+    double d;
+    zz_err ret = MPZ_to_double(self, &d);
+
+    if (ret == ZZ_BUF) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "integer too large to convert to float");
+        return NULL;
+    }
+    return PyFloat_FromDouble(d);
+}
+
+/* Operations with an mpz and a float operand are done on doubles, as for
+   int operands of float's methods: the mpz is converted to float first.
+   Kernels return NULL without an exception set for special cases (like
+   division by zero), where the generic path is used. */
+typedef PyObject *(*float_kernel)(double, double);
+
+static PyObject *
+float_add(double x, double y)
+{
+    return PyFloat_FromDouble(x + y);
+}
+
+static PyObject *
+float_sub(double x, double y)
+{
+    return PyFloat_FromDouble(x - y);
+}
+
+static PyObject *
+float_mul(double x, double y)
+{
+    return PyFloat_FromDouble(x * y);
+}
+
+static PyObject *
+float_truediv(double x, double y)
+{
+    return y ? PyFloat_FromDouble(x / y) : NULL;
+}
+
+/* Same as _float_div_mod() of the CPython. */
+static void
+float_divmod_impl(double x, double y, double *floordiv, double *mod)
+{
+    double div;
+
+    *mod = fmod(x, y);
+    div = (x - *mod) / y;
+    if (*mod) {
+        if ((y < 0) != (*mod < 0)) {
+            *mod += y;
+            div -= 1.0;
+        }
+    }
+    else {
+        *mod = copysign(0.0, y);
+    }
+    if (div) {
+        *floordiv = floor(div);
+        if (div - *floordiv > 0.5) {
+            *floordiv += 1.0;
+        }
+    }
+    else {
+        *floordiv = copysign(0.0, x / y);
+    }
+}
+
+static PyObject *
+float_quo_(double x, double y)
+{
+    double q, r;
+
+    if (!y) {
+        return NULL;
+    }
+    float_divmod_impl(x, y, &q, &r);
+    return PyFloat_FromDouble(q);
+}
+
+static PyObject *
+float_rem_(double x, double y)
+{
+    double q, r;
+
+    if (!y) {
+        return NULL;
+    }
+    float_divmod_impl(x, y, &q, &r);
+    return PyFloat_FromDouble(r);
+}
+
+static PyObject *
+float_divmod(double x, double y)
+{
+    double q, r;
+
+    if (!y) {
+        return NULL;
+    }
+    float_divmod_impl(x, y, &q, &r);
+    return Py_BuildValue("(dd)", q, r);
+}
+
+static PyObject *
+float_pow(double x, double y)
+{
+    /* Leave to float special values and negative bases, which may
+       give complex results. */
+    if (!(x > 0) || !isfinite(x) || !isfinite(y)) {
+        return NULL;
+    }
+
+    double r = pow(x, y);
+
+    return isfinite(r) ? PyFloat_FromDouble(r) : NULL;
+}
+
+/* Get the value of a float or an mpz.  Return 1, if a has other type, or
+   -1 with an exception set. */
+static int
+as_double(PyObject *a, double *d)
+{
+    if (PyFloat_Check(a)) {
+        *d = PyFloat_AS_DOUBLE(a);
+        return 0;
+    }
+    if (MPZ_Check(a)) {
+        if (MPZ_to_double(a, d) == ZZ_BUF) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "integer too large to convert to float");
+            return -1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* Apply the kernel to operands, if one is a float and other is an mpz.
+   Return NULL without an exception set, if the generic path must be
+   used. */
+static PyObject *
+float_binop(PyObject *self, PyObject *other, float_kernel kernel)
+{
+    double x, y;
+
+    if (as_double(self, &x) || as_double(other, &y)) {
+        return NULL;
+    }
+    return kernel(x, y);
+}
+
+static inline zz_slimb_t
+PyLong_AsSlimb_t(PyObject *obj, int *error)
+{
+#if SIZEOF_LONG == 8
+    long value = PyLong_AsLongAndOverflow(obj, error);
+#else
+    long long value = PyLong_AsLongLongAndOverflow(obj, error);
+#endif
+    Py_BUILD_ASSERT(sizeof(value) == sizeof(int64_t));
+    if (!error && (ZZ_SLIMB_T_MIN > value || value > ZZ_SLIMB_T_MAX)) {
+        *error = 1;
+    }
+    return (zz_slimb_t)value;
+}
+
+/* Kernels for operands, that fit into zz_slimb_t.  They return false, if
+   the result can't be computed that way (e.g. on overflow or for invalid
+   operands), then the libzz functions must be used. */
+
+#if defined(__GNUC__) || defined(__clang__)
+#  define sl_add_overflow(x, y, r) __builtin_add_overflow((x), (y), (r))
+#  define sl_sub_overflow(x, y, r) __builtin_sub_overflow((x), (y), (r))
+#  define sl_mul_overflow(x, y, r) __builtin_mul_overflow((x), (y), (r))
+#else
+static inline bool
+sl_add_overflow(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    *r = (zz_slimb_t)((uint64_t)x + (uint64_t)y);
+    return (x < 0) == (y < 0) && (*r < 0) != (x < 0);
+}
+
+static inline bool
+sl_sub_overflow(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    *r = (zz_slimb_t)((uint64_t)x - (uint64_t)y);
+    return (x < 0) != (y < 0) && (*r < 0) != (x < 0);
+}
+
+/* Conservative: both operands must fit into 32 bits. */
+static inline bool
+sl_mul_overflow(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    if (x < INT32_MIN || x > INT32_MAX || y < INT32_MIN || y > INT32_MAX) {
+        return true;
+    }
+    *r = x*y;
+    return false;
+}
+#endif
+
+static inline bool
+sl_add(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    return !sl_add_overflow(x, y, r);
+}
+
+static inline bool
+sl_sub(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    return !sl_sub_overflow(x, y, r);
+}
+
+static inline bool
+sl_mul(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    return !sl_mul_overflow(x, y, r);
+}
+
+static inline bool
+sl_quo_(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    if (!y || (y == -1 && x == ZZ_SLIMB_T_MIN)) {
+        return false;
+    }
+    *r = x/y;
+    if (x%y && (x < 0) != (y < 0)) {
+        (*r)--;
+    }
+    return true;
+}
+
+static inline bool
+sl_rem_(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    if (!y || (y == -1 && x == ZZ_SLIMB_T_MIN)) {
+        return false;
+    }
+    *r = x%y;
+    if (*r && (*r < 0) != (y < 0)) {
+        *r += y;
+    }
+    return true;
+}
+
+/* Bitwise operations on two's complement values agree with ones for
+   integers of unbounded size. */
+static inline bool
+sl_and(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    *r = x & y;
+    return true;
+}
+
+static inline bool
+sl_or(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    *r = x | y;
+    return true;
+}
+
+static inline bool
+sl_xor(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    *r = x ^ y;
+    return true;
+}
+
+static inline bool
+sl_lshift(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    if (y < 0 || y >= ZZ_LIMB_T_BITS - 1) {
+        return false;
+    }
+    return !sl_mul_overflow(x, (zz_slimb_t)1 << y, r);
+}
+
+static inline bool
+sl_rshift(zz_slimb_t x, zz_slimb_t y, zz_slimb_t *r)
+{
+    if (y < 0) {
+        return false;
+    }
+    if (y >= ZZ_LIMB_T_BITS - 1) {
+        *r = x < 0 ? -1 : 0;
+    }
+    else {
+        *r = x < 0 ? ~(~x >> y) : x >> y;
+    }
+    return true;
+}
+
+typedef bool (*sl_kernel)(zz_slimb_t, zz_slimb_t, zz_slimb_t *);
+
+/* Apply the kernel, if both operands (an mpz or int) fit into zz_slimb_t.
+   Here u (v) is either NULL or self (other), casted to mpz.  Return false,
+   if the generic path must be used, else set res (NULL on errors). */
+static inline bool
+sl_binop(PyObject *self, MPZ_Object *u, PyObject *other, MPZ_Object *v,
+         sl_kernel kernel, MPZ_Object **res)
+{
+    zz_slimb_t x, y, r;
+    int error = 0;
+
+    if (u ? !MPZ_to_sl(u, &x) : (x = PyLong_AsSlimb_t(self, &error), error)) {
+        return false;
+    }
+    if (v ? !MPZ_to_sl(v, &y) : (y = PyLong_AsSlimb_t(other, &error), error)) {
+        return false;
+    }
+    if (!kernel(x, y, &r)) {
+        return false;
+    }
+    *res = MPZ_from_sl(r);
+    return true;
+}
+
+/* Return bits of |u| from the s-th one, at most 64 of them. */
+static uint64_t
+zz_bits_from(const zz_t *u, zz_bitcnt_t s)
+{
+    zz_size_t i = (zz_size_t)(s / ZZ_LIMB_T_BITS);
+    int shift = ZZ_LIMB_T_BITS - (int)(s % ZZ_LIMB_T_BITS);
+    uint64_t r = (uint64_t)(u->digits[i] >> (s % ZZ_LIMB_T_BITS));
+
+    for (i++; i < u->size && shift < 64; i++) {
+        r |= (uint64_t)u->digits[i] << shift;
+        shift += ZZ_LIMB_T_BITS;
+    }
+    return r;
+}
+
+/* Compare u with a finite double exactly. */
+static zz_ord
+zz_cmp_d(const zz_t *u, double d)
+{
+    assert(isfinite(d));
+
+    if (u->size <= 1
+        && (!u->size || (uint64_t)u->digits[0] <= 1ULL << DBL_MANT_DIG))
+    {
+        double ud = u->size ? (double)u->digits[0] : 0; /* exact */
+
+        if (u->negative) {
+            ud = -ud;
+        }
+        return ud < d ? ZZ_LT : (ud > d ? ZZ_GT : ZZ_EQ);
+    }
+
+    int su = u->negative ? -1 : 1;
+    int sd = d < 0 ? -1 : 1;
+
+    if (su != sd || d == 0) {
+        return su < sd ? ZZ_LT : ZZ_GT;
+    }
+
+    zz_bitcnt_t bits = zz_bitlen(u);
+    zz_ord r;
+
+    if (bits <= DBL_MANT_DIG) {
+        double ud;
+
+        (void)zz_to_double(u, &ud); /* exact */
+        return ud < d ? ZZ_LT : (ud > d ? ZZ_GT : ZZ_EQ);
+    }
+
+    int e;
+    double m = frexp(fabs(d), &e);
+
+    /* Now 2**(bits - 1) <= |u| < 2**bits and 2**(e - 1) <= |d| < 2**e. */
+    if (e < 0 || bits != (zz_bitcnt_t)e) {
+        r = e < 0 || bits > (zz_bitcnt_t)e ? ZZ_GT : ZZ_LT;
+    }
+    else {
+        /* |d| = M*2**s, where M has DBL_MANT_DIG bits. */
+        uint64_t M = (uint64_t)ldexp(m, DBL_MANT_DIG);
+        zz_bitcnt_t s = bits - DBL_MANT_DIG;
+        uint64_t top = zz_bits_from(u, s);
+
+        if (top != M) {
+            r = top < M ? ZZ_LT : ZZ_GT;
+        }
+        else {
+            r = zz_lsbpos(u) < s ? ZZ_GT : ZZ_EQ;
+        }
+    }
+    return su < 0 ? -r : r;
+}
+
+static PyObject *
+richcompare(PyObject *self, PyObject *other, int op)
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    zz_ord r;
+
+    if (MPZ_Check(other)) {
+        r = zz_cmp(&u->z, &((MPZ_Object *)other)->z);
+    }
+    else if (PyLong_Check(other)) {
+        int error;
+        zz_slimb_t temp = PyLong_AsSlimb_t(other, &error);
+
+        if (!error) {
+            r = zz_cmp_sl(&u->z, temp);
+        }
+        else {
+            MPZ_Object *v = MPZ_borrow_int(other);
+
+            if (!v) {
+                goto end; /* LCOV_EXCL_LINE */
+            }
+            r = zz_cmp(&u->z, &v->z);
+            Py_DECREF(v);
+        }
+    }
+    else if (PyFloat_Check(other)) {
+        /* Compare exactly, as int does. */
+        double d = PyFloat_AS_DOUBLE(other);
+
+        if (isnan(d)) {
+            return PyBool_FromLong(op == Py_NE);
+        }
+        if (isinf(d)) {
+            r = d > 0 ? ZZ_LT : ZZ_GT;
+        }
+        else {
+            r = zz_cmp_d(&u->z, d);
+        }
+    }
+    else if (Number_Check(other)) {
+        goto numbers;
+    }
+    else {
+        goto fallback;
+    }
+    switch (op) {
+        case Py_LT:
+            return PyBool_FromLong(r == ZZ_LT);
+        case Py_LE:
+            return PyBool_FromLong(r != ZZ_GT);
+        case Py_GT:
+            return PyBool_FromLong(r == ZZ_GT);
+        case Py_GE:
+            return PyBool_FromLong(r != ZZ_LT);
+        case Py_EQ:
+            return PyBool_FromLong(r == ZZ_EQ);
+        case Py_NE:
+            return PyBool_FromLong(r != ZZ_EQ);
+    }
+    /* LCOV_EXCL_START */
+end:
+    return NULL;
+    /* LCOV_EXCL_STOP */
+fallback:
+    Py_RETURN_NOTIMPLEMENTED;
+numbers:
+    self = to_float(self);
+    if (!self) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    PyObject *res = PyObject_RichCompare(self, other, op);
+
+    Py_DECREF(self);
+    return res;
+}
+
+/* Return |u| mod PyHASH_MODULUS.  As the modulus is a Mersenne prime
+   2**PyHASH_BITS - 1, limbs are folded with shifts and additions. */
+static Py_uhash_t
+zz_hash(const zz_t *u)
+{
+    const int s = ZZ_LIMB_T_BITS % PyHASH_BITS;
+    Py_uhash_t x = 0;
+
+    for (zz_size_t i = u->size; i--;) {
+        zz_limb_t d = u->digits[i];
+
+        /* x*2**ZZ_LIMB_T_BITS, as 2**PyHASH_BITS = 1 */
+        x = (((x << s) & PyHASH_MODULUS)
+             | (x >> (PyHASH_BITS - s)));
+        while (d > PyHASH_MODULUS) {
+            d = (d & PyHASH_MODULUS) + (d >> PyHASH_BITS);
+        }
+        x += (Py_uhash_t)d;
+        if (x >= PyHASH_MODULUS) {
+            x -= PyHASH_MODULUS;
+        }
+    }
+    return x;
+}
+
+static Py_hash_t
+hash(PyObject *self)
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    Py_hash_t r = atomic_load(&u->hash_cache);
+
+    if (r != -1) {
+        return r;
+    }
+    r = (Py_hash_t)zz_hash(&u->z);
+    if (zz_isneg(&u->z)) {
+        r = -r;
+    }
+    if (r == -1) {
+        r = -2;
+    }
+    atomic_store(&u->hash_cache, r);
+    return r;
+}
+
+#define UNOP(suff, func)                           \
+    static PyObject *                              \
+    func(PyObject *self)                           \
+    {                                              \
+        MPZ_Object *u = (MPZ_Object *)self;        \
+        MPZ_Object *res = MPZ_new(u->z.size);      \
+                                                   \
+        if (res && zz_##suff(&u->z, &res->z)) {    \
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */ \
+        }                                          \
+        return (PyObject *)MPZ_finish(res);        \
+    }
+
+UNOP(copy, plus)
+UNOP(neg, nb_negative)
+UNOP(abs, nb_absolute)
+UNOP(invert, nb_invert)
+
+PyObject *
+to_int(PyObject *self)
+{
+    return MPZ_to_int((MPZ_Object *)self);
+}
+
+static int
+to_bool(PyObject *self)
+{
+    return !zz_iszero(&((MPZ_Object *)self)->z);
+}
+
+#define CHECK_OPv2(u, a)        \
+    if (MPZ_Check(a)) {         \
+        u = MPZ_operand(a);     \
+        if (!u) {               \
+            goto end;           \
+        }                       \
+    }                           \
+    else if (PyLong_Check(a)) { \
+        ;                       \
+    }                           \
+    else if (Number_Check(a)) { \
+        goto numbers;           \
+    }                           \
+    else {                      \
+        goto fallback;          \
+    }
+
+#define BINOP(suff, slot)                                       \
+    static PyObject *                                           \
+    nb_##suff(PyObject *self, PyObject *other)                  \
+    {                                                           \
+        MPZ_Object *u = NULL, *v = NULL, *res = NULL;           \
+                                                                \
+        CHECK_OPv2(u, self);                                    \
+        CHECK_OPv2(v, other);                                   \
+                                                                \
+        if (sl_binop(self, u, other, v, sl_##suff, &res)) {     \
+            Py_XDECREF(u);                                      \
+            Py_XDECREF(v);                                      \
+            return (PyObject *)res;                             \
+        }                                                       \
+                                                                \
+        zz_err ret = ZZ_OK;                                     \
+                                                                \
+        if (!u) {                                               \
+            int error;                                          \
+            zz_slimb_t temp = PyLong_AsSlimb_t(self, &error);   \
+                                                                \
+            if (!error) {                                       \
+                res = MPZ_new(suff##_size(1, v->z.size));       \
+                if (res) {                                      \
+                    ret = zz_sl_##suff(temp, &v->z, &res->z);   \
+                }                                               \
+                goto done;                                      \
+            }                                                   \
+            u = MPZ_borrow_int(self);                           \
+            if (!u) {                                           \
+                goto end;                                       \
+            }                                                   \
+        }                                                       \
+        if (!v) {                                               \
+            int error;                                          \
+            zz_slimb_t temp = PyLong_AsSlimb_t(other, &error);  \
+                                                                \
+            if (!error) {                                       \
+                res = MPZ_new(suff##_size(u->z.size, 1));       \
+                if (res) {                                      \
+                    ret = zz_##suff##_sl(&u->z, temp, &res->z); \
+                }                                               \
+                goto done;                                      \
+            }                                                   \
+            v = MPZ_borrow_int(other);                          \
+            if (!v) {                                           \
+                goto end;                                       \
+            }                                                   \
+        }                                                       \
+        res = MPZ_new(suff##_size(u->z.size, v->z.size));       \
+        if (res) {                                              \
+            NOGIL_IF(MPZ_nogil(u, v, suff##_work(u->z.size,     \
+                                                 v->z.size)),   \
+                     ret = big_##suff(&u->z, &v->z, &res->z))   \
+        }                                                       \
+done:                                                           \
+        if (ret == ZZ_OK) {                                     \
+            goto end;                                           \
+        }                                                       \
+        if (ret == ZZ_VAL) {                                    \
+            Py_CLEAR(res);                                      \
+            PyErr_SetString(PyExc_ZeroDivisionError,            \
+                            "division by zero");                \
+        }                                                       \
+        else {                                                  \
+            Py_CLEAR(res);                                      \
+            PyErr_NoMemory();                                   \
+        }                                                       \
+    end:                                                        \
+        Py_XDECREF(u);                                          \
+        Py_XDECREF(v);                                          \
+        return (PyObject *)MPZ_finish(res);                     \
+    fallback:                                                   \
+        Py_XDECREF(u);                                          \
+        Py_XDECREF(v);                                          \
+        Py_RETURN_NOTIMPLEMENTED;                               \
+    numbers:                                                    \
+        Py_XDECREF(u);                                          \
+        Py_XDECREF(v);                                          \
+                                                                \
+        PyObject *uf, *vf, *rf = float_binop(self, other,       \
+                                             float_##suff);     \
+                                                                \
+        if (rf || PyErr_Occurred()) {                           \
+            return rf;                                          \
+        }                                                       \
+        if (Number_Check(self)) {                               \
+            uf = self;                                          \
+            Py_INCREF(uf);                                      \
+        }                                                       \
+        else {                                                  \
+            uf = to_float(self);                                \
+            if (!uf) {                                          \
+                return NULL;                                    \
+            }                                                   \
+        }                                                       \
+        if (Number_Check(other)) {                              \
+            vf = other;                                         \
+            Py_INCREF(vf);                                      \
+        }                                                       \
+        else {                                                  \
+            vf = to_float(other);                               \
+            if (!vf) {                                          \
+                Py_DECREF(uf);                                  \
+                return NULL;                                    \
+            }                                                   \
+        }                                                       \
+        rf = slot(uf, vf);                                      \
+        Py_DECREF(uf);                                          \
+        Py_DECREF(vf);                                          \
+        return rf;                                              \
+    }
+
+/* Estimates for the number of limbs in results of binary operations. */
+
+static inline zz_size_t
+add_size(zz_size_t u, zz_size_t v)
+{
+    return Py_MAX(u, v) + 1;
+}
+#define sub_size add_size
+
+static inline zz_size_t
+mul_size(zz_size_t u, zz_size_t v)
+{
+    return u + v;
+}
+
+static inline zz_size_t
+quo__size(zz_size_t u, zz_size_t v)
+{
+    return u > v ? u - v + 1 : 1;
+}
+
+static inline zz_size_t
+rem__size(zz_size_t Py_UNUSED(u), zz_size_t v)
+{
+    return v;
+}
+
+#define and_size add_size
+#define or_size add_size
+#define xor_size add_size
+
+/* Estimates for the work (in limb multiplications) of binary operations. */
+
+static inline double
+add_work(zz_size_t u, zz_size_t v)
+{
+    return (double)Py_MAX(u, v);
+}
+#define sub_work add_work
+
+static inline double
+mul_work(zz_size_t u, zz_size_t v)
+{
+    return (double)u*(double)v;
+}
+
+static inline double
+quo__work(zz_size_t u, zz_size_t v)
+{
+    return (double)quo__size(u, v)*(double)v;
+}
+#define rem__work quo__work
+
+static inline zz_size_t
+lshift_size(zz_size_t u, zz_size_t Py_UNUSED(v))
+{
+    return u + 1;
+}
+
+static inline zz_size_t
+rshift_size(zz_size_t u, zz_size_t Py_UNUSED(v))
+{
+    return u;
+}
+
+#define zz_sl_add(x, y, r) zz_add_sl((y), (x), (r))
+#define zz_sl_mul(x, y, r) zz_mul_sl((y), (x), (r))
+
+/* Kernels for generic paths of binary operations, that may use several
+   threads for big operands. */
+
+#define big_add zz_add
+#define big_sub zz_sub
+
+static zz_err
+big_mul(const zz_t *u, const zz_t *v, zz_t *w)
+{
+    return mul_threads(u, v, w, parallel_threads);
+}
+
+BINOP(add, PyNumber_Add)
+BINOP(sub, PyNumber_Subtract)
+BINOP(mul, PyNumber_Multiply)
+
+static inline zz_err
+zz_quo_(const zz_t *u, const zz_t *v, zz_t *w)
+{
+    return zz_div(u, v, w, NULL);
+}
+
+static inline zz_err
+zz_rem_(const zz_t *u, const zz_t *v, zz_t *w)
+{
+    return zz_div(u, v, NULL, w);
+}
+
+static inline zz_err
+zz_sl_quo_(zz_slimb_t u, const zz_t *v, zz_t *w)
+{
+    return zz_sl_div(u, v, w, NULL);
+}
+
+static inline zz_err
+zz_quo__sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+{
+    return zz_div_sl(u, v, w, NULL);
+}
+
+static inline zz_err
+zz_sl_rem_(zz_slimb_t u, const zz_t *v, zz_t *w)
+{
+    return zz_sl_div(u, v, NULL, w);
+}
+
+static inline zz_err
+zz_rem__sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+{
+    return zz_div_sl(u, v, NULL, w);
+}
+
+#define big_quo_ zz_quo_
+#define big_rem_ zz_rem_
+
+BINOP(quo_, PyNumber_FloorDivide)
+BINOP(rem_, PyNumber_Remainder)
+
+static PyObject *
+nb_divmod(PyObject *self, PyObject *other)
+{
+    PyObject *res = PyTuple_New(2);
+    MPZ_Object *u = NULL, *v = NULL;
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    CHECK_OPv2(u, self);
+    CHECK_OPv2(v, other);
+
+    /* One operand is an mpz, other may be an int, that fits into
+       zz_slimb_t. */
+    int error = 1;
+    zz_slimb_t temp = 0;
+
+    if (!u) {
+        temp = PyLong_AsSlimb_t(self, &error);
+        if (error && !(u = MPZ_borrow_int(self))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+    if (!v) {
+        temp = PyLong_AsSlimb_t(other, &error);
+        if (error && !(v = MPZ_borrow_int(other))) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+
+    zz_size_t usize = u ? u->z.size : 1, vsize = v ? v->z.size : 1;
+    MPZ_Object *q = MPZ_new(quo__size(usize, vsize));
+    MPZ_Object *r = MPZ_new(rem__size(usize, vsize));
+
+    if (!q || !r) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(q);
+        Py_XDECREF(r);
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+
+    zz_err ret;
+
+    if (!u) {
+        ret = zz_sl_div(temp, &v->z, &q->z, &r->z);
+    }
+    else if (!v) {
+        ret = zz_div_sl(&u->z, temp, &q->z, &r->z);
+    }
+    else {
+        NOGIL_IF(MPZ_nogil(u, v, quo__work(usize, vsize)),
+                 ret = zz_div(&u->z, &v->z, &q->z, &r->z))
+    }
+    if (ret) {
+        Py_DECREF(q);
+        Py_DECREF(r);
+        if (ret == ZZ_VAL) {
+            PyErr_SetString(PyExc_ZeroDivisionError, "division by zero");
+        }
+        else {
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        }
+        goto end;
+    }
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    PyTuple_SET_ITEM(res, 0, (PyObject *)MPZ_finish(q));
+    PyTuple_SET_ITEM(res, 1, (PyObject *)MPZ_finish(r));
+    return res;
+    /* LCOV_EXCL_START */
+end:
+    Py_DECREF(res);
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    return NULL;
+    /* LCOV_EXCL_STOP */
+fallback:
+    Py_DECREF(res);
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    Py_RETURN_NOTIMPLEMENTED;
+numbers:
+    Py_DECREF(res);
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    res = float_binop(self, other, float_divmod);
+    if (res || PyErr_Occurred()) {
+        return res;
+    }
+
+    PyObject *uf, *vf;
+
+    if (Number_Check(self)) {
+        uf = self;
+        Py_INCREF(uf);
+    }
+    else {
+        uf = to_float(self);
+        if (!uf) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+    }
+    if (Number_Check(other)) {
+        vf = other;
+        Py_INCREF(vf);
+    }
+    else {
+        vf = to_float(other);
+        if (!vf) {
+            /* LCOV_EXCL_START */
+            Py_DECREF(uf);
+            return NULL;
+            /* LCOV_EXCL_STOP */
+        }
+    }
+    res = PyNumber_Divmod(uf, vf);
+    Py_DECREF(uf);
+    Py_DECREF(vf);
+    return res;
+}
+
+static zz_err
+zz_divnear(const zz_t *u, const zz_t *v, zz_t *q, zz_t *r)
+{
+    if (!q || !r) {
+        assert(q != NULL || r != NULL);
+
+        zz_t *tmp = scratch_get();
+
+        if (!tmp) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+
+        zz_err ret = zz_divnear(u, v, q ? q : tmp, r ? r : tmp);
+
+        scratch_put(tmp);
+        return ret;
+    }
+
+    zz_err ret = zz_div(u, v, q, r);
+
+    if (ret) {
+        /* LCOV_EXCL_START */
+err:
+        zz_clear(q);
+        zz_clear(r);
+        return ret;
+        /* LCOV_EXCL_STOP */
+    }
+
+    zz_ord unexpect = v->negative ? ZZ_LT : ZZ_GT;
+    zz_t *halfQ = scratch_get();
+
+    if (!halfQ || zz_quo_2exp(v, 1, halfQ)) {
+        /* LCOV_EXCL_START */
+        if (halfQ) {
+            scratch_put(halfQ);
+        }
+        ret = ZZ_MEM;
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+
+    zz_ord cmp = zz_cmp(r, halfQ);
+
+    scratch_put(halfQ);
+    if (cmp == ZZ_EQ && v->digits[0]%2 == 0 && q->size
+        && q->digits[0]%2 != 0)
+    {
+        cmp = unexpect;
+    }
+    if (cmp == unexpect && (zz_add_sl(q, 1, q) || zz_sub(r, v, r))) {
+        /* LCOV_EXCL_START */
+        ret = ZZ_MEM;
+        goto err;
+        /* LCOV_EXCL_STOP */
+    }
+    return ZZ_OK;
+}
+
+static zz_err
+zz_truediv(const zz_t *u, const zz_t *v, double *res)
+{
+    if (!v->size) {
+        return ZZ_VAL;
+    }
+    if (!u->size) {
+        *res = v->negative ? -0.0 : 0.0;
+        return ZZ_OK;
+    }
+
+    zz_bitcnt_t ubits = zz_bitlen(u);
+    zz_bitcnt_t vbits = zz_bitlen(v);
+
+    if (ubits > vbits && ubits - vbits > DBL_MAX_EXP) {
+        return ZZ_BUF;
+    }
+    if (ubits < vbits && vbits - ubits > -DBL_MIN_EXP + DBL_MANT_DIG + 1) {
+        *res = u->negative != v->negative ? -0.0 : 0.0;
+        return ZZ_OK;
+    }
+
+    int shift = (int)(vbits - ubits);
+    int n = shift, whole = n / ZZ_LIMB_T_BITS;
+    zz_t *a = scratch_get();
+
+    if (!a) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+
+    zz_t *b = scratch_get();
+
+    if (!b) {
+        /* LCOV_EXCL_START */
+        scratch_put(a);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_abs(u, a) || zz_abs(v, b)) {
+        /* LCOV_EXCL_START */
+tmp_clear:
+        scratch_put(b);
+        scratch_put(a);
+        return ZZ_MEM;
+        /* LCOV_EXCL_STOP */
+    }
+    if (shift < 0) {
+        const zz_t *t = u;
+
+        u = v;
+        v = t;
+        n = -n;
+        whole = -whole;
+    }
+    /*                       -shift - 1             -shift
+      find shift satisfying 2           <= |a/b| < 2       */
+    n %= ZZ_LIMB_T_BITS;
+    for (zz_size_t i = v->size; i--;) {
+        zz_limb_t du, dv = v->digits[i];
+
+        if (i >= whole) {
+            if (i - whole < u->size) {
+                du = u->digits[i - whole] << n;
+            }
+            else {
+                du = 0;
+            }
+            if (n && i > whole) {
+                du |= u->digits[i - whole - 1] >> (ZZ_LIMB_T_BITS - n);
+            }
+        }
+        else {
+            du = 0;
+        }
+        if (du < dv) {
+            if (shift < 0) {
+                shift--;
+            }
+            break;
+        }
+        if (du > dv) {
+            if (shift >= 0) {
+                shift--;
+            }
+            break;
+        }
+    }
+    shift += DBL_MANT_DIG;
+    if (shift > 0 && zz_mul_2exp(a, (uint64_t)shift, a)) {
+        goto tmp_clear; /* LCOV_EXCL_LINE */
+    }
+    if (shift < 0 && zz_mul_2exp(b, (uint64_t)-shift, b)) {
+        goto tmp_clear; /* LCOV_EXCL_LINE */
+    }
+    if (zz_divnear(a, b, a, NULL)) {
+        goto tmp_clear; /* LCOV_EXCL_LINE */
+    }
+    (void)zz_to_double(a, res);
+    scratch_put(b);
+    scratch_put(a);
+    *res = ldexp(*res, -shift);
+    if (u->negative != v->negative) {
+        *res = -*res;
+    }
+    if (isinf(*res)) {
+        return ZZ_BUF;
+    }
+    return ZZ_OK;
+}
+
+static PyObject *
+nb_truediv(PyObject *self, PyObject *other)
+{
+    PyObject *res = NULL;
+    MPZ_Object *u = NULL, *v = NULL;
+
+    CHECK_OP(u, self);
+    CHECK_OP(v, other);
+
+    double d;
+
+    zz_err ret = zz_truediv(&u->z, &v->z, &d);
+
+    if (ret == ZZ_OK) {
+        res = PyFloat_FromDouble(d);
+        goto end;
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ZeroDivisionError, "division by zero");
+    }
+    else if (ret == ZZ_BUF) {
+        PyErr_SetString(PyExc_OverflowError,
+                        "integer too large to convert to float");
+    }
+    else {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+end:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    return res;
+fallback:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    Py_RETURN_NOTIMPLEMENTED;
+numbers:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    res = float_binop(self, other, float_truediv);
+    if (res || PyErr_Occurred()) {
+        return res;
+    }
+
+    PyObject *uf, *vf;
+
+    if (Number_Check(self)) {
+        uf = self;
+        Py_INCREF(uf);
+    }
+    else {
+        uf = to_float(self);
+        if (!uf) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+    }
+    if (Number_Check(other)) {
+        vf = other;
+        Py_INCREF(vf);
+    }
+    else {
+        vf = to_float(other);
+        if (!vf) {
+            /* LCOV_EXCL_START */
+            Py_DECREF(uf);
+            return NULL;
+            /* LCOV_EXCL_STOP */
+        }
+    }
+    res = PyNumber_TrueDivide(uf, vf);
+    Py_DECREF(uf);
+    Py_DECREF(vf);
+    return res;
+}
+
+#define CHECK_OP_INT(u, a)      \
+    if (MPZ_Check(a)) {         \
+        u = MPZ_operand(a);     \
+        if (!u) {               \
+            goto end;           \
+        }                       \
+    }                           \
+    else {                      \
+        u = MPZ_borrow_int(a);  \
+        if (!u) {               \
+            goto end;           \
+        }                       \
+    }                           \
+
+#define CHECK_OP_INTv2(u, a)    \
+    if (MPZ_Check(a)) {         \
+        u = MPZ_operand(a);     \
+        if (!u) {               \
+            goto end;           \
+        }                       \
+    }                           \
+    else if (PyLong_Check(a)) { \
+        ;                       \
+    }                           \
+    else {                      \
+        goto end;               \
+    }                           \
+
+#define BINOP_INTv2(suff, neg)                                       \
+    static PyObject *                                                \
+    nb_##suff(PyObject *self, PyObject *other)                       \
+    {                                                                \
+        MPZ_Object *u = NULL, *v = NULL, *res = NULL;                \
+                                                                     \
+        CHECK_OP_INTv2(u, self);                                     \
+        CHECK_OP_INTv2(v, other);                                    \
+                                                                     \
+        if (sl_binop(self, u, other, v, sl_##suff, &res)) {          \
+            Py_XDECREF(u);                                           \
+            Py_XDECREF(v);                                           \
+            return (PyObject *)res;                                  \
+        }                                                            \
+                                                                     \
+        zz_err ret = ZZ_OK;                                          \
+                                                                     \
+        if (!u) {                                                    \
+            int error = !(neg) && (PyLong_IsNegative(self)           \
+                                   || zz_isneg(&v->z));              \
+                                                                     \
+            if (!error) {                                            \
+                zz_slimb_t temp = PyLong_AsSlimb_t(self, &error);    \
+                                                                     \
+                if (!error) {                                        \
+                    res = MPZ_new(suff##_size(1, v->z.size));        \
+                    if (res) {                                       \
+                        ret = zz_sl_##suff(temp, &v->z, &res->z);    \
+                    }                                                \
+                    goto done;                                       \
+                }                                                    \
+            }                                                        \
+            u = MPZ_borrow_int(self);                                \
+            if (!u) {                                                \
+                goto end;                                            \
+            }                                                        \
+        }                                                            \
+        if (!v) {                                                    \
+            int error = !(neg) && (zz_isneg(&u->z)                   \
+                                   || PyLong_IsNegative(other));     \
+                                                                     \
+            if (!error) {                                            \
+                zz_slimb_t temp = PyLong_AsSlimb_t(other, &error);   \
+                                                                     \
+                if (!error) {                                        \
+                    res = MPZ_new(suff##_size(u->z.size, 1));        \
+                    if (res) {                                       \
+                        ret = zz_##suff##_sl(&u->z, temp, &res->z);  \
+                    }                                                \
+                    goto done;                                       \
+                }                                                    \
+            }                                                        \
+            v = MPZ_borrow_int(other);                               \
+            if (!v) {                                                \
+                goto end;                                            \
+            }                                                        \
+        }                                                            \
+        res = MPZ_new(suff##_size(u->z.size, v->z.size));            \
+        if (res) {                                                   \
+            ret = zz_##suff(&u->z, &v->z, &res->z);                  \
+        }                                                            \
+done:                                                                \
+        if (ret) {                                                   \
+            /* LCOV_EXCL_START */                                    \
+            Py_CLEAR(res);                                           \
+            if (ret == ZZ_VAL) {                                     \
+                PyErr_SetString(PyExc_ValueError,                    \
+                                "negative shift count");             \
+            }                                                        \
+            else if (ret == ZZ_BUF) {                                \
+                PyErr_SetString(PyExc_OverflowError,                 \
+                                "too many digits in integer");       \
+            }                                                        \
+            else {                                                   \
+                PyErr_NoMemory();                                    \
+            }                                                        \
+            /* LCOV_EXCL_STOP */                                     \
+        }                                                            \
+    end:                                                             \
+        Py_XDECREF(u);                                               \
+        Py_XDECREF(v);                                               \
+        return (PyObject *)MPZ_finish(res);                          \
+    }
+
+static inline zz_err
+zz_and_sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+{
+    if (!u->size || !v) {
+        return zz_from_sl(0, w);
+    }
+    assert(!u->negative && v > 0);
+    return zz_from_sl((zz_slimb_t)(u->digits[0] & (zz_limb_t)v), w);
+}
+#define zz_sl_and(x, y, r) zz_and_sl((y), (x), (r))
+
+
+/* Results of bitwise operations with non-negative operands, where v
+   fits into a limb. */
+static inline zz_err
+zz_or_sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+{
+    assert(!u->negative && v >= 0);
+    if (!u->size) {
+        return zz_from_sl(v, w);
+    }
+    if (zz_copy(u, w)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    w->digits[0] |= (zz_limb_t)v;
+    return ZZ_OK;
+}
+#define zz_sl_or(x, y, r) zz_or_sl((y), (x), (r))
+
+static inline zz_err
+zz_xor_sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+{
+    assert(!u->negative && v >= 0);
+    if (!u->size) {
+        return zz_from_sl(v, w);
+    }
+    if (zz_copy(u, w)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    w->digits[0] ^= (zz_limb_t)v;
+    if (w->size == 1 && !w->digits[0]) {
+        w->size = 0;
+    }
+    return ZZ_OK;
+}
+#define zz_sl_xor(x, y, r) zz_xor_sl((y), (x), (r))
+
+BINOP_INTv2(and, false)
+BINOP_INTv2(or, false)
+BINOP_INTv2(xor, false)
+
+static inline zz_err
+zz_lshift(const zz_t *u, const zz_t *v, zz_t *w)
+{
+    if (zz_isneg(v)) {
+        return ZZ_VAL;
+    }
+    if (v->size > 1) {
+        return ZZ_BUF;
+    }
+
+    zz_limb_t shift = v->size ? v->digits[0] : 0;
+
+    if (u->size && !memory_allows((double)zz_bitlen(u) + (double)shift)) {
+        return ZZ_MEM;
+    }
+    return zz_mul_2exp(u, shift, w);
+}
+
+static inline zz_err
+zz_rshift(const zz_t *u, const zz_t *v, zz_t *w)
+{
+    if (zz_isneg(v)) {
+        return ZZ_VAL;
+    }
+    if (v->size > 1) {
+        return zz_from_sl(zz_isneg(u) ? -1 : 0, w);
+    }
+    return zz_quo_2exp(u, v->size ? v->digits[0] : 0, w);
+}
+
+static inline zz_err
+zz_lshift_sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+{
+    if (v < 0) {
+        return ZZ_VAL;
+    }
+    if (u->size && !memory_allows((double)zz_bitlen(u) + (double)v)) {
+        return ZZ_MEM;
+    }
+    return zz_mul_2exp(u, (zz_bitcnt_t)v, w);
+}
+
+static inline zz_err
+zz_rshift_sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+{
+    if (v < 0) {
+        return ZZ_VAL;
+    }
+    return zz_quo_2exp(u, (zz_bitcnt_t)v, w);
+}
+
+static inline zz_err
+zz_sl_lshift(zz_slimb_t u, const zz_t *v, zz_t *w)
+{
+    if (zz_from_sl(u, w)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    return zz_lshift(w, v, w);
+}
+
+static inline zz_err
+zz_sl_rshift(zz_slimb_t u, const zz_t *v, zz_t *w)
+{
+    if (zz_from_sl(u, w)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    return zz_rshift(w, v, w);
+}
+
+BINOP_INTv2(lshift, true)
+BINOP_INTv2(rshift, true)
+
+/* In-place variants of binary operations.  If the left operand is an
+   exact mpz, which is not referenced elsewhere, its value is replaced by
+   the result.  Else, fall back to the binary operation. */
+#define INPLACE(suff, valerr, valmsg)                                 \
+    static PyObject *                                                 \
+    nb_inplace_##suff(PyObject *self, PyObject *other)                \
+    {                                                                 \
+        if (!MPZ_CheckExact(self) || !MPZ_IsTemporary(self)           \
+            || !(MPZ_Check(other) || PyLong_Check(other)))            \
+        {                                                             \
+            return nb_##suff(self, other);                            \
+        }                                                             \
+                                                                      \
+        MPZ_Object *u = (MPZ_Object *)self, *v;                       \
+                                                                      \
+        v = MPZ_Check(other) ? MPZ_operand(other)                     \
+                             : MPZ_borrow_int(other);                 \
+        if (!v) {                                                     \
+            return NULL; /* LCOV_EXCL_LINE */                         \
+        }                                                             \
+        if (MPZ_unfinish(u, suff##_size(u->z.size, v->z.size))) {     \
+            Py_DECREF(v);                                             \
+            return NULL;                                              \
+        }                                                             \
+                                                                      \
+        zz_err ret = zz_##suff(&u->z, &v->z, &u->z);                  \
+                                                                      \
+        Py_DECREF(v);                                                 \
+        u = MPZ_finish((MPZ_Object *)Py_NewRef(self));                \
+        if (ret == ZZ_OK) {                                           \
+            return (PyObject *)u;                                     \
+        }                                                             \
+        Py_DECREF(u);                                                 \
+        if (ret == ZZ_VAL) {                                          \
+            assert(valerr);                                           \
+            PyErr_SetString(valerr, valmsg);                          \
+        }                                                             \
+        else if (ret == ZZ_BUF) {                                     \
+            PyErr_SetString(PyExc_OverflowError,                      \
+                            "too many digits in integer");            \
+        }                                                             \
+        else {                                                        \
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */                    \
+        }                                                             \
+        return NULL;                                                  \
+    }
+
+/* Operations without ZZ_VAL failures pass NULL for valerr. */
+INPLACE(add, NULL, NULL)
+INPLACE(sub, NULL, NULL)
+INPLACE(mul, NULL, NULL)
+INPLACE(quo_, PyExc_ZeroDivisionError, "division by zero")
+INPLACE(rem_, PyExc_ZeroDivisionError, "division by zero")
+INPLACE(lshift, PyExc_ValueError, "negative shift count")
+INPLACE(rshift, PyExc_ValueError, "negative shift count")
+INPLACE(and, NULL, NULL)
+INPLACE(or, NULL, NULL)
+INPLACE(xor, NULL, NULL)
+
+/* Lower bound for the bit length of u**exp (exp >= 0), exact if |u| is a
+   power of two.  So, only results that surely don't fit into the memory
+   limit are rejected early. */
+static double
+pow_bits(const zz_t *u, zz_slimb_t exp)
+{
+    zz_bitcnt_t bits = zz_bitlen(u);
+
+    return bits <= 1 ? 1 : (double)(bits - 1)*(double)exp + 1;
+}
+
+/* Compute u**exp for nonnegative exp. */
+static MPZ_Object *
+power_sl(MPZ_Object *u, zz_slimb_t exp)
+{
+    MPZ_Object *res = NULL;
+    double bits = pow_bits(&u->z, exp), limbs = bits/ZZ_LIMB_T_BITS;
+    zz_err ret = ZZ_MEM;
+
+    if (memory_allows(bits)) {
+        zz_size_t size = 0;
+
+        if (exp < MAX_CACHE_MPZ_LIMBS && u->z.size < MAX_CACHE_MPZ_LIMBS) {
+            size = (zz_size_t)limbs + 1;
+        }
+        res = MPZ_new(size);
+    }
+    if (res) {
+        NOGIL_IF(MPZ_nogil(u, NULL, limbs*limbs),
+                 ret = zz_pow(&u->z, (zz_limb_t)exp, &res->z))
+    }
+    if (ret) {
+        /* LCOV_EXCL_START */
+        Py_CLEAR(res);
+        if (!PyErr_Occurred()) {
+            PyErr_SetNone(PyExc_MemoryError);
+        }
+        /* LCOV_EXCL_STOP */
+    }
+    return res;
+}
+
+static PyObject *
+power(PyObject *self, PyObject *other, PyObject *module)
+{
+    MPZ_Object *res = NULL;
+    MPZ_Object *u = NULL, *v = NULL;
+
+    CHECK_OP(u, self);
+    if (Py_IsNone(module) && PyLong_Check(other)) {
+        int error;
+        zz_slimb_t exp = PyLong_AsSlimb_t(other, &error);
+
+        if (!error && exp >= 0) {
+            res = power_sl(u, exp);
+            Py_DECREF(u);
+            return (PyObject *)MPZ_finish(res);
+        }
+    }
+    CHECK_OP(v, other);
+    if (Py_IsNone(module)) {
+        if (zz_isneg(&v->z)) {
+            PyObject *uf, *vf, *resf;
+
+            uf = to_float((PyObject *)u);
+            Py_DECREF(u);
+            if (!uf) {
+                Py_DECREF(v);
+                return NULL;
+            }
+            vf = to_float((PyObject *)v);
+            Py_DECREF(v);
+            if (!vf) {
+                Py_DECREF(uf);
+                return NULL;
+            }
+            resf = PyFloat_Type.tp_as_number->nb_power(uf, vf, Py_None);
+            Py_DECREF(uf);
+            Py_DECREF(vf);
+            return resf;
+        }
+        zz_slimb_t exp;
+
+        if (zz_to_sl(&v->z, &exp) == ZZ_OK) {
+            res = power_sl(u, exp);
+        }
+        else {
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        }
+        Py_DECREF(u);
+        Py_DECREF(v);
+        return (PyObject *)MPZ_finish(res);
+    }
+    else {
+        MPZ_Object *w = NULL;
+
+        CHECK_OP_INT(w, module);
+
+        zz_err ret = ZZ_OK;
+
+        res = MPZ_new(w->z.size);
+        if (res) {
+            double work = (mul_work(w->z.size, w->z.size)
+                           * (double)zz_bitlen(&v->z));
+
+            NOGIL_IF(MPZ_nogil(u, v, work) && MPZ_CheckExact(w),
+                     ret = zz_powm(&u->z, &v->z, &w->z, &res->z))
+        }
+        if (!res || ret) {
+            /* LCOV_EXCL_START */
+            if (ret == ZZ_VAL) {
+                PyErr_SetString(PyExc_ValueError,
+                                "base is not invertible for the given modulus");
+            }
+            else {
+                PyErr_NoMemory();
+            }
+            Py_CLEAR(res);
+            /* LCOV_EXCL_STOP */
+        }
+        Py_DECREF(w);
+    }
+end:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    return (PyObject *)MPZ_finish(res);
+fallback:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    Py_RETURN_NOTIMPLEMENTED;
+numbers:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    if (Py_IsNone(module)) {
+        PyObject *rf = float_binop(self, other, float_pow);
+
+        if (rf || PyErr_Occurred()) {
+            return rf;
+        }
+    }
+
+    PyObject *uf, *vf;
+
+    if (Number_Check(self)) {
+        uf = self;
+        Py_INCREF(uf);
+    }
+    else {
+        uf = to_float(self);
+        if (!uf) {
+            return NULL;
+        }
+    }
+    if (Number_Check(other)) {
+        vf = other;
+        Py_INCREF(vf);
+    }
+    else {
+        vf = to_float(other);
+        if (!vf) {
+            Py_DECREF(uf);
+            return NULL;
+        }
+    }
+
+    PyObject *res2 = PyNumber_Power(uf, vf, Py_None);
+
+    Py_DECREF(uf);
+    Py_DECREF(vf);
+    return res2;
+}
+
+static PyNumberMethods as_number = {
+    .nb_add = nb_add,
+    .nb_subtract = nb_sub,
+    .nb_multiply = nb_mul,
+    .nb_divmod = nb_divmod,
+    .nb_floor_divide = nb_quo_,
+    .nb_true_divide = nb_truediv,
+    .nb_remainder = nb_rem_,
+    .nb_power = power,
+    .nb_positive = plus,
+    .nb_negative = nb_negative,
+    .nb_absolute = nb_absolute,
+    .nb_invert = nb_invert,
+    .nb_lshift = nb_lshift,
+    .nb_rshift = nb_rshift,
+    .nb_and = nb_and,
+    .nb_or = nb_or,
+    .nb_xor = nb_xor,
+    .nb_int = to_int,
+    .nb_float = to_float,
+    .nb_index = to_int,
+    .nb_bool = to_bool,
+    .nb_inplace_add = nb_inplace_add,
+    .nb_inplace_subtract = nb_inplace_sub,
+    .nb_inplace_multiply = nb_inplace_mul,
+    .nb_inplace_floor_divide = nb_inplace_quo_,
+    .nb_inplace_remainder = nb_inplace_rem_,
+    .nb_inplace_lshift = nb_inplace_lshift,
+    .nb_inplace_rshift = nb_inplace_rshift,
+    .nb_inplace_and = nb_inplace_and,
+    .nb_inplace_or = nb_inplace_or,
+    .nb_inplace_xor = nb_inplace_xor,
+};
+
+static PyObject *
+get_copy(PyObject *self, void *Py_UNUSED(closure))
+{
+    if (MPZ_CheckExact(self)) {
+        return Py_NewRef(self);
+    }
+    return plus(self);
+}
+
+static PyObject *
+get_one(PyObject *Py_UNUSED(self), void *Py_UNUSED(closure))
+{
+    return (PyObject *)MPZ_small(1);
+}
+
+static PyObject *
+get_zero(PyObject *Py_UNUSED(self), void *Py_UNUSED(closure))
+{
+    return (PyObject *)MPZ_small(0);
+}
+
+static PyGetSetDef getsetters[] = {
+    {"numerator", (getter)get_copy, NULL,
+     "the numerator of self (the value itself)", NULL},
+    {"denominator", (getter)get_one, NULL,
+     "the denominator of self (mpz(1))", NULL},
+    {"real", (getter)get_copy, NULL, "the real part of self (the value itself)",
+     NULL},
+    {"imag", (getter)get_zero, NULL, "the imaginary part of self (mpz(0))",
+     NULL},
+    {NULL} /* sentinel */
+};
+
+static PyObject *
+bit_length(PyObject *self, PyObject *Py_UNUSED(args))
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    zz_limb_t digit = zz_bitlen(&u->z);
+
+    return PyLong_FromUnsignedLongLong(digit);
+}
+
+static PyObject *
+bit_count(PyObject *self, PyObject *Py_UNUSED(args))
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    zz_bitcnt_t count = zz_bitcnt(&u->z);
+
+    return PyLong_FromUnsignedLongLong(count);
+}
+
+static PyObject *
+to_bytes(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+         PyObject *kwnames)
+{
+    static const char *const keywords[] = {"length", "byteorder", "signed"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 2,
+        .minargs = 0,
+        .maxargs = 3,
+        .fname = "to_bytes",
+    };
+    Py_ssize_t argidx[3] = {-1, -1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    Py_ssize_t length = 1;
+    int is_little = 0, is_signed = 0;
+
+    if (argidx[0] >= 0) {
+        PyObject *arg = args[argidx[0]];
+
+        if (PyLong_Check(arg)) {
+            length = PyLong_AsSsize_t(arg);
+            if (length < 0) {
+                PyErr_SetString(PyExc_ValueError,
+                                "length argument must be non-negative");
+                return NULL;
+            }
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError,
+                            "to_bytes() takes an integer argument 'length'");
+            return NULL;
+        }
+    }
+    if (argidx[1] >= 0) {
+        PyObject *arg = args[argidx[1]];
+
+        if (PyUnicode_Check(arg)) {
+            const char *byteorder = PyUnicode_AsUTF8(arg);
+
+            if (!byteorder) {
+                return NULL; /* LCOV_EXCL_LINE */
+            }
+            else if (strcmp(byteorder, "big") == 0) {
+                is_little = 0;
+            }
+            else if (strcmp(byteorder, "little") == 0) {
+                is_little = 1;
+            }
+            else {
+                PyErr_SetString(PyExc_ValueError,
+                                "byteorder must be either 'little' or 'big'");
+                return NULL;
+            }
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError,
+                            "to_bytes() argument 'byteorder' must be str");
+            return NULL;
+        }
+    }
+    if (argidx[2] >= 0) {
+        is_signed = PyObject_IsTrue(args[argidx[2]]);
+    }
+    return MPZ_to_bytes((MPZ_Object *)self, length, is_little, is_signed);
+}
+
+static PyObject *
+_from_bytes(PyObject *type, PyObject *arg)
+{
+    PyObject *res = (PyObject *)MPZ_finish(MPZ_from_bytes(arg, 0, 1));
+
+    if (res && type != (PyObject *)&MPZ_Type) {
+        Py_SETREF(res, PyObject_CallOneArg(type, res));
+    }
+    return res;
+}
+
+static PyObject *
+from_bytes(PyTypeObject *Py_UNUSED(type), PyObject *const *args,
+           Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const keywords[] = {"bytes", "byteorder", "signed"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 3,
+        .minargs = 1,
+        .maxargs = 3,
+        .fname = "from_bytes",
+    };
+    Py_ssize_t argidx[3] = {-1, -1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    int is_little = 0, is_signed = 0;
+
+    if (argidx[1] >= 0) {
+        PyObject *arg = args[argidx[1]];
+
+        if (PyUnicode_Check(arg)) {
+            const char *byteorder = PyUnicode_AsUTF8(arg);
+
+            if (!byteorder) {
+                return NULL; /* LCOV_EXCL_LINE */
+            }
+            else if (strcmp(byteorder, "big") == 0) {
+                is_little = 0;
+            }
+            else if (strcmp(byteorder, "little") == 0) {
+                is_little = 1;
+            }
+            else {
+                PyErr_SetString(PyExc_ValueError,
+                                ("byteorder must be either 'little'"
+                                 " or 'big'"));
+                return NULL;
+            }
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError,
+                            ("from_bytes() argument 'byteorder'"
+                             " must be str"));
+            return NULL;
+        }
+    }
+    if (argidx[2] >= 0) {
+        is_signed = PyObject_IsTrue(args[argidx[2]]);
+    }
+    return (PyObject *)MPZ_finish(MPZ_from_bytes(args[argidx[0]],
+                                                      is_little, is_signed));
 }
 
-static inline zz_err
-zz_sl_rem_(zz_slimb_t u, const zz_t *v, zz_t *w)
+static PyObject *
+as_integer_ratio(PyObject *self, PyObject *Py_UNUSED(args))
 {
-    return zz_sl_div(u, v, NULL, w);
+    PyObject *one = get_one(NULL, NULL);
+
+    if (!one) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    PyObject *u = get_copy(self, NULL);
+
+    if (!u) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(one);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+
+    PyObject *ratio_tuple = PyTuple_Pack(2, u, one);
+
+    Py_DECREF(u);
+    Py_DECREF(one);
+    return ratio_tuple;
 }
 
-static inline zz_err
-zz_rem__sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+static PyObject *
+__round__(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
-    return zz_div_sl(u, v, NULL, w);
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "__round__ expected at most 1 argument, got %zu");
+        return NULL;
+    }
+
+    MPZ_Object *u = (MPZ_Object *)self;
+
+    if (!nargs) {
+noop:
+        return plus(self);
+    }
+
+    MPZ_Object *ndigits = NULL;
+
+    CHECK_OP_INT(ndigits, args[0]);
+
+    if (zz_isneg(&ndigits->z)) {
+        Py_SETREF(ndigits, (MPZ_Object *)nb_negative((PyObject *)ndigits));
+        if (!ndigits) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
+    }
+    else {
+        Py_DECREF(ndigits);
+        goto noop;
+    }
+
+    MPZ_Object *ten = MPZ_small(10);
+
+    if (!ten) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(ndigits);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+
+    PyObject *p = power((PyObject *)ten, (PyObject *)ndigits, Py_None);
+
+    Py_DECREF(ten);
+    Py_DECREF(ndigits);
+    if (!p) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    MPZ_Object *r = MPZ_new(((MPZ_Object *)p)->z.size);
+
+    if (!r) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(r);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    if (zz_divnear(&u->z, &((MPZ_Object *)p)->z, NULL, &r->z)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(r);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    Py_DECREF(p);
+
+    MPZ_Object *res = MPZ_new(u->z.size + 1);
+
+    if (!res || zz_sub(&u->z, &r->z, &res->z)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(r);
+        Py_XDECREF(res);
+        return PyErr_NoMemory();
+        /* LCOV_EXCL_STOP */
+    }
+    Py_DECREF(r);
+    return (PyObject *)MPZ_finish(res);
+end:
+    return NULL;
+}
+
+static PyObject *
+__reduce_ex__(PyObject *self, PyObject *Py_UNUSED(args))
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    zz_bitcnt_t len = zz_bitlen(&u->z);
+
+    return Py_BuildValue("N(N)",
+                         PyObject_GetAttrString(self, "_from_bytes"),
+                         MPZ_to_bytes(u, (Py_ssize_t)(len + 7)/8 + 1, 0, 1));
+}
+
+static PyObject *
+__sizeof__(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+
+    size_t size = sizeof(MPZ_Object);
+
+    if (!MPZ_is_inline(u)) {
+        size += (size_t)(u->z).alloc*sizeof(zz_limb_t);
+    }
+    return PyLong_FromSize_t(size);
+}
+
+static PyObject *
+is_integer(PyObject *Py_UNUSED(self), PyObject *Py_UNUSED(args))
+{
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+digits(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+       PyObject *kwnames)
+{
+    static const char *const keywords[] = {"base"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 1,
+        .minargs = 0,
+        .maxargs = 1,
+        .fname = "digits",
+    };
+    Py_ssize_t argidx[1] = {-1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    int base = 10;
+
+    if (argidx[0] != -1) {
+        PyObject *arg = args[argidx[0]];
+
+        if (PyLong_Check(arg)) {
+            base = PyLong_AsInt(args[argidx[0]]);
+            if (base == -1 && PyErr_Occurred()) {
+                return NULL;
+            }
+        }
+        else {
+            PyErr_SetString(PyExc_TypeError,
+                            "digits() takes an integer argument 'base'");
+            return NULL;
+        }
+    }
+    return MPZ_to_str((MPZ_Object *)self, base, 0);
 }
 
-BINOP(quo_, PyNumber_FloorDivide)
-BINOP(rem_, PyNumber_Remainder)
+PyDoc_STRVAR(
+    to_bytes__doc__,
+    "to_bytes($self, /, length=1, byteorder=\'big\', *, signed=False)\n--\n\n\
+Return an array of bytes representing self.\n\n\
+The integer is represented using length bytes.  An OverflowError is\n\
+raised if self is not representable with the given number of bytes.\n\n\
+The byteorder argument determines the byte order used to represent self.\n\
+Accepted values are \'big\' and \'little\', when the most significant\n\
+byte is at the beginning or at the end of the byte array, respectively.\n\n\
+The signed argument determines whether two\'s complement is used to\n\
+represent self.  If signed is False and a negative integer is given,\n\
+an OverflowError is raised.");
+PyDoc_STRVAR(
+    from_bytes__doc__,
+    "from_bytes($type, /, bytes, byteorder=\'big\', *, signed=False)\n--\n\n\
+Return the integer represented by the given array of bytes.\n\n\
+The argument bytes must either be a bytes-like object or an iterable\n\
+producing bytes.\n\n\
+The byteorder argument determines the byte order used to represent the\n\
+integer.  Accepted values are \'big\' and \'little\', when the most\n\
+significant byte is at the beginning or at the end of the byte array,\n\
+respectively.\n\n\
+The signed argument indicates whether two’s complement is used.");
+
+extern PyObject * __format__(PyObject *self, PyObject *format_spec);
+
+PyDoc_STRVAR(bit_length__doc__,
+             "Number of bits necessary to represent self in binary.");
+PyDoc_STRVAR(bit_count__doc__,
+             "Number of ones in the binary representation of the "
+             "absolute value of self.");
+PyDoc_STRVAR(as_integer_ratio__doc__,
+             "Return a pair of integers, whose ratio is equal to self.\n\n"
+             "The ratio is in lowest terms and has a positive "
+             "denominator.");
+PyDoc_STRVAR(round__doc__,
+             "__round__($self, ndigits=0, /)\n--\n\n"
+             "Round self to to the closest multiple of 10**-ndigits\n\n"
+             "Always return an integer.  If two multiples are equally "
+             "close,\nrounding is done toward the even choice.");
+PyDoc_STRVAR(reduce_ex__doc__,
+             "__reduce_ex__($self, protocol, /)\n--\n\n"
+             "Return state information for pickling.");
+PyDoc_STRVAR(format__doc__,
+             "__format__($self, format_spec, /)\n--\n\n"
+             "Convert self to a string according to format_spec.");
+PyDoc_STRVAR(sizeof__doc__, "Returns size of self in memory, in bytes.");
+PyDoc_STRVAR(digits__doc__,
+             "digits($self, base=10)\n--\n\n"
+             "Return string representing self in the given base.\n\n"
+             "Values for base can range between 2 to 36.");
+
+static PyMethodDef methods[] = {
+    {"conjugate", (PyCFunction)plus, METH_NOARGS,
+     "Returns self."},
+    {"bit_length", bit_length, METH_NOARGS, bit_length__doc__},
+    {"bit_count", bit_count, METH_NOARGS, bit_count__doc__},
+    {"to_bytes", (PyCFunction)to_bytes, METH_FASTCALL | METH_KEYWORDS,
+     to_bytes__doc__},
+    {"from_bytes", (PyCFunction)from_bytes,
+     METH_FASTCALL | METH_KEYWORDS | METH_CLASS, from_bytes__doc__},
+    {"as_integer_ratio", as_integer_ratio, METH_NOARGS,
+     as_integer_ratio__doc__},
+    {"__trunc__", (PyCFunction)plus, METH_NOARGS, "Returns self."},
+    {"__floor__", (PyCFunction)plus, METH_NOARGS, "Returns self."},
+    {"__ceil__", (PyCFunction)plus, METH_NOARGS, "Returns self."},
+    {"__round__", (PyCFunction)__round__, METH_FASTCALL, round__doc__},
+    {"__reduce_ex__", __reduce_ex__, METH_O, reduce_ex__doc__},
+    {"__format__", __format__, METH_O, format__doc__},
+    {"__sizeof__", __sizeof__, METH_NOARGS, sizeof__doc__},
+    {"is_integer", is_integer, METH_NOARGS, "Returns True."},
+    {"digits", (PyCFunction)digits, METH_FASTCALL | METH_KEYWORDS,
+     digits__doc__},
+    {"_from_bytes", _from_bytes, METH_O | METH_CLASS, NULL},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(mpz_doc,
+             "mpz(number=0, /)\nmpz(string, /, base=10)\n\n\
+Convert a number or a string to an integer.  If numeric argument is not\n\
+an int subclass, return mpz(int(number)).\n\n\
+If argument is not a number or if base is given, then it must be a string,\n\
+bytes, or bytearray instance representing an integer literal in the\n\
+given base.  The literal can be preceded by '+' or '-' and be surrounded\n\
+by whitespace.  Valid bases are 0 and 2-36.  Base 0 means to interpret \n\
+the base from the string as an integer literal.");
+
+PyTypeObject MPZ_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp.mpz",
+    .tp_basicsize = sizeof(MPZ_Object),
+    .tp_new = new,
+    .tp_dealloc = dealloc,
+    .tp_repr = repr,
+    .tp_str = str,
+    .tp_richcompare = richcompare,
+    .tp_hash = hash,
+    .tp_as_number = &as_number,
+    .tp_getset = getsetters,
+    .tp_methods = methods,
+    .tp_doc = mpz_doc,
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_vectorcall = vectorcall,
+};
+
+/* The xmpz type is a mutable subtype of mpz.  In-place operations store
+   results to the limb buffer of self, which is never kept in the inline
+   storage.  Other operations are inherited and return mpz objects. */
 
-static PyObject *
-nb_divmod(PyObject *self, PyObject *other)
+/* Grow the buffer of u to hold at least size limbs, keep the value. */
+static zz_err
+zz_reserve(zz_size_t size, zz_t *u)
 {
-    PyObject *res = PyTuple_New(2);
-    MPZ_Object *u = NULL, *v = NULL;
+    zz_t tmp;
 
-    if (!res) {
-        return NULL; /* LCOV_EXCL_LINE */
+    if (cache_get_limbs(size, &tmp)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
     }
-    CHECK_OP(u, self);
-    CHECK_OP(v, other);
-
-    MPZ_Object *q = MPZ_new();
-    MPZ_Object *r = MPZ_new();
-
-    if (!q || !r) {
+    /* There is no API to allocate limbs in advance, so let the library
+       allocate a buffer for 2**(size*ZZ_LIMB_T_BITS - 1). */
+    if ((tmp.alloc < size
+         && (zz_from_sl(1, &tmp)
+             || zz_mul_2exp(&tmp, (zz_bitcnt_t)size*ZZ_LIMB_T_BITS - 1,
+                            &tmp)))
+        || zz_copy(u, &tmp))
+    {
         /* LCOV_EXCL_START */
-        Py_XDECREF(q);
-        Py_XDECREF(r);
-        return NULL;
+        cache_put_limbs(&tmp);
+        return ZZ_MEM;
         /* LCOV_EXCL_STOP */
     }
+    cache_put_limbs(u);
+    *u = tmp;
+    return ZZ_OK;
+}
 
-    zz_err ret = zz_div(&u->z, &v->z, &q->z, &r->z);
+/* Charge the buffer of u to the memory limit and report it to tracemalloc,
+   after the buffer was (maybe) reallocated from digits. */
+static void
+XMPZ_account(MPZ_Object *u, const zz_limb_t *digits)
+{
+    if (memory_limit || u->charge) {
+        atomic_add(&memory_used, ((int64_t)(u->z.alloc - u->charge)
+                                  * (int64_t)sizeof(zz_limb_t)));
+        u->charge = u->z.alloc;
+    }
+#if defined(TRACEMALLOC_DOMAIN)
+    if (digits != u->z.digits) {
+        (void)PyTraceMalloc_Untrack(TRACEMALLOC_DOMAIN, (uintptr_t)digits);
+    }
+    (void)PyTraceMalloc_Track(TRACEMALLOC_DOMAIN, (uintptr_t)u->z.digits,
+                              (size_t)u->z.alloc*sizeof(zz_limb_t));
+#else
+    (void)digits;
+#endif
+}
 
-    if (ret) {
-        Py_DECREF(q);
-        Py_DECREF(r);
-        if (ret == ZZ_VAL) {
-            PyErr_SetString(PyExc_ZeroDivisionError, "division by zero");
-        }
-        else {
-            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
-        }
-        goto end;
+static PyObject *
+XMPZ_result(PyObject *self, zz_err ret, const zz_limb_t *digits,
+            PyObject *valerr, const char *valmsg)
+{
+    XMPZ_account((MPZ_Object *)self, digits);
+    if (ret == ZZ_OK) {
+        return Py_NewRef(self);
+    }
+    if (ret == ZZ_VAL) {
+        assert(valerr);
+        PyErr_SetString(valerr, valmsg);
+    }
+    else if (ret == ZZ_BUF) {
+        PyErr_SetString(PyExc_OverflowError, "too many digits in integer");
+    }
+    else if (!PyErr_Occurred()) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
     }
-    Py_DECREF(u);
-    Py_DECREF(v);
-    PyTuple_SET_ITEM(res, 0, (PyObject *)q);
-    PyTuple_SET_ITEM(res, 1, (PyObject *)r);
-    return res;
-    /* LCOV_EXCL_START */
-end:
-    Py_DECREF(res);
-    Py_XDECREF(u);
-    Py_XDECREF(v);
     return NULL;
-    /* LCOV_EXCL_STOP */
-fallback:
-numbers:
-    Py_DECREF(res);
-    Py_XDECREF(u);
-    Py_XDECREF(v);
-    Py_RETURN_NOTIMPLEMENTED;
 }
 
-static zz_err
-zz_divnear(const zz_t *u, const zz_t *v, zz_t *q, zz_t *r)
+/* On free-threaded builds, in-place operations lock self and the other
+   operand, if it's an xmpz too. */
+static inline PyObject *
+XMPZ_lock2(PyObject *self, PyObject *other)
 {
-    if (!q || !r) {
-        assert(q != NULL || r != NULL);
-        if (!q) {
-            zz_t tmp;
+    return XMPZ_Check(other) ? other : self;
+}
 
-            if (zz_init(&tmp)) {
-                return ZZ_MEM; /* LCOV_EXCL_LINE */
-            }
+#define XMPZ_INPLACE(suff, valerr, valmsg)                              \
+    static PyObject *                                                   \
+    xmpz_inplace_##suff(PyObject *self, PyObject *other)                \
+    {                                                                   \
+        if (!MPZ_Check(other) && !PyLong_Check(other)) {                \
+            return nb_##suff(self, other);                              \
+        }                                                               \
+                                                                        \
+        MPZ_Object *u = (MPZ_Object *)self, *v;                         \
+                                                                        \
+        if (MPZ_Check(other)) {                                         \
+            v = (MPZ_Object *)Py_NewRef(other);                         \
+        }                                                               \
+        else {                                                          \
+            v = MPZ_borrow_int(other);                                  \
+            if (!v) {                                                   \
+                return NULL; /* LCOV_EXCL_LINE */                       \
+            }                                                           \
+        }                                                               \
+                                                                        \
+        zz_limb_t *digits;                                              \
+        zz_err ret = ZZ_MEM;                                            \
+        PyObject *res;                                                  \
+                                                                        \
+        Py_BEGIN_CRITICAL_SECTION2(self, XMPZ_lock2(self, other));      \
+        digits = u->z.digits;                                           \
+        if (memory_allows((double)suff##_size(u->z.size, v->z.size)     \
+                          * ZZ_LIMB_T_BITS))                            \
+        {                                                               \
+            ret = zz_##suff(&u->z, &v->z, &u->z);                       \
+        }                                                               \
+        res = XMPZ_result(self, ret, digits, valerr, valmsg);           \
+        Py_END_CRITICAL_SECTION2();                                     \
+        Py_DECREF(v);                                                   \
+        return res;                                                     \
+    }
+
+/* Same, with a fast path for int operands, that fit into zz_slimb_t. */
+#define XMPZ_INPLACEv2(suff, valerr, valmsg)                            \
+    static PyObject *                                                   \
+    xmpz_inplace_##suff(PyObject *self, PyObject *other)                \
+    {                                                                   \
+        if (!MPZ_Check(other) && !PyLong_Check(other)) {                \
+            return nb_##suff(self, other);                              \
+        }                                                               \
+                                                                        \
+        MPZ_Object *u = (MPZ_Object *)self, *v;                         \
+        zz_limb_t *digits;                                              \
+        zz_err ret = ZZ_MEM;                                            \
+        PyObject *res;                                                  \
+                                                                        \
+        if (PyLong_Check(other)) {                                      \
+            int error;                                                  \
+            zz_slimb_t temp = PyLong_AsSlimb_t(other, &error);          \
+                                                                        \
+            if (!error) {                                               \
+                Py_BEGIN_CRITICAL_SECTION(self);                        \
+                digits = u->z.digits;                                   \
+                if (memory_allows((double)suff##_size(u->z.size, 1)     \
+                                  * ZZ_LIMB_T_BITS))                    \
+                {                                                       \
+                    ret = zz_##suff##_sl(&u->z, temp, &u->z);           \
+                }                                                       \
+                res = XMPZ_result(self, ret, digits, valerr, valmsg);   \
+                Py_END_CRITICAL_SECTION();                              \
+                return res;                                             \
+            }                                                           \
+            v = MPZ_borrow_int(other);                                  \
+            if (!v) {                                                   \
+                return NULL; /* LCOV_EXCL_LINE */                       \
+            }                                                           \
+        }                                                               \
+        else {                                                          \
+            v = (MPZ_Object *)Py_NewRef(other);                         \
+        }                                                               \
+        Py_BEGIN_CRITICAL_SECTION2(self, XMPZ_lock2(self, other));      \
+        digits = u->z.digits;                                           \
+        if (memory_allows((double)suff##_size(u->z.size, v->z.size)     \
+                          * ZZ_LIMB_T_BITS))                            \
+        {                                                               \
+            ret = zz_##suff(&u->z, &v->z, &u->z);                       \
+        }                                                               \
+        res = XMPZ_result(self, ret, digits, valerr, valmsg);           \
+        Py_END_CRITICAL_SECTION2();                                     \
+        Py_DECREF(v);                                                   \
+        return res;                                                     \
+    }
+
+/* Operations without ZZ_VAL failures pass NULL for valerr. */
+XMPZ_INPLACEv2(add, NULL, NULL)
+XMPZ_INPLACEv2(sub, NULL, NULL)
+XMPZ_INPLACEv2(mul, NULL, NULL)
+XMPZ_INPLACEv2(quo_, PyExc_ZeroDivisionError, "division by zero")
+XMPZ_INPLACEv2(rem_, PyExc_ZeroDivisionError, "division by zero")
+XMPZ_INPLACE(lshift, PyExc_ValueError, "negative shift count")
+XMPZ_INPLACE(rshift, PyExc_ValueError, "negative shift count")
+XMPZ_INPLACE(and, NULL, NULL)
+XMPZ_INPLACE(or, NULL, NULL)
+XMPZ_INPLACE(xor, NULL, NULL)
 
-            zz_err ret = zz_divnear(u, v, &tmp, r);
+static PyObject *
+xmpz_inplace_power(PyObject *self, PyObject *other, PyObject *module)
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    zz_slimb_t exp = -1;
+    int error = 1;
 
-            zz_clear(&tmp);
-            return ret;
+    if (Py_IsNone(module)) {
+        if (PyLong_Check(other)) {
+            exp = PyLong_AsSlimb_t(other, &error);
         }
-        else {
-            zz_t tmp;
-
-            if (zz_init(&tmp)) {
-                return ZZ_MEM; /* LCOV_EXCL_LINE */
-            }
-
-            zz_err ret = zz_divnear(u, v, q, &tmp);
-
-            zz_clear(&tmp);
-            return ret;
+        else if (MPZ_Check(other)) {
+            Py_BEGIN_CRITICAL_SECTION(other);
+            error = zz_to_sl(&((MPZ_Object *)other)->z, &exp) != ZZ_OK;
+            Py_END_CRITICAL_SECTION();
         }
     }
-
-    zz_err ret = zz_div(u, v, q, r);
-
-    if (ret) {
-        /* LCOV_EXCL_START */
-err:
-        zz_clear(q);
-        zz_clear(r);
-        return ret;
-        /* LCOV_EXCL_STOP */
+    if (error || exp < 0) {
+        return power(self, other, module);
     }
 
-    zz_ord unexpect = v->negative ? ZZ_LT : ZZ_GT;
-    zz_t halfQ;
+    zz_limb_t *digits;
+    zz_err ret = ZZ_MEM;
+    PyObject *res;
 
-    if (zz_init(&halfQ) || zz_quo_2exp(v, 1, &halfQ)) {
-        /* LCOV_EXCL_START */
-        zz_clear(&halfQ);
-        goto err;
-        /* LCOV_EXCL_STOP */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    digits = u->z.digits;
+    if (memory_allows(pow_bits(&u->z, exp))) {
+        ret = zz_pow(&u->z, (zz_limb_t)exp, &u->z);
     }
+    res = XMPZ_result(self, ret, digits, PyExc_ValueError,
+                      "negative exponent");
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
 
-    zz_ord cmp = zz_cmp(r, &halfQ);
+/* Inherited slots and methods, which read the value of self, are wrapped to
+   lock self, as it may be changed by other threads on free-threaded builds.
+   Other operands are copied by MPZ_operand(). */
+#define XMPZ_LOCKED(type, func, params, args) \
+    static type                               \
+    xmpz_##func params                        \
+    {                                         \
+        type res;                             \
+                                              \
+        Py_BEGIN_CRITICAL_SECTION(self);      \
+        res = func args;                      \
+        Py_END_CRITICAL_SECTION();            \
+        return res;                           \
+    }
+
+XMPZ_LOCKED(PyObject *, str, (PyObject *self), (self))
+XMPZ_LOCKED(PyObject *, plus, (PyObject *self), (self))
+XMPZ_LOCKED(PyObject *, nb_negative, (PyObject *self), (self))
+XMPZ_LOCKED(PyObject *, nb_absolute, (PyObject *self), (self))
+XMPZ_LOCKED(PyObject *, nb_invert, (PyObject *self), (self))
+XMPZ_LOCKED(PyObject *, to_int, (PyObject *self), (self))
+XMPZ_LOCKED(int, to_bool, (PyObject *self), (self))
+XMPZ_LOCKED(PyObject *, get_copy, (PyObject *self, void *closure),
+            (self, closure))
+XMPZ_LOCKED(PyObject *, bit_length, (PyObject *self, PyObject *args),
+            (self, args))
+XMPZ_LOCKED(PyObject *, bit_count, (PyObject *self, PyObject *args),
+            (self, args))
+XMPZ_LOCKED(PyObject *, as_integer_ratio, (PyObject *self, PyObject *args),
+            (self, args))
+XMPZ_LOCKED(PyObject *, __sizeof__, (PyObject *self, PyObject *args),
+            (self, args))
+XMPZ_LOCKED(PyObject *, __reduce_ex__, (PyObject *self, PyObject *arg),
+            (self, arg))
+XMPZ_LOCKED(PyObject *, __format__, (PyObject *self, PyObject *arg),
+            (self, arg))
+XMPZ_LOCKED(PyObject *, __round__,
+            (PyObject *self, PyObject *const *args, Py_ssize_t nargs),
+            (self, args, nargs))
+XMPZ_LOCKED(PyObject *, to_bytes,
+            (PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+             PyObject *kwnames),
+            (self, args, nargs, kwnames))
+XMPZ_LOCKED(PyObject *, digits,
+            (PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+             PyObject *kwnames),
+            (self, args, nargs, kwnames))
 
-    zz_clear(&halfQ);
-    if (cmp == ZZ_EQ && v->digits[0]%2 == 0 && q->size
-        && q->digits[0]%2 != 0)
-    {
-        cmp = unexpect;
-    }
-    if (cmp == unexpect && (zz_add_sl(q, 1, q) || zz_sub(r, v, r))) {
-        goto err; /* LCOV_EXCL_LINE */
-    }
-    return ZZ_OK;
+static PyObject *
+xmpz_richcompare(PyObject *self, PyObject *other, int op)
+{
+    PyObject *res;
+
+    Py_BEGIN_CRITICAL_SECTION2(self, XMPZ_lock2(self, other));
+    res = richcompare(self, other, op);
+    Py_END_CRITICAL_SECTION2();
+    return res;
 }
 
-static zz_err
-zz_truediv(const zz_t *u, const zz_t *v, double *res)
+static PyNumberMethods xmpz_as_number = {
+    .nb_positive = xmpz_plus,
+    .nb_negative = xmpz_nb_negative,
+    .nb_absolute = xmpz_nb_absolute,
+    .nb_invert = xmpz_nb_invert,
+    .nb_int = xmpz_to_int,
+    .nb_index = xmpz_to_int,
+    .nb_bool = xmpz_to_bool,
+    .nb_inplace_add = xmpz_inplace_add,
+    .nb_inplace_subtract = xmpz_inplace_sub,
+    .nb_inplace_multiply = xmpz_inplace_mul,
+    .nb_inplace_floor_divide = xmpz_inplace_quo_,
+    .nb_inplace_remainder = xmpz_inplace_rem_,
+    .nb_inplace_power = xmpz_inplace_power,
+    .nb_inplace_lshift = xmpz_inplace_lshift,
+    .nb_inplace_rshift = xmpz_inplace_rshift,
+    .nb_inplace_and = xmpz_inplace_and,
+    .nb_inplace_or = xmpz_inplace_or,
+    .nb_inplace_xor = xmpz_inplace_xor,
+};
+
+static PyObject *
+xmpz_repr(PyObject *self)
 {
-    if (!v->size) {
-        return ZZ_VAL;
-    }
-    if (!u->size) {
-        *res = v->negative ? -0.0 : 0.0;
-        return ZZ_OK;
-    }
+    PyObject *str;
 
-    zz_bitcnt_t ubits = zz_bitlen(u);
-    zz_bitcnt_t vbits = zz_bitlen(v);
+    Py_BEGIN_CRITICAL_SECTION(self);
+    str = MPZ_to_str((MPZ_Object *)self, 10, 0);
+    Py_END_CRITICAL_SECTION();
 
-    if (ubits > vbits && ubits - vbits > DBL_MAX_EXP) {
-        return ZZ_BUF;
-    }
-    if (ubits < vbits && vbits - ubits > -DBL_MIN_EXP + DBL_MANT_DIG + 1) {
-        *res = u->negative != v->negative ? -0.0 : 0.0;
-        return ZZ_OK;
+    if (!str) {
+        return NULL; /* LCOV_EXCL_LINE */
     }
+    Py_SETREF(str, PyUnicode_FromFormat("xmpz(%U)", str));
+    return str;
+}
 
-    int shift = (int)(vbits - ubits);
-    int n = shift, whole = n / ZZ_LIMB_T_BITS;
-    zz_t a, b;
+static PyObject *
+xmpz_reserve(PyObject *self, PyObject *arg)
+{
+    MPZ_Object *u = (MPZ_Object *)self;
+    Py_ssize_t bits = PyLong_AsSsize_t(arg);
 
-    if (zz_init(&a) || zz_init(&b) || zz_abs(u, &a) || zz_abs(v, &b)) {
-        /* LCOV_EXCL_START */
-tmp_clear:
-        zz_clear(&a);
-        zz_clear(&b);
-        return ZZ_MEM;
-        /* LCOV_EXCL_STOP */
+    if (bits == -1 && PyErr_Occurred()) {
+        return NULL;
     }
-    if (shift < 0) {
-        const zz_t *t = u;
-
-        u = v;
-        v = t;
-        n = -n;
-        whole = -whole;
+    if (bits < 0) {
+        PyErr_SetString(PyExc_ValueError, "bits must be non-negative");
+        return NULL;
     }
-    /*                       -shift - 1             -shift
-      find shift satisfying 2           <= |a/b| < 2       */
-    n %= ZZ_LIMB_T_BITS;
-    for (zz_size_t i = v->size; i--;) {
-        zz_limb_t du, dv = v->digits[i];
 
-        if (i >= whole) {
-            if (i - whole < u->size) {
-                du = u->digits[i - whole] << n;
-            }
-            else {
-                du = 0;
-            }
-            if (n && i > whole) {
-                du |= u->digits[i - whole - 1] >> (ZZ_LIMB_T_BITS - n);
-            }
+    zz_size_t size = (zz_size_t)((bits + ZZ_LIMB_T_BITS - 1)/ZZ_LIMB_T_BITS);
+    zz_limb_t *digits;
+    int ret = 0;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (size > u->z.alloc) {
+        if (!memory_allows((double)bits)) {
+            ret = -1;
         }
         else {
-            du = 0;
-        }
-        if (du < dv) {
-            if (shift < 0) {
-                shift--;
+            digits = u->z.digits;
+            if (zz_reserve(size, &u->z)) {
+                /* LCOV_EXCL_START */
+                PyErr_NoMemory();
+                ret = -1;
+                /* LCOV_EXCL_STOP */
             }
-            break;
-        }
-        if (du > dv) {
-            if (shift >= 0) {
-                shift--;
+            else {
+                XMPZ_account(u, digits);
             }
-            break;
         }
     }
-    shift += DBL_MANT_DIG;
-    if (shift > 0 && zz_mul_2exp(&a, (uint64_t)shift, &a)) {
-        goto tmp_clear; /* LCOV_EXCL_LINE */
-    }
-    if (shift < 0 && zz_mul_2exp(&b, (uint64_t)-shift, &b)) {
-        goto tmp_clear; /* LCOV_EXCL_LINE */
-    }
-    if (zz_divnear(&a, &b, &a, NULL)) {
-        /* LCOV_EXCL_START */
-        zz_clear(&a);
-        zz_clear(&b);
-        return ZZ_MEM;
-        /* LCOV_EXCL_STOP */
-    }
-    zz_clear(&b);
-    (void)zz_to_double(&a, res);
-    zz_clear(&a);
-    *res = ldexp(*res, -shift);
-    if (u->negative != v->negative) {
-        *res = -*res;
-    }
-    if (isinf(*res)) {
-        return ZZ_BUF;
+    Py_END_CRITICAL_SECTION();
+    if (ret) {
+        return NULL;
     }
-    return ZZ_OK;
+    Py_RETURN_NONE;
 }
 
-static PyObject *
-nb_truediv(PyObject *self, PyObject *other)
+static PyGetSetDef xmpz_getsetters[] = {
+    {"numerator", (getter)xmpz_get_copy, NULL,
+     "the numerator of self (the value itself)", NULL},
+    {"real", (getter)xmpz_get_copy, NULL,
+     "the real part of self (the value itself)", NULL},
+    {NULL} /* sentinel */
+};
+
+static PyMethodDef xmpz_methods[] = {
+    {"conjugate", (PyCFunction)xmpz_plus, METH_NOARGS, "Returns self."},
+    {"bit_length", xmpz_bit_length, METH_NOARGS, bit_length__doc__},
+    {"bit_count", xmpz_bit_count, METH_NOARGS, bit_count__doc__},
+    {"to_bytes", (PyCFunction)xmpz_to_bytes, METH_FASTCALL | METH_KEYWORDS,
+     to_bytes__doc__},
+    {"as_integer_ratio", xmpz_as_integer_ratio, METH_NOARGS,
+     as_integer_ratio__doc__},
+    {"__trunc__", (PyCFunction)xmpz_plus, METH_NOARGS, "Returns self."},
+    {"__floor__", (PyCFunction)xmpz_plus, METH_NOARGS, "Returns self."},
+    {"__ceil__", (PyCFunction)xmpz_plus, METH_NOARGS, "Returns self."},
+    {"__round__", (PyCFunction)xmpz___round__, METH_FASTCALL, round__doc__},
+    {"__reduce_ex__", xmpz___reduce_ex__, METH_O, reduce_ex__doc__},
+    {"__format__", xmpz___format__, METH_O, format__doc__},
+    {"__sizeof__", xmpz___sizeof__, METH_NOARGS, sizeof__doc__},
+    {"digits", (PyCFunction)xmpz_digits, METH_FASTCALL | METH_KEYWORDS,
+     digits__doc__},
+    {"reserve", xmpz_reserve, METH_O,
+     ("reserve($self, bits, /)\n--\n\n"
+      "Preallocate memory for values up to the given bit length.\n\n"
+      "In-place operations on self will not reallocate memory, unless\n"
+      "the result is bigger.")},
+    {NULL} /* sentinel */
+};
+
+PyDoc_STRVAR(xmpz_doc,
+             "xmpz(number=0, /)\nxmpz(string, /, base=10)\n\n\
+Mutable integer, suitable for accumulators.\n\n\
+Arguments are same as for mpz.  In-place operations (+=, *=, etc)\n\
+modify the value of self instead of creating a new object.  Other\n\
+operations return mpz objects.  Mutable objects are not hashable.");
+
+PyTypeObject XMPZ_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp.xmpz",
+    .tp_basicsize = sizeof(MPZ_Object),
+    .tp_base = &MPZ_Type,
+    .tp_repr = xmpz_repr,
+    .tp_str = xmpz_str,
+    .tp_richcompare = xmpz_richcompare,
+    .tp_hash = PyObject_HashNotImplemented,
+    .tp_as_number = &xmpz_as_number,
+    .tp_getset = xmpz_getsetters,
+    .tp_methods = xmpz_methods,
+    .tp_doc = xmpz_doc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+/* Context for arithmetic modulo a fixed positive integer.  The modulus is
+   validated once.  If it's less than 2**63, values are reduced with native
+   128-bit arithmetic and precomputed constants for Montgomery reduction
+   (for odd moduli) are used by pow().  For big moduli, products of reduced
+   values are reduced with the precomputed Barrett reciprocal of the modulus,
+   which is faster than division for at least MOD_BARRETT_BITS bits. */
+
+#define MOD_BARRETT_BITS (8192)
+
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 mod_wide_t;
+#  define HAVE_MOD_WIDE 1
+#endif
+
+typedef struct {
+    PyObject_HEAD
+    MPZ_Object *modulus;
+    uint64_t m; /* the modulus, if the fast path is used, else zero */
+    uint64_t minv; /* -1/m mod 2**64, if m is odd, else zero */
+    uint64_t r1; /* 2**64 mod m */
+    uint64_t r2; /* 2**128 mod m */
+    MPZ_Object *mu; /* 2**(2*k)//m for k-bit m, if k >= MOD_BARRETT_BITS */
+} ModContext_Object;
+
+typedef uint64_t (*mod_kernel)(const ModContext_Object *, uint64_t,
+                               uint64_t);
+typedef zz_err (*mod_binop)(const zz_t *, const zz_t *, zz_t *);
+
+#if defined(HAVE_MOD_WIDE)
+static uint64_t
+mod_add(const ModContext_Object *ctx, uint64_t x, uint64_t y)
 {
-    PyObject *res = NULL;
-    MPZ_Object *u = NULL, *v = NULL;
+    uint64_t r = x + y;
 
-    CHECK_OP(u, self);
-    CHECK_OP(v, other);
+    return r >= ctx->m ? r - ctx->m : r;
+}
 
-    double d;
+static uint64_t
+mod_sub(const ModContext_Object *ctx, uint64_t x, uint64_t y)
+{
+    return x >= y ? x - y : x + (ctx->m - y);
+}
 
-    zz_err ret = zz_truediv(&u->z, &v->z, &d);
+static uint64_t
+mod_mul(const ModContext_Object *ctx, uint64_t x, uint64_t y)
+{
+    return (uint64_t)((mod_wide_t)x*y % ctx->m);
+}
 
-    if (ret == ZZ_OK) {
-        res = PyFloat_FromDouble(d);
-        goto end;
-    }
-    if (ret == ZZ_VAL) {
-        PyErr_SetString(PyExc_ZeroDivisionError, "division by zero");
-    }
-    else if (ret == ZZ_BUF) {
-        PyErr_SetString(PyExc_OverflowError,
-                        "integer too large to convert to float");
-    }
-    else {
-        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
-    }
-end:
-    Py_XDECREF(u);
-    Py_XDECREF(v);
-    return res;
-fallback:
-    Py_XDECREF(u);
-    Py_XDECREF(v);
-    Py_RETURN_NOTIMPLEMENTED;
-numbers:
-    Py_XDECREF(u);
-    Py_XDECREF(v);
+/* Montgomery reduction: return t/2**64 mod m for t < m*2**64. */
+static inline uint64_t
+mod_redc(const ModContext_Object *ctx, mod_wide_t t)
+{
+    uint64_t q = (uint64_t)t*ctx->minv;
+    uint64_t r = (uint64_t)((t + (mod_wide_t)q*ctx->m) >> 64);
 
-    PyObject *uf, *vf;
+    return r >= ctx->m ? r - ctx->m : r;
+}
 
-    if (Number_Check(self)) {
-        uf = self;
-        Py_INCREF(uf);
-    }
-    else {
-        uf = to_float(self);
-        if (!uf) {
-            return NULL; /* LCOV_EXCL_LINE */
+static uint64_t
+mod_pow(const ModContext_Object *ctx, uint64_t x, uint64_t e)
+{
+    uint64_t r;
+
+    if (ctx->minv) {
+        r = ctx->r1;
+        x = mod_redc(ctx, (mod_wide_t)x*ctx->r2);
+        for (; e; e >>= 1) {
+            if (e & 1) {
+                r = mod_redc(ctx, (mod_wide_t)r*x);
+            }
+            x = mod_redc(ctx, (mod_wide_t)x*x);
         }
+        return mod_redc(ctx, r);
     }
-    if (Number_Check(other)) {
-        vf = other;
-        Py_INCREF(vf);
-    }
-    else {
-        vf = to_float(other);
-        if (!vf) {
-            /* LCOV_EXCL_START */
-            Py_DECREF(uf);
-            return NULL;
-            /* LCOV_EXCL_STOP */
+    r = 1 % ctx->m;
+    for (; e; e >>= 1) {
+        if (e & 1) {
+            r = mod_mul(ctx, r, x);
         }
+        x = mod_mul(ctx, x, x);
     }
-    res = PyNumber_TrueDivide(uf, vf);
-    Py_DECREF(uf);
-    Py_DECREF(vf);
-    return res;
+    return r;
 }
 
-#define CHECK_OP_INT(u, a)      \
-    if (MPZ_Check(a)) {         \
-        u = (MPZ_Object *)a;    \
-        Py_INCREF(u);           \
-    }                           \
-    else {                      \
-        u = MPZ_from_int(a);    \
-        if (!u) {               \
-            goto end;           \
-        }                       \
-    }                           \
+/* Set r to the inverse of x.  Return false, if x is not invertible. */
+static bool
+mod_inv(const ModContext_Object *ctx, uint64_t x, uint64_t *r)
+{
+    int64_t t = 0, nt = 1;
+    uint64_t a = ctx->m, b = x;
 
-#define CHECK_OP_INTv2(u, a)    \
-    if (MPZ_Check(a)) {         \
-        u = (MPZ_Object *)a;    \
-        Py_INCREF(u);           \
-    }                           \
-    else if (PyLong_Check(a)) { \
-        ;                       \
-    }                           \
-    else {                      \
-        goto end;               \
-    }                           \
+    while (b) {
+        uint64_t q = a/b, tmp = a - q*b;
+        int64_t ttmp = t - (int64_t)q*nt;
 
-#define BINOP_INT(suff)                                         \
-    static PyObject *                                           \
-    nb_##suff(PyObject *self, PyObject *other)                  \
-    {                                                           \
-        MPZ_Object *u = NULL, *v = NULL, *res = NULL;           \
-                                                                \
-        CHECK_OP_INT(u, self);                                  \
-        CHECK_OP_INT(v, other);                                 \
-                                                                \
-        res = MPZ_new();                                        \
-        zz_err ret = ZZ_OK;                                     \
-                                                                \
-        if (!res || (ret = zz_##suff(&u->z, &v->z, &res->z))) { \
-            /* LCOV_EXCL_START */                               \
-            Py_CLEAR(res);                                      \
-            if (ret == ZZ_VAL) {                                \
-                PyErr_SetString(PyExc_ValueError,               \
-                                "negative shift count");        \
-            }                                                   \
-            else if (ret == ZZ_BUF) {                           \
-                PyErr_SetString(PyExc_OverflowError,            \
-                                "too many digits in integer");  \
-            }                                                   \
-            else {                                              \
-                PyErr_NoMemory();                               \
-            }                                                   \
-            /* LCOV_EXCL_STOP */                                \
-        }                                                       \
-    end:                                                        \
-        Py_XDECREF(u);                                          \
-        Py_XDECREF(v);                                          \
-        return (PyObject *)res;                                 \
+        a = b;
+        b = tmp;
+        t = nt;
+        nt = ttmp;
     }
-
-#define BINOP_INTv2(suff)                                            \
-    static PyObject *                                                \
-    nb_##suff(PyObject *self, PyObject *other)                       \
-    {                                                                \
-        MPZ_Object *u = NULL, *v = NULL, *res = NULL;                \
-                                                                     \
-        CHECK_OP_INTv2(u, self);                                     \
-        CHECK_OP_INTv2(v, other);                                    \
-                                                                     \
-        res = MPZ_new();                                             \
-        if (!res) {                                                  \
-            goto end;                                                \
-        }                                                            \
-                                                                     \
-        zz_err ret = ZZ_OK;                                          \
-                                                                     \
-        if (!u) {                                                    \
-            int error = PyLong_IsNegative(self) || zz_isneg(&v->z);  \
-                                                                     \
-            if (!error) {                                            \
-                zz_slimb_t temp = PyLong_AsSlimb_t(self, &error);    \
-                                                                     \
-                if (!error) {                                        \
-                    ret = zz_sl_##suff(temp, &v->z, &res->z);        \
-                    goto done;                                       \
-                }                                                    \
-            }                                                        \
-            u = MPZ_from_int(self);                                  \
-            if (!u) {                                                \
-                goto end;                                            \
-            }                                                        \
-        }                                                            \
-        if (!v) {                                                    \
-            int error = zz_isneg(&u->z) || PyLong_IsNegative(other); \
-                                                                     \
-            if (!error) {                                            \
-                zz_slimb_t temp = PyLong_AsSlimb_t(other, &error);   \
-                                                                     \
-                if (!error) {                                        \
-                    ret = zz_##suff##_sl(&u->z, temp, &res->z);      \
-                    goto done;                                       \
-                }                                                    \
-            }                                                        \
-            v = MPZ_from_int(other);                                 \
-            if (!v) {                                                \
-                goto end;                                            \
-            }                                                        \
-        }                                                            \
-        ret = zz_##suff(&u->z, &v->z, &res->z);                      \
-done:                                                                \
-        if (ret) {                                                   \
-            /* LCOV_EXCL_START */                                    \
-            Py_CLEAR(res);                                           \
-            if (ret == ZZ_VAL) {                                     \
-                PyErr_SetString(PyExc_ValueError,                    \
-                                "negative shift count");             \
-            }                                                        \
-            else if (ret == ZZ_BUF) {                                \
-                PyErr_SetString(PyExc_OverflowError,                 \
-                                "too many digits in integer");       \
-            }                                                        \
-            else {                                                   \
-                PyErr_NoMemory();                                    \
-            }                                                        \
-            /* LCOV_EXCL_STOP */                                     \
-        }                                                            \
-    end:                                                             \
-        Py_XDECREF(u);                                               \
-        Py_XDECREF(v);                                               \
-        return (PyObject *)res;                                      \
+    if (a != 1) {
+        return false;
     }
+    *r = t < 0 ? (uint64_t)t + ctx->m : (uint64_t)t;
+    return true;
+}
 
-static inline zz_err
-zz_and_sl(const zz_t *u, zz_slimb_t v, zz_t *w)
+/* Set r to the residue of the integer x.  Return -1 and set an exception
+   on errors. */
+static int
+mod_residue(const ModContext_Object *ctx, PyObject *x, uint64_t *r)
 {
-    if (!u->size || !v) {
-        return zz_from_sl(0, w);
+    MPZ_Object *u;
+    zz_slimb_t v = 0;
+    int error = 1;
+
+    if (PyLong_Check(x)) {
+        v = PyLong_AsSlimb_t(x, &error);
+    }
+    if (error) {
+        CHECK_OP_INT(u, x);
+        if (!MPZ_to_sl(u, &v)) {
+            zz_t *t = scratch_get();
+            zz_err ret = ZZ_MEM;
+
+            if (t) {
+                ret = zz_div_sl(&u->z, (zz_slimb_t)ctx->m, NULL, t);
+                if (ret == ZZ_OK) {
+                    ret = zz_to_sl(t, &v);
+                }
+                scratch_put(t);
+            }
+            if (ret) {
+                /* LCOV_EXCL_START */
+                Py_DECREF(u);
+                PyErr_NoMemory();
+                return -1;
+                /* LCOV_EXCL_STOP */
+            }
+        }
+        Py_DECREF(u);
     }
-    assert(!u->negative && v > 0);
-    return zz_from_sl((zz_slimb_t)(u->digits[0] & (zz_limb_t)v), w);
+    v %= (zz_slimb_t)ctx->m;
+    *r = v < 0 ? (uint64_t)v + ctx->m : (uint64_t)v;
+    return 0;
+end:
+    return -1;
 }
-#define zz_sl_and(x, y, r) zz_and_sl((y), (x), (r))
-
-BINOP_INTv2(and)
-BINOP_INT(or)
-BINOP_INT(xor)
+#else
+#  define mod_add NULL
+#  define mod_sub NULL
+#  define mod_mul NULL
+#endif
 
-static inline zz_err
-zz_lshift(const zz_t *u, const zz_t *v, zz_t *w)
+/* Return true, if 0 <= u < m. */
+static inline bool
+mod_isreduced(const ModContext_Object *ctx, const zz_t *u)
 {
-    if (zz_isneg(v)) {
-        return ZZ_VAL;
-    }
-    if (v->size > 1) {
-        return ZZ_BUF;
-    }
-    return zz_mul_2exp(u, v->size ? v->digits[0] : 0, w);
+    return !zz_isneg(u) && zz_cmp(u, &ctx->modulus->z) == ZZ_LT;
 }
 
-static inline zz_err
-zz_rshift(const zz_t *u, const zz_t *v, zz_t *w)
+/* Set r to t mod m for 0 <= t < m**2 with Barrett reduction.  The quotient
+   q = ((t >> (k - 1))*mu) >> (k + 1) is less than the exact one by at most
+   two, so t - q*m is reduced with at most two subtractions. */
+static zz_err
+mod_barrett(const ModContext_Object *ctx, const zz_t *t, zz_t *r)
 {
-    if (zz_isneg(v)) {
-        return ZZ_VAL;
+    const zz_t *m = &ctx->modulus->z;
+    zz_bitcnt_t k = zz_bitlen(m);
+    zz_t *q = scratch_get();
+
+    if (!q) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
     }
-    if (v->size > 1) {
-        return zz_from_sl(zz_isneg(u) ? -1 : 0, w);
+
+    zz_err ret = zz_quo_2exp(t, k - 1, q);
+
+    if (ret == ZZ_OK) {
+        ret = zz_mul(q, &ctx->mu->z, q);
     }
-    return zz_quo_2exp(u, v->size ? v->digits[0] : 0, w);
+    if (ret == ZZ_OK) {
+        ret = zz_quo_2exp(q, k + 1, q);
+    }
+    if (ret == ZZ_OK) {
+        ret = zz_mul(q, m, q);
+    }
+    if (ret == ZZ_OK) {
+        ret = zz_sub(t, q, r);
+    }
+    while (ret == ZZ_OK && zz_cmp(r, m) != ZZ_LT) {
+        ret = zz_sub(r, m, r);
+    }
+    scratch_put(q);
+    return ret;
 }
 
-BINOP_INT(lshift)
-BINOP_INT(rshift)
-
-static PyObject *
-power(PyObject *self, PyObject *other, PyObject *module)
+/* Return (u op v) mod m as a new object. */
+static MPZ_Object *
+mod_generic(const ModContext_Object *ctx, mod_binop op, const zz_t *u,
+            const zz_t *v)
 {
-    MPZ_Object *res = NULL;
-    MPZ_Object *u = NULL, *v = NULL;
+    const zz_t *m = &ctx->modulus->z;
 
-    CHECK_OP(u, self);
-    CHECK_OP(v, other);
-    if (Py_IsNone(module)) {
-        if (zz_isneg(&v->z)) {
-            PyObject *uf, *vf, *resf;
+    if (!memory_allows((double)(u->size + v->size + 1)*ZZ_LIMB_T_BITS)) {
+        return NULL;
+    }
 
-            uf = to_float((PyObject *)u);
-            Py_DECREF(u);
-            if (!uf) {
-                Py_DECREF(v);
-                return NULL;
+    zz_t *t = scratch_get();
+    MPZ_Object *res = t ? MPZ_new(m->size) : NULL;
+    zz_err ret = ZZ_MEM;
+
+    if (res) {
+        ret = op(u, v, t);
+        if (ret == ZZ_OK) {
+            if (ctx->mu && op == zz_mul && mod_isreduced(ctx, u)
+                && mod_isreduced(ctx, v))
+            {
+                ret = mod_barrett(ctx, t, &res->z);
             }
-            vf = to_float((PyObject *)v);
-            Py_DECREF(v);
-            if (!vf) {
-                Py_DECREF(uf);
-                return NULL;
+            else {
+                ret = zz_div(t, m, NULL, &res->z);
             }
-            resf = PyFloat_Type.tp_as_number->nb_power(uf, vf, Py_None);
-            Py_DECREF(uf);
-            Py_DECREF(vf);
-            return resf;
         }
-        res = MPZ_new();
+    }
+    if (t) {
+        scratch_put(t);
+    }
+    if (ret) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(res);
+        if (!PyErr_Occurred()) {
+            PyErr_NoMemory();
+        }
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    return MPZ_finish(res);
+}
 
-        zz_slimb_t exp;
+/* Return u**e mod m as a new object. */
+static MPZ_Object *
+mod_generic_pow(const ModContext_Object *ctx, const zz_t *u, const zz_t *e)
+{
+    MPZ_Object *res = MPZ_new(ctx->modulus->z.size);
+    zz_err ret = ZZ_MEM;
 
-        if (!res || zz_to_sl(&v->z, &exp)
-            || zz_pow(&u->z, (zz_limb_t)exp, &res->z))
-        {
-            /* LCOV_EXCL_START */
-            Py_CLEAR(res);
-            PyErr_SetNone(PyExc_MemoryError);
-            /* LCOV_EXCL_STOP */
+    if (res) {
+        ret = zz_powm(u, e, &ctx->modulus->z, &res->z);
+    }
+    if (ret) {
+        Py_XDECREF(res);
+        if (ret == ZZ_VAL) {
+            PyErr_SetString(PyExc_ValueError,
+                            "base is not invertible for the given modulus");
         }
-        Py_DECREF(u);
-        Py_DECREF(v);
-        return (PyObject *)res;
+        else if (!PyErr_Occurred()) {
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        }
+        return NULL;
     }
-    else {
-        MPZ_Object *w = NULL;
+    return MPZ_finish(res);
+}
 
-        CHECK_OP_INT(w, module);
+/* Set the exponent e for the fast path.  Return false, if it's not
+   applicable (e.g. for negative exponents). */
+static bool
+mod_exponent(PyObject *obj, uint64_t *e)
+{
+    zz_slimb_t v = -1;
 
-        zz_err ret = ZZ_OK;
+    if (PyLong_Check(obj)) {
+        int error;
 
-        res = MPZ_new();
-        if (!res || (ret = zz_powm(&u->z, &v->z, &w->z, &res->z))) {
-            /* LCOV_EXCL_START */
-            if (ret == ZZ_VAL) {
-                PyErr_SetString(PyExc_ValueError,
-                                "base is not invertible for the given modulus");
-            }
-            else {
-                PyErr_NoMemory();
-            }
-            Py_CLEAR(res);
-            /* LCOV_EXCL_STOP */
+        v = PyLong_AsSlimb_t(obj, &error);
+        if (error) {
+            return false;
         }
-        Py_DECREF(w);
     }
-end:
-    Py_XDECREF(u);
-    Py_XDECREF(v);
-    return (PyObject *)res;
-fallback:
-    Py_XDECREF(u);
-    Py_XDECREF(v);
-    Py_RETURN_NOTIMPLEMENTED;
-numbers:
-    Py_XDECREF(u);
-    Py_XDECREF(v);
-
-    PyObject *uf, *vf;
+    else if (MPZ_Check(obj)) {
+        bool ok;
 
-    if (Number_Check(self)) {
-        uf = self;
-        Py_INCREF(uf);
+        Py_BEGIN_CRITICAL_SECTION(obj);
+        ok = MPZ_to_sl((MPZ_Object *)obj, &v);
+        Py_END_CRITICAL_SECTION();
+        if (!ok) {
+            return false;
+        }
     }
-    else {
-        uf = to_float(self);
-        if (!uf) {
-            return NULL;
+    *e = (uint64_t)v;
+    return v >= 0;
+}
+
+/* Precompute data for the fast path, if the modulus is small enough. */
+static void
+ModContext_setup(ModContext_Object *ctx)
+{
+    ctx->m = ctx->minv = ctx->r1 = ctx->r2 = 0;
+    ctx->mu = NULL;
+#if defined(HAVE_MOD_WIDE)
+    zz_slimb_t v;
+
+    if (MPZ_to_sl(ctx->modulus, &v) && v > 0) {
+        ctx->m = (uint64_t)v;
+        if (ctx->m & 1) {
+            uint64_t inv = ctx->m;
+
+            /* Newton iteration, each step doubles the number of correct
+               bits (three for the initial value). */
+            for (int i = 0; i < 5; i++) {
+                inv *= 2 - ctx->m*inv;
+            }
+            ctx->minv = -inv;
         }
+        ctx->r1 = (0 - ctx->m) % ctx->m;
+        ctx->r2 = mod_mul(ctx, ctx->r1, ctx->r1);
     }
-    if (Number_Check(other)) {
-        vf = other;
-        Py_INCREF(vf);
+#endif
+}
+
+/* Precompute the reciprocal for Barrett reduction, if the modulus is big
+   enough.  Return -1 and set an exception on errors. */
+static int
+ModContext_setup_barrett(ModContext_Object *ctx)
+{
+    const zz_t *m = &ctx->modulus->z;
+    zz_bitcnt_t k = zz_bitlen(m);
+
+    if (k < MOD_BARRETT_BITS) {
+        return 0;
     }
-    else {
-        vf = to_float(other);
-        if (!vf) {
-            Py_DECREF(uf);
-            return NULL;
+
+    MPZ_Object *mu = MPZ_new(m->size + 1);
+    zz_t *t = mu ? scratch_get() : NULL;
+    zz_err ret = ZZ_MEM;
+
+    if (t) {
+        ret = zz_from_sl(1, t);
+        if (ret == ZZ_OK) {
+            ret = zz_mul_2exp(t, 2*k, t);
+        }
+        if (ret == ZZ_OK) {
+            ret = zz_div(t, m, &mu->z, NULL);
         }
+        scratch_put(t);
+    }
+    if (ret) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(mu);
+        PyErr_NoMemory();
+        return -1;
+        /* LCOV_EXCL_STOP */
     }
+    ctx->mu = MPZ_finish(mu);
+    return 0;
+}
 
-    PyObject *res2 = PyNumber_Power(uf, vf, Py_None);
+static PyObject *
+ModContext_new(PyTypeObject *type, PyObject *args, PyObject *keywds)
+{
+    static char *kwlist[] = {"modulus", NULL};
+    PyObject *arg;
 
-    Py_DECREF(uf);
-    Py_DECREF(vf);
-    return res2;
+    if (!PyArg_ParseTupleAndKeywords(args, keywds, "O", kwlist, &arg)) {
+        return NULL;
+    }
+
+    MPZ_Object *m = MPZ_own(arg);
+
+    if (!m) {
+        return NULL;
+    }
+    if (zz_cmp_sl(&m->z, 0) != ZZ_GT) {
+        Py_DECREF(m);
+        PyErr_SetString(PyExc_ValueError, "modulus must be positive");
+        return NULL;
+    }
+
+    ModContext_Object *ctx = (ModContext_Object *)type->tp_alloc(type, 0);
+
+    if (!ctx) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(m);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    ctx->modulus = m;
+    ModContext_setup(ctx);
+    if (ModContext_setup_barrett(ctx)) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(ctx);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    return (PyObject *)ctx;
 }
 
-static PyNumberMethods as_number = {
-    .nb_add = nb_add,
-    .nb_subtract = nb_sub,
-    .nb_multiply = nb_mul,
-    .nb_divmod = nb_divmod,
-    .nb_floor_divide = nb_quo_,
-    .nb_true_divide = nb_truediv,
-    .nb_remainder = nb_rem_,
-    .nb_power = power,
-    .nb_positive = plus,
-    .nb_negative = nb_negative,
-    .nb_absolute = nb_absolute,
-    .nb_invert = nb_invert,
-    .nb_lshift = nb_lshift,
-    .nb_rshift = nb_rshift,
-    .nb_and = nb_and,
-    .nb_or = nb_or,
-    .nb_xor = nb_xor,
-    .nb_int = to_int,
-    .nb_float = to_float,
-    .nb_index = to_int,
-    .nb_bool = to_bool,
-};
+static void
+ModContext_dealloc(PyObject *self)
+{
+    Py_DECREF(((ModContext_Object *)self)->modulus);
+    Py_XDECREF(((ModContext_Object *)self)->mu);
+    Py_TYPE(self)->tp_free(self);
+}
 
 static PyObject *
-get_copy(PyObject *self, void *Py_UNUSED(closure))
+ModContext_repr(PyObject *self)
 {
-    return Py_NewRef(self);
+    PyObject *str = MPZ_to_str(((ModContext_Object *)self)->modulus, 10, 0);
+
+    if (!str) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    Py_SETREF(str, PyUnicode_FromFormat("ModContext(%U)", str));
+    return str;
 }
 
 static PyObject *
-get_one(PyObject *Py_UNUSED(self), void *Py_UNUSED(closure))
+ModContext_binop(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
+                 mod_kernel kernel, mod_binop op)
 {
-    MPZ_Object *res = MPZ_new();
+    ModContext_Object *ctx = (ModContext_Object *)self;
 
-    if (res && zz_from_sl(1, &res->z)) {
-        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "two arguments required");
+        return NULL;
+    }
+#if defined(HAVE_MOD_WIDE)
+    if (ctx->m) {
+        uint64_t x, y;
+
+        if (mod_residue(ctx, args[0], &x) || mod_residue(ctx, args[1], &y)) {
+            return NULL;
+        }
+        return (PyObject *)MPZ_from_sl((zz_slimb_t)kernel(ctx, x, y));
     }
+#endif
+
+    MPZ_Object *u = NULL, *v = NULL, *res = NULL;
+
+    CHECK_OP_INT(u, args[0]);
+    CHECK_OP_INT(v, args[1]);
+    res = mod_generic(ctx, op, &u->z, &v->z);
+end:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
     return (PyObject *)res;
 }
 
 static PyObject *
-get_zero(PyObject *Py_UNUSED(self), void *Py_UNUSED(closure))
+ModContext_add(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
-    return (PyObject *)MPZ_new();
+    return ModContext_binop(self, args, nargs, mod_add, zz_add);
 }
 
-static PyGetSetDef getsetters[] = {
-    {"numerator", (getter)get_copy, NULL,
-     "the numerator of self (the value itself)", NULL},
-    {"denominator", (getter)get_one, NULL,
-     "the denominator of self (mpz(1))", NULL},
-    {"real", (getter)get_copy, NULL, "the real part of self (the value itself)",
-     NULL},
-    {"imag", (getter)get_zero, NULL, "the imaginary part of self (mpz(0))",
-     NULL},
-    {NULL} /* sentinel */
-};
-
 static PyObject *
-bit_length(PyObject *self, PyObject *Py_UNUSED(args))
+ModContext_sub(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
-    MPZ_Object *u = (MPZ_Object *)self;
-    zz_limb_t digit = zz_bitlen(&u->z);
+    return ModContext_binop(self, args, nargs, mod_sub, zz_sub);
+}
 
-    return PyLong_FromUnsignedLongLong(digit);
+static PyObject *
+ModContext_mul(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    return ModContext_binop(self, args, nargs, mod_mul, zz_mul);
 }
 
 static PyObject *
-bit_count(PyObject *self, PyObject *Py_UNUSED(args))
+ModContext_sqr(PyObject *self, PyObject *arg)
 {
-    MPZ_Object *u = (MPZ_Object *)self;
-    zz_bitcnt_t count = zz_bitcnt(&u->z);
+    PyObject *const args[2] = {arg, arg};
 
-    return PyLong_FromUnsignedLongLong(count);
+    return ModContext_binop(self, args, 2, mod_mul, zz_mul);
 }
 
 static PyObject *
-to_bytes(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
-         PyObject *kwnames)
+ModContext_pow(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
-    static const char *const keywords[] = {"length", "byteorder", "signed"};
-    const static gmp_pyargs fnargs = {
-        .keywords = keywords,
-        .maxpos = 2,
-        .minargs = 0,
-        .maxargs = 3,
-        .fname = "to_bytes",
-    };
-    Py_ssize_t argidx[3] = {-1, -1, -1};
+    ModContext_Object *ctx = (ModContext_Object *)self;
 
-    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "two arguments required");
         return NULL;
     }
+#if defined(HAVE_MOD_WIDE)
+    uint64_t x, e;
 
-    Py_ssize_t length = 1;
-    int is_little = 0, is_signed = 0;
-
-    if (argidx[0] >= 0) {
-        PyObject *arg = args[argidx[0]];
-
-        if (PyLong_Check(arg)) {
-            length = PyLong_AsSsize_t(arg);
-            if (length < 0) {
-                PyErr_SetString(PyExc_ValueError,
-                                "length argument must be non-negative");
-                return NULL;
-            }
-        }
-        else {
-            PyErr_SetString(PyExc_TypeError,
-                            "to_bytes() takes an integer argument 'length'");
+    if (ctx->m && mod_exponent(args[1], &e)) {
+        if (mod_residue(ctx, args[0], &x)) {
             return NULL;
         }
+        return (PyObject *)MPZ_from_sl((zz_slimb_t)mod_pow(ctx, x, e));
     }
-    if (argidx[1] >= 0) {
-        PyObject *arg = args[argidx[1]];
+#endif
 
-        if (PyUnicode_Check(arg)) {
-            const char *byteorder = PyUnicode_AsUTF8(arg);
+    MPZ_Object *u = NULL, *v = NULL, *res = NULL;
 
-            if (!byteorder) {
-                return NULL; /* LCOV_EXCL_LINE */
-            }
-            else if (strcmp(byteorder, "big") == 0) {
-                is_little = 0;
-            }
-            else if (strcmp(byteorder, "little") == 0) {
-                is_little = 1;
-            }
-            else {
-                PyErr_SetString(PyExc_ValueError,
-                                "byteorder must be either 'little' or 'big'");
-                return NULL;
-            }
+    CHECK_OP_INT(u, args[0]);
+    CHECK_OP_INT(v, args[1]);
+    res = mod_generic_pow(ctx, &u->z, &v->z);
+end:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    return (PyObject *)res;
+}
+
+static PyObject *
+ModContext_inv(PyObject *self, PyObject *arg)
+{
+    ModContext_Object *ctx = (ModContext_Object *)self;
+
+#if defined(HAVE_MOD_WIDE)
+    if (ctx->m) {
+        uint64_t x, r;
+
+        if (mod_residue(ctx, arg, &x)) {
+            return NULL;
         }
-        else {
-            PyErr_SetString(PyExc_TypeError,
-                            "to_bytes() argument 'byteorder' must be str");
+        if (!mod_inv(ctx, x, &r)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "base is not invertible for the given modulus");
             return NULL;
         }
+        return (PyObject *)MPZ_from_sl((zz_slimb_t)r);
     }
-    if (argidx[2] >= 0) {
-        is_signed = PyObject_IsTrue(args[argidx[2]]);
-    }
-    return MPZ_to_bytes((MPZ_Object *)self, length, is_little, is_signed);
-}
+#endif
 
-static PyObject *
-_from_bytes(PyObject *Py_UNUSED(type), PyObject *arg)
-{
-    return (PyObject *)MPZ_from_bytes(arg, 0, 1);
+    MPZ_Object *u = NULL, *res = NULL;
+
+    CHECK_OP_INT(u, arg);
+
+    MPZ_Object *e = MPZ_small(-1);
+
+    if (e) {
+        res = mod_generic_pow(ctx, &u->z, &e->z);
+        Py_DECREF(e);
+    }
+end:
+    Py_XDECREF(u);
+    return (PyObject *)res;
 }
 
 static PyObject *
-from_bytes(PyTypeObject *Py_UNUSED(type), PyObject *const *args,
-           Py_ssize_t nargs, PyObject *kwnames)
+ModContext_prod(PyObject *self, PyObject *iterable)
 {
-    static const char *const keywords[] = {"bytes", "byteorder", "signed"};
-    const static gmp_pyargs fnargs = {
-        .keywords = keywords,
-        .maxpos = 3,
-        .minargs = 1,
-        .maxargs = 3,
-        .fname = "from_bytes",
-    };
-    Py_ssize_t argidx[3] = {-1, -1, -1};
+    ModContext_Object *ctx = (ModContext_Object *)self;
+    PyObject *it = PyObject_GetIter(iterable), *item;
 
-    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+    if (!it) {
         return NULL;
     }
+#if defined(HAVE_MOD_WIDE)
+    if (ctx->m) {
+        uint64_t r = 1 % ctx->m, x;
 
-    int is_little = 0, is_signed = 0;
-
-    if (argidx[1] >= 0) {
-        PyObject *arg = args[argidx[1]];
+        while ((item = PyIter_Next(it))) {
+            int err = mod_residue(ctx, item, &x);
 
-        if (PyUnicode_Check(arg)) {
-            const char *byteorder = PyUnicode_AsUTF8(arg);
-
-            if (!byteorder) {
-                return NULL; /* LCOV_EXCL_LINE */
-            }
-            else if (strcmp(byteorder, "big") == 0) {
-                is_little = 0;
-            }
-            else if (strcmp(byteorder, "little") == 0) {
-                is_little = 1;
-            }
-            else {
-                PyErr_SetString(PyExc_ValueError,
-                                ("byteorder must be either 'little'"
-                                 " or 'big'"));
+            Py_DECREF(item);
+            if (err) {
+                Py_DECREF(it);
                 return NULL;
             }
+            r = mod_mul(ctx, r, x);
         }
-        else {
-            PyErr_SetString(PyExc_TypeError,
-                            ("from_bytes() argument 'byteorder'"
-                             " must be str"));
+        Py_DECREF(it);
+        if (PyErr_Occurred()) {
             return NULL;
         }
+        return (PyObject *)MPZ_from_sl((zz_slimb_t)r);
+    }
+#endif
+
+    MPZ_Object *res = MPZ_small(1);
+
+    while (res && (item = PyIter_Next(it))) {
+        MPZ_Object *u = (MPZ_Check(item) ? MPZ_operand(item)
+                         : MPZ_borrow_int(item));
+
+        Py_DECREF(item);
+        if (!u) {
+            Py_CLEAR(res);
+            break;
+        }
+        Py_SETREF(res, mod_generic(ctx, zz_mul, &res->z, &u->z));
+        Py_DECREF(u);
     }
-    if (argidx[2] >= 0) {
-        is_signed = PyObject_IsTrue(args[argidx[2]]);
+    Py_DECREF(it);
+    if (PyErr_Occurred()) {
+        Py_CLEAR(res);
     }
-    return (PyObject *)MPZ_from_bytes(args[argidx[0]], is_little, is_signed);
+    return (PyObject *)res;
 }
 
 static PyObject *
-as_integer_ratio(PyObject *self, PyObject *Py_UNUSED(args))
+ModContext_get_modulus(PyObject *self, void *Py_UNUSED(closure))
 {
-    PyObject *one = get_one(NULL, NULL);
+    return Py_NewRef(((ModContext_Object *)self)->modulus);
+}
 
-    if (!one) {
-        return NULL; /* LCOV_EXCL_LINE */
-    }
+static PyGetSetDef ModContext_getsetters[] = {
+    {"modulus", (getter)ModContext_get_modulus, NULL, "the modulus", NULL},
+    {NULL} /* sentinel */
+};
 
-    PyObject *u = Py_NewRef(self);
-    PyObject *ratio_tuple = PyTuple_Pack(2, u, one);
+static PyMethodDef ModContext_methods[] = {
+    {"add", (PyCFunction)ModContext_add, METH_FASTCALL,
+     ("add($self, x, y, /)\n--\n\nReturn (x + y) mod m.")},
+    {"sub", (PyCFunction)ModContext_sub, METH_FASTCALL,
+     ("sub($self, x, y, /)\n--\n\nReturn (x - y) mod m.")},
+    {"mul", (PyCFunction)ModContext_mul, METH_FASTCALL,
+     ("mul($self, x, y, /)\n--\n\nReturn x*y mod m.")},
+    {"sqr", ModContext_sqr, METH_O,
+     ("sqr($self, x, /)\n--\n\nReturn x*x mod m.")},
+    {"pow", (PyCFunction)ModContext_pow, METH_FASTCALL,
+     ("pow($self, x, e, /)\n--\n\n"
+      "Return x**e mod m.\n\n"
+      "Negative exponents are allowed, if x is invertible.")},
+    {"inv", ModContext_inv, METH_O,
+     ("inv($self, x, /)\n--\n\n"
+      "Return the inverse of x modulo m.\n\n"
+      "A ValueError is raised, if x is not invertible.")},
+    {"prod", ModContext_prod, METH_O,
+     ("prod($self, iterable, /)\n--\n\n"
+      "Return the product of integers of the iterable modulo m.")},
+    {NULL} /* sentinel */
+};
 
-    Py_DECREF(u);
-    Py_DECREF(one);
-    return ratio_tuple;
+PyDoc_STRVAR(ModContext_doc,
+             "ModContext(modulus)\n\n\
+Context for arithmetic modulo a fixed positive integer m.\n\n\
+Methods accept int or mpz arguments and return mpz values in range\n\
+0 <= x < m.  The modulus is validated once.  For moduli less than\n\
+2**63, the context uses native machine arithmetic with precomputed\n\
+constants for the reduction.");
+
+static PyTypeObject ModContext_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "gmp.ModContext",
+    .tp_basicsize = sizeof(ModContext_Object),
+    .tp_new = ModContext_new,
+    .tp_dealloc = ModContext_dealloc,
+    .tp_repr = ModContext_repr,
+    .tp_getset = ModContext_getsetters,
+    .tp_methods = ModContext_methods,
+    .tp_doc = ModContext_doc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+typedef struct {
+    MPZ_Object *base;
+    MPZ_Object *exp;
+    MPZ_Object *res; /* NULL for the fast path */
+    uint64_t x; /* residue of the base (then result) for the fast path */
+    uint64_t e;
+    zz_err ret;
+} powm_item;
+
+typedef struct {
+    const ModContext_Object *ctx;
+    powm_item *items;
+} powm_data;
+
+static void
+powm_task(void *data, size_t i)
+{
+    const powm_data *d = data;
+    powm_item *item = &d->items[i];
+
+#if defined(HAVE_MOD_WIDE)
+    if (!item->res) {
+        item->x = mod_pow(d->ctx, item->x, item->e);
+        return;
+    }
+#endif
+    item->ret = zz_powm(&item->base->z, &item->exp->z, &d->ctx->modulus->z,
+                        &item->res->z);
+}
+
+static int
+powm_item_init(const ModContext_Object *ctx, powm_item *item,
+               PyObject *base, PyObject *exp)
+{
+#if defined(HAVE_MOD_WIDE)
+    if (ctx->m && mod_exponent(exp, &item->e)) {
+        return mod_residue(ctx, base, &item->x);
+    }
+#endif
+    if (!(item->base = MPZ_own(base)) || !(item->exp = MPZ_own(exp))
+        || !(item->res = MPZ_new(ctx->modulus->z.size)))
+    {
+        return -1;
+    }
+    return 0;
 }
 
 static PyObject *
-__round__(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
+gmp_powm_batch(PyObject *Py_UNUSED(module), PyObject *const *args,
+               Py_ssize_t nargs, PyObject *kwnames)
 {
-    if (nargs > 1) {
-        PyErr_Format(PyExc_TypeError,
-                     "__round__ expected at most 1 argument, got %zu");
+    static const char *const keywords[] = {"bases", "exps", "mod",
+                                           "threads"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 3,
+        .minargs = 3,
+        .maxargs = 4,
+        .fname = "powm_batch",
+    };
+    Py_ssize_t argidx[4] = {-1, -1, -1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
         return NULL;
     }
 
-    MPZ_Object *u = (MPZ_Object *)self;
+    PyObject *bases = args[argidx[0]], *exps = args[argidx[1]];
+    PyObject *mod = args[argidx[2]];
+    Py_ssize_t threads = 1;
 
-    if (!nargs) {
-noop:
-        return plus(self);
+    if (argidx[3] >= 0) {
+        threads = PyLong_AsSsize_t(args[argidx[3]]);
+        if (threads == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (threads < 1) {
+            PyErr_SetString(PyExc_ValueError, "threads must be positive");
+            return NULL;
+        }
     }
 
-    MPZ_Object *ndigits = NULL;
-
-    CHECK_OP_INT(ndigits, args[0]);
+    ModContext_Object tmp, *ctx = &tmp;
 
-    if (zz_isneg(&ndigits->z)) {
-        (void)zz_neg(&ndigits->z, &ndigits->z);
+    if (Py_IS_TYPE(mod, &ModContext_Type)) {
+        ctx = (ModContext_Object *)mod;
     }
     else {
-        Py_DECREF(ndigits);
-        goto noop;
+        tmp.modulus = MPZ_own(mod);
+        if (!tmp.modulus) {
+            return NULL;
+        }
+        if (zz_iszero(&tmp.modulus->z)) {
+            Py_DECREF(tmp.modulus);
+            PyErr_SetString(PyExc_ValueError, "modulus must be nonzero");
+            return NULL;
+        }
+        ModContext_setup(&tmp);
     }
 
-    MPZ_Object *ten = MPZ_new();
+    /* Scalar arguments are broadcasted. */
+    bool scalar_bases = PyLong_Check(bases) || MPZ_Check(bases);
+    bool scalar_exps = PyLong_Check(exps) || MPZ_Check(exps);
+    PyObject *res = NULL;
+    powm_item *items = NULL;
+    Py_ssize_t n = 1, i = 0;
+
+    bases = (scalar_bases ? Py_NewRef(bases)
+             : PySequence_Fast(bases, "bases must be an integer or iterable"));
+    exps = (scalar_exps ? Py_NewRef(exps)
+            : PySequence_Fast(exps, "exps must be an integer or iterable"));
+    if (!bases || !exps) {
+        goto end;
+    }
+    if (!scalar_bases) {
+        n = PySequence_Fast_GET_SIZE(bases);
+    }
+    if (!scalar_exps) {
+        if (!scalar_bases && PySequence_Fast_GET_SIZE(exps) != n) {
+            PyErr_SetString(PyExc_ValueError,
+                            "bases and exps must have the same length");
+            goto end;
+        }
+        n = PySequence_Fast_GET_SIZE(exps);
+    }
+    items = PyMem_Calloc((size_t)n + 1, sizeof(powm_item));
+    if (!items) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    for (i = 0; i < n; i++) {
+        PyObject *b = (scalar_bases ? bases
+                       : PySequence_Fast_GET_ITEM(bases, i));
+        PyObject *e = (scalar_exps ? exps
+                       : PySequence_Fast_GET_ITEM(exps, i));
 
-    if (!ten || zz_from_sl(10, &ten->z)) {
-        /* LCOV_EXCL_START */
-        Py_DECREF(ndigits);
-        Py_XDECREF(ten);
-        return NULL;
-        /* LCOV_EXCL_STOP */
+        if (powm_item_init(ctx, &items[i], b, e)) {
+            i++;
+            goto end;
+        }
     }
 
-    PyObject *p = power((PyObject *)ten, (PyObject *)ndigits, Py_None);
+    powm_data data = {ctx, items};
 
-    Py_DECREF(ten);
-    Py_DECREF(ndigits);
-    if (!p) {
-        return NULL; /* LCOV_EXCL_LINE */
+    Py_BEGIN_ALLOW_THREADS
+    gmp_parallel_for((size_t)n, (size_t)threads, powm_task, &data);
+    Py_END_ALLOW_THREADS
+
+    res = PyList_New(n);
+    if (!res) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    for (Py_ssize_t j = 0; j < n; j++) {
+        powm_item *item = &items[j];
+        MPZ_Object *r;
+
+        if (item->ret == ZZ_VAL) {
+            PyErr_SetString(PyExc_ValueError,
+                            "base is not invertible for the given modulus");
+            Py_CLEAR(res);
+            goto end;
+        }
+        if (item->ret) {
+            /* LCOV_EXCL_START */
+            PyErr_NoMemory();
+            Py_CLEAR(res);
+            goto end;
+            /* LCOV_EXCL_STOP */
+        }
+        if (item->res) {
+            r = MPZ_finish(item->res);
+            item->res = NULL;
+        }
+        else {
+            r = MPZ_from_sl((zz_slimb_t)item->x);
+            if (!r) {
+                /* LCOV_EXCL_START */
+                Py_CLEAR(res);
+                goto end;
+                /* LCOV_EXCL_STOP */
+            }
+        }
+        PyList_SET_ITEM(res, j, (PyObject *)r);
     }
+end:
+    while (items && i--) {
+        Py_XDECREF(items[i].base);
+        Py_XDECREF(items[i].exp);
+        Py_XDECREF(items[i].res);
+    }
+    PyMem_Free(items);
+    Py_XDECREF(bases);
+    Py_XDECREF(exps);
+    if (ctx == &tmp) {
+        Py_DECREF(tmp.modulus);
+    }
+    return res;
+}
 
-    MPZ_Object *r = MPZ_new();
+static PyObject *
+gmp_mul(PyObject *Py_UNUSED(module), PyObject *const *args,
+        Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const keywords[] = {"a", "b", "threads"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 2,
+        .minargs = 2,
+        .maxargs = 3,
+        .fname = "mul",
+    };
+    Py_ssize_t argidx[3] = {-1, -1, -1};
 
-    if (!r) {
-        /* LCOV_EXCL_START */
-        Py_XDECREF(r);
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
         return NULL;
-        /* LCOV_EXCL_STOP */
     }
-    if (zz_divnear(&u->z, &((MPZ_Object *)p)->z, NULL, &r->z)) {
-        /* LCOV_EXCL_START */
-        Py_DECREF(r);
-        return PyErr_NoMemory();
-        /* LCOV_EXCL_STOP */
+
+    Py_ssize_t threads = 0;
+
+    if (argidx[2] >= 0 && args[argidx[2]] != Py_None) {
+        threads = PyLong_AsSsize_t(args[argidx[2]]);
+        if (threads == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (threads < 1) {
+            PyErr_SetString(PyExc_ValueError, "threads must be positive");
+            return NULL;
+        }
     }
-    Py_DECREF(p);
 
-    MPZ_Object *res = MPZ_new();
+    MPZ_Object *u = NULL, *v = NULL, *res = NULL;
+    zz_err ret = ZZ_OK;
 
-    if (!res || zz_sub(&u->z, &r->z, &res->z)) {
-        /* LCOV_EXCL_START */
-        Py_DECREF(r);
-        Py_XDECREF(res);
-        return PyErr_NoMemory();
-        /* LCOV_EXCL_STOP */
+    CHECK_OP_INT(u, args[argidx[0]]);
+    CHECK_OP_INT(v, args[argidx[1]]);
+    res = MPZ_new(u->z.size + v->z.size);
+    if (res) {
+        NOGIL_IF(MPZ_nogil(u, v, mul_work(u->z.size, v->z.size)),
+                 ret = (threads ? zz_mul_threads(&u->z, &v->z, &res->z,
+                                                 (size_t)threads)
+                        : big_mul(&u->z, &v->z, &res->z)))
+        if (ret) {
+            /* LCOV_EXCL_START */
+            Py_CLEAR(res);
+            PyErr_NoMemory();
+            /* LCOV_EXCL_STOP */
+        }
     }
-    Py_DECREF(r);
-    return (PyObject *)res;
 end:
-    return NULL;
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    return (PyObject *)MPZ_finish(res);
 }
 
-static PyObject *
-__reduce_ex__(PyObject *self, PyObject *Py_UNUSED(args))
+/* Values for the product tree of gmp.prod(). */
+typedef struct {
+    zz_t *items;
+    size_t len, alloc;
+    zz_slimb_t acc;   /* product of pending small values */
+} prod_state;
+
+/* Append a copy of u (or of the acc value, if u is NULL) to items. */
+static int
+prod_push(prod_state *st, const zz_t *u)
 {
-    MPZ_Object *u = (MPZ_Object *)self;
-    zz_bitcnt_t len = zz_bitlen(&u->z);
+    if (st->len == st->alloc) {
+        size_t alloc = 2*st->alloc + 16;
+        zz_t *items = PyMem_Realloc(st->items, alloc*sizeof(zz_t));
 
-    return Py_BuildValue("N(N)",
-                         PyObject_GetAttrString(self, "_from_bytes"),
-                         MPZ_to_bytes(u, (Py_ssize_t)(len + 7)/8 + 1, 0, 1));
-}
+        if (!items) {
+            PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        st->items = items;
+        st->alloc = alloc;
+    }
 
-static PyObject *
-__sizeof__(PyObject *self, PyObject *Py_UNUSED(ignored))
-{
-    MPZ_Object *u = (MPZ_Object *)self;
+    zz_t *t = &st->items[st->len];
 
-    return PyLong_FromSize_t(sizeof(MPZ_Object)
-                             + (unsigned int)(u->z).alloc*sizeof(zz_limb_t));
+    if (zz_init(t)) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    st->len++;
+    if (u ? zz_copy(u, t) : zz_from_sl(st->acc, t)) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    return 0;
 }
 
-static PyObject *
-is_integer(PyObject *Py_UNUSED(self), PyObject *Py_UNUSED(args))
+/* Multiply the integer obj into the product.  Small values are packed into
+   the acc, big ones are copied (values of xmpz may change, while the GIL is
+   released). */
+static int
+prod_add(prod_state *st, PyObject *obj)
 {
-    Py_RETURN_TRUE;
+    zz_slimb_t v = 0, r;
+    int error = 0;
+
+    if (MPZ_Check(obj)) {
+        int ret = 1;
+
+        Py_BEGIN_CRITICAL_SECTION(obj);
+        if (!MPZ_to_sl((MPZ_Object *)obj, &v)) {
+            ret = prod_push(st, &((MPZ_Object *)obj)->z);
+        }
+        Py_END_CRITICAL_SECTION();
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+    else if (PyLong_Check(obj)) {
+        v = PyLong_AsSlimb_t(obj, &error);
+        if (error) {
+            MPZ_Object *u = MPZ_borrow_int(obj);
+
+            if (!u) {
+                return -1; /* LCOV_EXCL_LINE */
+            }
+            error = prod_push(st, &u->z);
+            Py_DECREF(u);
+            return error;
+        }
+    }
+    else {
+        PyErr_Format(PyExc_TypeError,
+                     "prod() accepts only integers, got %s",
+                     Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    if (sl_mul_overflow(st->acc, v, &r)) {
+        if (prod_push(st, NULL)) {
+            return -1; /* LCOV_EXCL_LINE */
+        }
+        r = v;
+    }
+    st->acc = r;
+    return 0;
 }
 
 static PyObject *
-digits(PyObject *self, PyObject *const *args, Py_ssize_t nargs,
-       PyObject *kwnames)
+gmp_prod(PyObject *Py_UNUSED(module), PyObject *const *args,
+         Py_ssize_t nargs, PyObject *kwnames)
 {
-    static const char *const keywords[] = {"base"};
+    static const char *const keywords[] = {"", "start", "threads"};
     const static gmp_pyargs fnargs = {
         .keywords = keywords,
         .maxpos = 1,
-        .minargs = 0,
-        .maxargs = 1,
-        .fname = "digits",
+        .minargs = 1,
+        .maxargs = 3,
+        .fname = "prod",
     };
-    Py_ssize_t argidx[1] = {-1};
+    Py_ssize_t argidx[3] = {-1, -1, -1};
 
     if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
         return NULL;
     }
 
-    int base = 10;
-
-    if (argidx[0] != -1) {
-        PyObject *arg = args[argidx[0]];
+    Py_ssize_t threads = (Py_ssize_t)parallel_threads;
 
-        if (PyLong_Check(arg)) {
-            base = PyLong_AsInt(args[argidx[0]]);
-            if (base == -1 && PyErr_Occurred()) {
-                return NULL;
-            }
+    if (argidx[2] >= 0 && args[argidx[2]] != Py_None) {
+        threads = PyLong_AsSsize_t(args[argidx[2]]);
+        if (threads == -1 && PyErr_Occurred()) {
+            return NULL;
         }
-        else {
-            PyErr_SetString(PyExc_TypeError,
-                            "digits() takes an integer argument 'base'");
+        if (threads < 1) {
+            PyErr_SetString(PyExc_ValueError, "threads must be positive");
             return NULL;
         }
     }
-    return MPZ_to_str((MPZ_Object *)self, base, 0);
-}
 
-PyDoc_STRVAR(
-    to_bytes__doc__,
-    "to_bytes($self, /, length=1, byteorder=\'big\', *, signed=False)\n--\n\n\
-Return an array of bytes representing self.\n\n\
-The integer is represented using length bytes.  An OverflowError is\n\
-raised if self is not representable with the given number of bytes.\n\n\
-The byteorder argument determines the byte order used to represent self.\n\
-Accepted values are \'big\' and \'little\', when the most significant\n\
-byte is at the beginning or at the end of the byte array, respectively.\n\n\
-The signed argument determines whether two\'s complement is used to\n\
-represent self.  If signed is False and a negative integer is given,\n\
-an OverflowError is raised.");
-PyDoc_STRVAR(
-    from_bytes__doc__,
-    "from_bytes($type, /, bytes, byteorder=\'big\', *, signed=False)\n--\n\n\
-Return the integer represented by the given array of bytes.\n\n\
-The argument bytes must either be a bytes-like object or an iterable\n\
-producing bytes.\n\n\
-The byteorder argument determines the byte order used to represent the\n\
-integer.  Accepted values are \'big\' and \'little\', when the most\n\
-significant byte is at the beginning or at the end of the byte array,\n\
-respectively.\n\n\
-The signed argument indicates whether two’s complement is used.");
+    PyObject *it = PyObject_GetIter(args[argidx[0]]), *item;
+    prod_state st = {NULL, 0, 0, 1};
+    MPZ_Object *res = NULL;
+
+    if (!it) {
+        return NULL;
+    }
+    if (argidx[1] >= 0 && prod_add(&st, args[argidx[1]])) {
+        goto end;
+    }
+    while ((item = PyIter_Next(it))) {
+        int ret = prod_add(&st, item);
+
+        Py_DECREF(item);
+        if (ret) {
+            goto end;
+        }
+    }
+    if (PyErr_Occurred()
+        || ((st.acc != 1 || !st.len) && prod_push(&st, NULL)))
+    {
+        goto end;
+    }
 
-extern PyObject * __format__(PyObject *self, PyObject *format_spec);
+    zz_size_t limbs = 0;
 
-static PyMethodDef methods[] = {
-    {"conjugate", (PyCFunction)plus, METH_NOARGS,
-     "Returns self."},
-    {"bit_length", bit_length, METH_NOARGS,
-     "Number of bits necessary to represent self in binary."},
-    {"bit_count", bit_count, METH_NOARGS,
-     ("Number of ones in the binary representation of the "
-      "absolute value of self.")},
-    {"to_bytes", (PyCFunction)to_bytes, METH_FASTCALL | METH_KEYWORDS,
-     to_bytes__doc__},
-    {"from_bytes", (PyCFunction)from_bytes,
-     METH_FASTCALL | METH_KEYWORDS | METH_CLASS, from_bytes__doc__},
-    {"as_integer_ratio", as_integer_ratio, METH_NOARGS,
-     ("Return a pair of integers, whose ratio is equal to self.\n\n"
-      "The ratio is in lowest terms and has a positive denominator.")},
-    {"__trunc__", (PyCFunction)plus, METH_NOARGS, "Returns self."},
-    {"__floor__", (PyCFunction)plus, METH_NOARGS, "Returns self."},
-    {"__ceil__", (PyCFunction)plus, METH_NOARGS, "Returns self."},
-    {"__round__", (PyCFunction)__round__, METH_FASTCALL,
-     ("__round__($self, ndigits=0, /)\n--\n\n"
-      "Round self to to the closest multiple of 10**-ndigits\n\n"
-      "Always return an integer.  If two multiples are equally close,\n"
-      "rounding is done toward the even choice.")},
-    {"__reduce_ex__", __reduce_ex__, METH_O,
-     ("__reduce_ex__($self, protocol, /)\n--\n\n"
-      "Return state information for pickling.")},
-    {"__format__", __format__, METH_O,
-     ("__format__($self, format_spec, /)\n--\n\n"
-      "Convert self to a string according to format_spec.")},
-    {"__sizeof__", __sizeof__, METH_NOARGS,
-     "Returns size of self in memory, in bytes."},
-    {"is_integer", is_integer, METH_NOARGS, "Returns True."},
-    {"digits", (PyCFunction)digits, METH_FASTCALL | METH_KEYWORDS,
-     ("digits($self, base=10)\n--\n\n"
-      "Return string representing self in the given base.\n\n"
-      "Values for base can range between 2 to 36.")},
-    {"_from_bytes", _from_bytes, METH_O | METH_CLASS, NULL},
-    {NULL} /* sentinel */
-};
+    for (size_t i = 0; i < st.len; i++) {
+        limbs += st.items[i].size;
+    }
+    if (!memory_allows((double)limbs*ZZ_LIMB_T_BITS)) {
+        goto end;
+    }
+    res = MPZ_new(0);
+    if (!res) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
 
-PyDoc_STRVAR(mpz_doc,
-             "mpz(number=0, /)\nmpz(string, /, base=10)\n\n\
-Convert a number or a string to an integer.  If numeric argument is not\n\
-an int subclass, return mpz(int(number)).\n\n\
-If argument is not a number or if base is given, then it must be a string,\n\
-bytes, or bytearray instance representing an integer literal in the\n\
-given base.  The literal can be preceded by '+' or '-' and be surrounded\n\
-by whitespace.  Valid bases are 0 and 2-36.  Base 0 means to interpret \n\
-the base from the string as an integer literal.");
+    zz_err ret;
+    size_t n = st.len;
 
-PyTypeObject MPZ_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_name = "gmp.mpz",
-    .tp_basicsize = sizeof(MPZ_Object),
-    .tp_new = new,
-    .tp_dealloc = dealloc,
-    .tp_repr = repr,
-    .tp_str = str,
-    .tp_richcompare = richcompare,
-    .tp_hash = hash,
-    .tp_as_number = &as_number,
-    .tp_getset = getsetters,
-    .tp_methods = methods,
-    .tp_doc = mpz_doc,
-    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
-    .tp_vectorcall = vectorcall,
-};
+    /* All values are owned by the state. */
+    NOGIL_IF(MPZ_nogil(NULL, NULL, mul_work(limbs/2, limbs/2)),
+             ret = zz_prod_threads(st.items, n, (size_t)threads))
+    st.len = 1;
+    if (ret) {
+        /* LCOV_EXCL_START */
+        Py_CLEAR(res);
+        PyErr_NoMemory();
+        goto end;
+        /* LCOV_EXCL_STOP */
+    }
+
+    zz_t tmp = res->z;
+
+    res->z = st.items[0];
+    st.items[0] = tmp;
+end:
+    Py_DECREF(it);
+    while (st.len) {
+        zz_clear(&st.items[--st.len]);
+    }
+    PyMem_Free(st.items);
+    return (PyObject *)MPZ_finish(res);
+}
 
 static PyObject *
 gmp_gcd(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
 {
-    MPZ_Object *res = MPZ_new();
+    MPZ_Object *res = MPZ_new(0);
 
     if (!res) {
         return (PyObject *)res; /* LCOV_EXCL_LINE */
@@ -2059,7 +5872,7 @@ gmp_gcd(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
         }
         Py_DECREF(arg);
     }
-    return (PyObject *)res;
+    return (PyObject *)MPZ_finish(res);
 end:
     Py_DECREF(res);
     return NULL;
@@ -2074,7 +5887,7 @@ gmp_gcdext(PyObject *Py_UNUSED(module), PyObject *const *args,
         return NULL;
     }
     MPZ_Object *x = NULL, *y = NULL;
-    MPZ_Object *g = MPZ_new(), *s = MPZ_new(), *t = MPZ_new();
+    MPZ_Object *g = MPZ_new(0), *s = MPZ_new(0), *t = MPZ_new(0);
 
     if (!g || !s || !t) {
         /* LCOV_EXCL_START */
@@ -2094,6 +5907,10 @@ gmp_gcdext(PyObject *Py_UNUSED(module), PyObject *const *args,
     if (ret == ZZ_MEM) {
         return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
     }
+    g = MPZ_finish(g);
+    s = MPZ_finish(s);
+    t = MPZ_finish(t);
+
     PyObject *tup = PyTuple_Pack(3, g, s, t);
 
     Py_DECREF(g);
@@ -2112,7 +5929,7 @@ end:
 static PyObject *
 gmp_lcm(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
 {
-    MPZ_Object *res = MPZ_new();
+    MPZ_Object *res = MPZ_new(0);
 
     if (!res || zz_from_sl(1, &res->z)) {
         return PyErr_NoMemory(); /* LCOV_EXCL_LINE */
@@ -2134,79 +5951,494 @@ gmp_lcm(PyObject *Py_UNUSED(module), PyObject *const *args, Py_ssize_t nargs)
         }
         Py_DECREF(arg);
     }
-    return (PyObject *)res;
+    return (PyObject *)MPZ_finish(res);
 end:
     Py_DECREF(res);
     return NULL;
 }
 
+/* Return acc + x*y (or acc - x*y, if negate is set), without a temporary
+   object for the product.  If acc is an xmpz, the result is stored in
+   place. */
+static PyObject *
+muladd(PyObject *const *args, Py_ssize_t nargs, bool negate)
+{
+    if (nargs != 3) {
+        PyErr_SetString(PyExc_TypeError, "three arguments required");
+        return NULL;
+    }
+
+    MPZ_Object *u = NULL, *v = NULL, *w = NULL, *res = NULL;
+    zz_slimb_t temp = 0;
+    int error = 1;
+    PyObject *acc = args[0];
+
+    if (XMPZ_Check(acc)) {
+        /* Changed in place below, with acc locked. */
+        u = (MPZ_Object *)Py_NewRef(acc);
+    }
+    else {
+        CHECK_OP_INT(u, acc);
+    }
+    CHECK_OP_INT(v, args[1]);
+    if (PyLong_Check(args[2])) {
+        temp = PyLong_AsSlimb_t(args[2], &error);
+    }
+    if (error) {
+        CHECK_OP_INT(w, args[2]);
+    }
+    if (!memory_allows((double)(v->z.size + (w ? w->z.size : 1))
+                       * ZZ_LIMB_T_BITS))
+    {
+        goto end;
+    }
+
+    zz_t *prod = scratch_get();
+    zz_err ret = ZZ_MEM;
+
+    if (prod) {
+        ret = w ? zz_mul(&v->z, &w->z, prod) : zz_mul_sl(&v->z, temp, prod);
+    }
+    if (ret == ZZ_OK) {
+        if (XMPZ_Check(acc)) {
+            zz_limb_t *digits;
+            PyObject *out;
+
+            Py_BEGIN_CRITICAL_SECTION(acc);
+            digits = u->z.digits;
+            ret = ZZ_MEM;
+            if (memory_allows((double)add_size(u->z.size, prod->size)
+                              * ZZ_LIMB_T_BITS))
+            {
+                ret = (negate ? zz_sub : zz_add)(&u->z, prod, &u->z);
+            }
+            out = XMPZ_result(acc, ret, digits, NULL, NULL);
+            Py_END_CRITICAL_SECTION();
+            scratch_put(prod);
+            Py_DECREF(v);
+            Py_XDECREF(w);
+            Py_DECREF(u);
+            return out;
+        }
+        res = MPZ_new(add_size(u->z.size, prod->size));
+        ret = res ? (negate ? zz_sub : zz_add)(&u->z, prod, &res->z) : ZZ_MEM;
+    }
+    if (prod) {
+        scratch_put(prod);
+    }
+    if (ret) {
+        /* LCOV_EXCL_START */
+        Py_CLEAR(res);
+        if (!PyErr_Occurred()) {
+            PyErr_NoMemory();
+        }
+        /* LCOV_EXCL_STOP */
+    }
+end:
+    Py_XDECREF(u);
+    Py_XDECREF(v);
+    Py_XDECREF(w);
+    return (PyObject *)MPZ_finish(res);
+}
+
+static PyObject *
+gmp_addmul(PyObject *Py_UNUSED(module), PyObject *const *args,
+           Py_ssize_t nargs)
+{
+    return muladd(args, nargs, false);
+}
+
+static PyObject *
+gmp_submul(PyObject *Py_UNUSED(module), PyObject *const *args,
+           Py_ssize_t nargs)
+{
+    return muladd(args, nargs, true);
+}
+
 static PyObject *
 gmp_isqrt(PyObject *Py_UNUSED(module), PyObject *arg)
 {
-    MPZ_Object *x, *root = MPZ_new();
+    MPZ_Object *x, *root = MPZ_new(0);
 
     if (!root) {
         return NULL; /* LCOV_EXCL_LINE */
     }
-    CHECK_OP_INT(x, arg);
+    CHECK_OP_INT(x, arg);
+
+    zz_err ret;
+
+    NOGIL_IF(MPZ_nogil(x, NULL, mul_work(x->z.size, x->z.size)),
+             ret = zz_sqrtrem(&x->z, &root->z, NULL))
+
+    Py_DECREF(x);
+    if (ret == ZZ_OK) {
+        return (PyObject *)MPZ_finish(root);
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "isqrt() argument must be nonnegative");
+    }
+    if (ret == ZZ_MEM) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+end:
+    Py_DECREF(root);
+    return NULL;
+}
+
+static PyObject *
+gmp_isqrt_rem(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    MPZ_Object *x, *root = MPZ_new(0), *rem = MPZ_new(0);
+    PyObject *tup = NULL;
+
+    if (!root || !rem) {
+        /* LCOV_EXCL_START */
+        Py_XDECREF(root);
+        Py_XDECREF(rem);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    CHECK_OP_INT(x, arg);
+
+    zz_err ret;
+
+    NOGIL_IF(MPZ_nogil(x, NULL, mul_work(x->z.size, x->z.size)),
+             ret = zz_sqrtrem(&x->z, &root->z, &rem->z))
+
+    Py_DECREF(x);
+    if (ret == ZZ_OK) {
+        root = MPZ_finish(root);
+        rem = MPZ_finish(rem);
+        tup = PyTuple_Pack(2, root, rem);
+    }
+    if (ret == ZZ_VAL) {
+        PyErr_SetString(PyExc_ValueError,
+                        "isqrt() argument must be nonnegative");
+    }
+    if (ret == ZZ_MEM) {
+        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    }
+end:
+    Py_DECREF(root);
+    Py_DECREF(rem);
+    return tup;
+}
+
+/* Estimates for the number of bits in results of integer functions. */
+
+static inline double
+fac_bits(zz_limb_t n)
+{
+    return lgamma((double)n + 1)*1.4426950408889634 /* 1/log(2) */ + 1;
+}
+
+/* Use n!!**2 <= (n + 1)! */
+static inline double
+fac2_bits(zz_limb_t n)
+{
+    return fac_bits(n + 1)/2 + 1;
+}
+
+/* Use fib(n) < phi**n */
+static inline double
+fib_bits(zz_limb_t n)
+{
+    return (double)n*0.6942419136306174 + 1;
+}
+
+/* Products of factorials, like n!/(a!*b!), are computed on several threads
+   from the prime factorization, using Legendre's formula for exponents of
+   primes p <= n.  Odd primes are sieved and split in chunks of equal width.
+   For each chunk and each bit j of exponents, a thread computes the product
+   A[j] of primes (in the chunk) with the j-th bit of exponent set.  Then
+   products of all chunks are multiplied and the result is
+
+                         2        2
+      (... (A[J-1] * A[J-2]) ...)  * A[0]
+
+   shifted by the exponent of 2. */
+
+/* An accumulator for products of many small factors.  Factors are packed
+   into limbs, which are multiplied with a balanced product tree. */
+typedef struct {
+    zz_limb_t limb;         /* product of pending factors */
+    size_t len;             /* number of values in the stack */
+    zz_t stack[64];         /* products of 2**level[i] limbs */
+    unsigned char level[64];
+} prod_acc;
+
+static zz_err
+prod_acc_flush(prod_acc *acc)
+{
+    zz_t *t = &acc->stack[acc->len];
+
+    if (zz_init(t)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    acc->level[acc->len++] = 0;
+    if (zz_from_sl((zz_slimb_t)acc->limb, t)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    acc->limb = 1;
+    while (acc->len > 1
+           && acc->level[acc->len - 1] == acc->level[acc->len - 2])
+    {
+        zz_t *u = &acc->stack[acc->len - 2], *v = &acc->stack[acc->len - 1];
+
+        if (zz_mul(u, v, u)) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+        zz_clear(v);
+        acc->len--;
+        acc->level[acc->len - 1]++;
+    }
+    return ZZ_OK;
+}
+
+static zz_err
+prod_acc_add(prod_acc *acc, zz_limb_t p)
+{
+    if (acc->limb > ZZ_SLIMB_T_MAX/p && prod_acc_flush(acc)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    acc->limb *= p;
+    return ZZ_OK;
+}
+
+/* Leave the product of all factors in stack[0]. */
+static zz_err
+prod_acc_finish(prod_acc *acc)
+{
+    if ((acc->limb > 1 || !acc->len) && prod_acc_flush(acc)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
+    }
+    while (acc->len > 1) {
+        zz_t *u = &acc->stack[acc->len - 2], *v = &acc->stack[acc->len - 1];
+
+        if (zz_mul(u, v, u)) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
+        }
+        zz_clear(v);
+        acc->len--;
+    }
+    return ZZ_OK;
+}
+
+static void
+prod_acc_clear(prod_acc *acc)
+{
+    while (acc->len) {
+        zz_clear(&acc->stack[--acc->len]);
+    }
+}
+
+/* Return the exponent of the prime p in n!. */
+static inline zz_limb_t
+legendre(zz_limb_t n, zz_limb_t p)
+{
+    zz_limb_t e = 0;
+
+    while (n >= p) {
+        n /= p;
+        e += n;
+    }
+    return e;
+}
+
+/* Return bit flags for odd numbers in [1, n], the bit i is set, if 2*i + 1
+   is composite (or one). */
+static uint64_t *
+odd_sieve(zz_limb_t n)
+{
+    uint64_t *sieve = calloc((size_t)(n/128 + 1), sizeof(uint64_t));
+
+    if (!sieve) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    sieve[0] = 1;
+    for (zz_limb_t p = 3; p <= n/p; p += 2) {
+        if (sieve[p/128] >> (p/2%64) & 1) {
+            continue;
+        }
+        for (zz_limb_t q = p*p;; q += 2*p) {
+            sieve[q/128] |= (uint64_t)1 << (q/2%64);
+            if (n - q < 2*p) {
+                break;
+            }
+        }
+    }
+    return sieve;
+}
+
+typedef struct {
+    zz_limb_t n, a, b;
+    const uint64_t *sieve;
+    zz_limb_t odds;    /* number of odd numbers in [3, n] */
+    size_t chunks;
+    size_t bits;       /* bit length of exponents */
+    prod_acc *accs;    /* bits accumulators per chunk */
+    zz_err *rets;
+} fac_data;
+
+static void
+fac_chunk_task(void *data, size_t c)
+{
+    const fac_data *d = data;
+    prod_acc *accs = &d->accs[c*d->bits];
+    zz_limb_t q = d->odds/d->chunks, r = d->odds%d->chunks;
+    zz_limb_t start = c*q + Py_MIN(c, r) + 1, end = start + q + (c < r);
+
+    d->rets[c] = ZZ_OK;
+    for (zz_limb_t i = start; i < end; i++) {
+        if (d->sieve[i/64] >> (i%64) & 1) {
+            continue;
+        }
+
+        zz_limb_t p = 2*i + 1;
+        zz_limb_t e = (legendre(d->n, p) - legendre(d->a, p)
+                       - legendre(d->b, p));
+
+        for (size_t j = 0; e; j++, e >>= 1) {
+            if (e & 1 && prod_acc_add(&accs[j], p)) {
+                d->rets[c] = ZZ_MEM; /* LCOV_EXCL_LINE */
+                return; /* LCOV_EXCL_LINE */
+            }
+        }
+    }
+    for (size_t j = 0; j < d->bits; j++) {
+        if (prod_acc_finish(&accs[j])) {
+            d->rets[c] = ZZ_MEM; /* LCOV_EXCL_LINE */
+            return; /* LCOV_EXCL_LINE */
+        }
+    }
+}
+
+/* Set w to n!/(a!*b!)*2**s, which must be an integer (with a + b <= n), on
+   (at most) the given number of threads.  Doesn't use the Python C-API. */
+static zz_err
+zz_factorials(zz_limb_t n, zz_limb_t a, zz_limb_t b, zz_slimb_t s,
+              size_t threads, zz_t *w)
+{
+    fac_data d = {n, a, b, NULL, n > 2 ? (n - 1)/2 : 0, 4*threads, 0,
+                  NULL, NULL};
+    zz_t *items = NULL;
+    zz_err ret = ZZ_MEM;
+
+    d.chunks = (size_t)Py_MAX(Py_MIN(d.chunks, d.odds), 1);
+    for (zz_limb_t e = legendre(n, 3); e; e >>= 1) {
+        d.bits++;
+    }
+    d.sieve = odd_sieve(n);
+    d.accs = calloc(d.chunks*d.bits + 1, sizeof(prod_acc));
+    d.rets = calloc(d.chunks, sizeof(zz_err));
+    items = calloc(d.chunks, sizeof(zz_t));
+    if (!d.sieve || !d.accs || !d.rets || !items) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < d.chunks*d.bits; i++) {
+        d.accs[i].limb = 1;
+    }
+    gmp_parallel_for(d.chunks, threads, fac_chunk_task, &d);
+    for (size_t c = 0; c < d.chunks; c++) {
+        if (d.rets[c]) {
+            goto end; /* LCOV_EXCL_LINE */
+        }
+    }
+    if (zz_from_sl(1, w)) {
+        goto end; /* LCOV_EXCL_LINE */
+    }
+    for (size_t j = d.bits; j-- > 0;) {
+        for (size_t c = 0; c < d.chunks; c++) {
+            prod_acc *acc = &d.accs[c*d.bits + j];
+
+            items[c] = acc->stack[0];
+            acc->len = 0;
+        }
+        if (zz_prod_threads(items, d.chunks, threads)
+            || mul_threads(w, w, w, threads)
+            || mul_threads(w, &items[0], w, threads))
+        {
+            zz_clear(&items[0]); /* LCOV_EXCL_LINE */
+            goto end; /* LCOV_EXCL_LINE */
+        }
+        zz_clear(&items[0]);
+    }
+
+    zz_slimb_t e2 = (zz_slimb_t)(legendre(n, 2) - legendre(a, 2)
+                                 - legendre(b, 2)) + s;
+
+    ret = zz_mul_2exp(w, (zz_bitcnt_t)e2, w);
+end:
+    for (size_t i = 0; d.accs && i < d.chunks*d.bits; i++) {
+        prod_acc_clear(&d.accs[i]);
+    }
+    free((void *)d.sieve);
+    free(d.accs);
+    free(d.rets);
+    free(items);
+    return ret;
+}
+
+/* Return the number of threads to compute a product of factorials with
+   primes up to n and with the result of given size (in bits). */
+static size_t
+factorials_threads(zz_limb_t n, double bits)
+{
+    if (bits < (double)parallel_limbs*ZZ_LIMB_T_BITS || bits < (double)n/4) {
+        return 1;
+    }
+    return parallel_threads;
+}
 
-    zz_err ret = zz_sqrtrem(&x->z, &root->z, NULL);
+static zz_err
+big_fac(zz_limb_t n, zz_t *w)
+{
+    size_t threads = factorials_threads(n, fac_bits(n));
 
-    Py_DECREF(x);
-    if (ret == ZZ_OK) {
-        return (PyObject *)root;
-    }
-    if (ret == ZZ_VAL) {
-        PyErr_SetString(PyExc_ValueError,
-                        "isqrt() argument must be nonnegative");
-    }
-    if (ret == ZZ_MEM) {
-        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+    if (threads > 1) {
+        return zz_factorials(n, 0, 0, 0, threads, w);
     }
-end:
-    Py_DECREF(root);
-    return NULL;
+    return zz_fac(n, w);
 }
 
-static PyObject *
-gmp_isqrt_rem(PyObject *Py_UNUSED(module), PyObject *arg)
+static zz_err
+big_fac2(zz_limb_t n, zz_t *w)
 {
-    MPZ_Object *x, *root = MPZ_new(), *rem = MPZ_new();
-    PyObject *tup = NULL;
+    size_t threads = factorials_threads(n, fac2_bits(n));
+    zz_limb_t m = n/2;
 
-    if (!root || !rem) {
-        /* LCOV_EXCL_START */
-        Py_XDECREF(root);
-        Py_XDECREF(rem);
-        return NULL;
-        /* LCOV_EXCL_STOP */
+    /* Use n!! = 2**m * m! for even n, else n!! = n!/(2**m * m!). */
+    if (threads > 1) {
+        if (n % 2) {
+            return zz_factorials(n, m, 0, -(zz_slimb_t)m, threads, w);
+        }
+        return zz_factorials(m, 0, 0, (zz_slimb_t)m, threads, w);
     }
-    CHECK_OP_INT(x, arg);
+    return zz_fac2(n, w);
+}
 
-    zz_err ret = zz_sqrtrem(&x->z, &root->z, &rem->z);
+#define big_fib zz_fib
 
-    Py_DECREF(x);
-    if (ret == ZZ_OK) {
-        tup = PyTuple_Pack(2, root, rem);
-    }
-    if (ret == ZZ_VAL) {
-        PyErr_SetString(PyExc_ValueError,
-                        "isqrt() argument must be nonnegative");
-    }
-    if (ret == ZZ_MEM) {
-        PyErr_NoMemory(); /* LCOV_EXCL_LINE */
+static zz_err
+big_bin(zz_limb_t n, zz_limb_t k, zz_t *w)
+{
+    if (k <= n) {
+        double bits = fac_bits(n) - fac_bits(k) - fac_bits(n - k);
+        size_t threads = factorials_threads(n, bits);
+
+        if (threads > 1) {
+            return zz_factorials(n, k, n - k, 0, threads, w);
+        }
     }
-end:
-    Py_DECREF(root);
-    Py_DECREF(rem);
-    return tup;
+    return zz_bin(n, k, w);
 }
 
 #define MAKE_MPZ_UI_FUN(name)                                            \
     static PyObject *                                                    \
     gmp_##name(PyObject *Py_UNUSED(module), PyObject *arg)               \
     {                                                                    \
-        MPZ_Object *x, *res = MPZ_new();                                 \
+        MPZ_Object *x, *res = MPZ_new(0);                                \
                                                                          \
         if (!res) {                                                      \
             return NULL; /* LCOV_EXCL_LINE */                            \
@@ -2227,13 +6459,22 @@ end:
             goto err;                                                    \
         }                                                                \
         Py_XDECREF(x);                                                   \
-        if (zz_##name((zz_limb_t)n, &res->z)) {                          \
+        if (!memory_allows(name##_bits((zz_limb_t)n))) {                 \
+            goto err;                                                    \
+        }                                                                \
+                                                                         \
+        double limbs = name##_bits((zz_limb_t)n)/ZZ_LIMB_T_BITS;         \
+        zz_err ret;                                                      \
+                                                                         \
+        NOGIL_IF(MPZ_nogil(NULL, NULL, limbs*limbs),                     \
+                 ret = big_##name((zz_limb_t)n, &res->z))                \
+        if (ret) {                                                       \
             /* LCOV_EXCL_START */                                        \
             PyErr_NoMemory();                                            \
             goto err;                                                    \
             /* LCOV_EXCL_STOP */                                         \
         }                                                                \
-        return (PyObject *)res;                                          \
+        return (PyObject *)MPZ_finish(res);                              \
     err:                                                                 \
     end:                                                                 \
         Py_DECREF(res);                                                  \
@@ -2252,7 +6493,7 @@ gmp_comb(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
         return NULL;
     }
 
-    MPZ_Object *x, *y, *res = MPZ_new();
+    MPZ_Object *x, *y, *res = MPZ_new(0);
 
     if (!res) {
         return NULL; /* LCOV_EXCL_LINE */
@@ -2277,19 +6518,57 @@ gmp_comb(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
     }
     Py_XDECREF(x);
     Py_XDECREF(y);
-    if (zz_bin((zz_limb_t)n, (zz_limb_t)k, &res->z)) {
+
+    double bits = 0;
+
+    if (k <= n) {
+        bits = (fac_bits((zz_limb_t)n) - fac_bits((zz_limb_t)k)
+                - fac_bits((zz_limb_t)(n - k)) + 3);
+        if (!memory_allows(bits)) {
+            goto err;
+        }
+    }
+
+    double limbs = bits/ZZ_LIMB_T_BITS;
+    zz_err ret;
+
+    NOGIL_IF(MPZ_nogil(NULL, NULL, limbs*limbs),
+             ret = big_bin((zz_limb_t)n, (zz_limb_t)k, &res->z))
+    if (ret) {
         /* LCOV_EXCL_START */
         PyErr_NoMemory();
         goto err;
         /* LCOV_EXCL_STOP */
     }
-    return (PyObject *)res;
+    return (PyObject *)MPZ_finish(res);
 err:
 end:
     Py_DECREF(res);
     return NULL;
 }
 
+/* Set w to n!/(n-k)!, using tmp for temporary values. */
+static zz_err
+zz_perm(zz_limb_t n, zz_limb_t k, zz_t *tmp, zz_t *w)
+{
+    double bits = fac_bits(n) - fac_bits(n - k);
+    size_t threads = factorials_threads(n, bits);
+
+    if (threads > 1) {
+        return zz_factorials(n, n - k, 0, 0, threads, w);
+    }
+
+    zz_err ret = zz_fac(n, w);
+
+    if (ret == ZZ_OK) {
+        ret = zz_fac(n - k, tmp);
+    }
+    if (ret == ZZ_OK) {
+        ret = zz_div(w, tmp, w, NULL);
+    }
+    return ret;
+}
+
 static PyObject *
 gmp_perm(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
 {
@@ -2301,7 +6580,7 @@ gmp_perm(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
         return gmp_fac(self, args[0]);
     }
 
-    MPZ_Object *x, *y, *res = MPZ_new();
+    MPZ_Object *x, *y, *res = MPZ_new(0);
 
     if (!res) {
         return NULL; /* LCOV_EXCL_LINE */
@@ -2327,10 +6606,14 @@ gmp_perm(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
     Py_XDECREF(x);
     Py_XDECREF(y);
     if (k > n) {
-        return (PyObject *)res;
+        return (PyObject *)MPZ_finish(res);
+    }
+
+    if (!memory_allows(fac_bits((zz_limb_t)n))) {
+        goto err;
     }
 
-    MPZ_Object *den = MPZ_new();
+    zz_t *den = scratch_get();
 
     if (!den) {
         /* LCOV_EXCL_START */
@@ -2338,18 +6621,21 @@ gmp_perm(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
         goto err;
         /* LCOV_EXCL_STOP */
     }
-    if (zz_fac((zz_limb_t)n, &res->z)
-        || zz_fac((zz_limb_t)(n-k), &den->z)
-        || zz_div(&res->z, &den->z, &res->z, NULL))
-    {
+
+    double limbs = fac_bits((zz_limb_t)n)/ZZ_LIMB_T_BITS;
+    zz_err ret;
+
+    NOGIL_IF(MPZ_nogil(NULL, NULL, limbs*limbs),
+             ret = zz_perm((zz_limb_t)n, (zz_limb_t)k, den, &res->z))
+    if (ret) {
         /* LCOV_EXCL_START */
-        Py_DECREF(den);
+        scratch_put(den);
         PyErr_NoMemory();
         goto err;
         /* LCOV_EXCL_STOP */
     }
-    Py_DECREF(den);
-    return (PyObject *)res;
+    scratch_put(den);
+    return (PyObject *)MPZ_finish(res);
 err:
 end:
     Py_DECREF(res);
@@ -2448,19 +6734,9 @@ do_rnd:
                     }
                 }
         }
-
-        zz_t tmp;
-
-        if (zz_init(&tmp) || shift > INT64_MAX
-            || zz_from_sl((zz_slimb_t)shift, &tmp)
-            || zz_add(exp, &tmp, exp))
-        {
-            /* LCOV_EXCL_START */
-            zz_clear(&tmp);
-            return ZZ_MEM;
-            /* LCOV_EXCL_STOP */
+        if (shift > INT64_MAX || zz_add_sl(exp, (zz_slimb_t)shift, exp)) {
+            return ZZ_MEM; /* LCOV_EXCL_LINE */
         }
-        zz_clear(&tmp);
         *bc = prec;
     }
 
@@ -2472,19 +6748,9 @@ do_rnd:
             return ZZ_MEM; /* LCOV_EXCL_LINE */
         }
     }
-
-    zz_t tmp;
-
-    if (zz_init(&tmp) || zbits > INT64_MAX
-        || zz_from_sl((zz_slimb_t)zbits, &tmp)
-        || zz_add(exp, &tmp, exp))
-    {
-        /* LCOV_EXCL_START */
-        zz_clear(&tmp);
-        return ZZ_MEM;
-        /* LCOV_EXCL_STOP */
+    if (zbits > INT64_MAX || zz_add_sl(exp, (zz_slimb_t)zbits, exp)) {
+        return ZZ_MEM; /* LCOV_EXCL_LINE */
     }
-    zz_clear(&tmp);
     *bc -= zbits;
     /* Check if one less than a power of 2 was rounded up. */
     if (zz_cmp_sl(man, 1) == ZZ_EQ) {
@@ -2519,7 +6785,7 @@ gmp__mpmath_normalize(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
         return NULL;
     }
 
-    MPZ_Object *man = (MPZ_Object *)plus(args[1]);
+    MPZ_Object *man = MPZ_copy_locked(args[1]);
     MPZ_Object *exp = MPZ_from_int(args[2]);
 
     if (!exp || !man || zz_mpmath_normalize(prec, rnd, &negative,
@@ -2541,7 +6807,7 @@ gmp__mpmath_normalize(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
         return NULL;
         /* LCOV_EXCL_STOP */
     }
-    return Py_BuildValue("(bNNK)", negative, man, iexp, bc);
+    return Py_BuildValue("(bNNK)", negative, MPZ_finish(man), iexp, bc);
 }
 
 static PyObject *
@@ -2556,7 +6822,10 @@ gmp__mpmath_create(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
     MPZ_Object *man;
 
     if (MPZ_Check(args[0])) {
-        man = (MPZ_Object *)plus(args[0]);
+        man = MPZ_copy_locked(args[0]);
+        if (!man) {
+            return NULL; /* LCOV_EXCL_LINE */
+        }
     }
     else if (PyLong_Check(args[0])) {
         man = MPZ_from_int(args[0]);
@@ -2624,24 +6893,232 @@ gmp__mpmath_create(PyObject *self, PyObject *const *args, Py_ssize_t nargs)
         return NULL;
         /* LCOV_EXCL_STOP */
     }
-    return Py_BuildValue("(bNNK)", negative, man, iexp, bc);
+    return Py_BuildValue("(bNNK)", negative, MPZ_finish(man), iexp, bc);
+}
+
+/* Free cached objects and buffers of the current thread, that are beyond
+   given limits of the cache. */
+static void
+cache_trim(size_t size, zz_size_t max_limbs)
+{
+    while (global.gmp_cache_size > size) {
+        MPZ_Object *u = global.gmp_cache[--(global.gmp_cache_size)];
+
+        Py_TYPE((PyObject *)u)->tp_free(u);
+    }
+    for (size_t k = 0; k < CACHE_CLASSES; k++) {
+        size_t depth = Py_MIN(cache_depth(k), size);
+        size_t i = 0;
+
+        /* compact the class, dropping buffers above the limb ceiling */
+        for (size_t j = 0; j < global.gmp_limbs_size[k]; j++) {
+            zz_t *u = &global.gmp_limbs[k][j];
+
+            if (i < depth && u->alloc <= max_limbs) {
+                global.gmp_limbs[k][i++] = *u;
+            }
+            else {
+                zz_clear(u);
+            }
+        }
+        global.gmp_limbs_size[k] = i;
+    }
 }
 
 static PyObject *
-gmp__free_cache(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
+gmp_compact(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
 {
-    for (size_t i = 0; i < global.gmp_cache_size; i++) {
-        MPZ_Object *u = global.gmp_cache[i];
-        PyObject *self = (PyObject *)u;
-        PyTypeObject *type = Py_TYPE(self);
+    int_operands_clear();
+    cache_trim(cache_size, 0);
+    depot_clear();
+    scratch_clear();
+    Py_RETURN_NONE;
+}
 
-        zz_clear(&u->z);
-        type->tp_free(self);
+static PyObject *
+gmp__free_cache(PyObject *module, PyObject *args)
+{
+    /* Holders of int operands would go to the cache. */
+    int_operands_clear();
+    cache_trim(0, 0);
+    return gmp_compact(module, args);
+}
+
+static PyObject *
+gmp_cache_config(PyObject *Py_UNUSED(module), PyObject *const *args,
+                 Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const keywords[] = {"size", "max_limbs"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 2,
+        .minargs = 0,
+        .maxargs = 2,
+        .fname = "cache_config",
+    };
+    Py_ssize_t argidx[2] = {-1, -1};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    size_t size = cache_size;
+    zz_size_t max_limbs = cache_max_limbs;
+
+    if (argidx[0] >= 0 && args[argidx[0]] != Py_None) {
+        Py_ssize_t value = PyLong_AsSsize_t(args[argidx[0]]);
+
+        if (value == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (value < 0 || value > CACHE_SIZE) {
+            PyErr_Format(PyExc_ValueError,
+                         "size must be in range [0, %d]", CACHE_SIZE);
+            return NULL;
+        }
+        size = (size_t)value;
+    }
+    if (argidx[1] >= 0 && args[argidx[1]] != Py_None) {
+        Py_ssize_t value = PyLong_AsSsize_t(args[argidx[1]]);
+
+        if (value == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (value < 0 || value > MAX_CACHE_MPZ_LIMBS) {
+            PyErr_Format(PyExc_ValueError,
+                         "max_limbs must be in range [0, %zd]",
+                         (Py_ssize_t)MAX_CACHE_MPZ_LIMBS);
+            return NULL;
+        }
+        max_limbs = (zz_size_t)value;
+    }
+    cache_size = size;
+    cache_max_limbs = max_limbs;
+    cache_trim(size, max_limbs);
+    depot_clear();
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+gmp_thread_config(PyObject *Py_UNUSED(module), PyObject *const *args,
+                  Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const keywords[] = {"nogil_limbs", "threads",
+                                           "parallel_limbs"};
+    const static gmp_pyargs fnargs = {
+        .keywords = keywords,
+        .maxpos = 0,
+        .minargs = 0,
+        .maxargs = 3,
+        .fname = "thread_config",
+    };
+    Py_ssize_t argidx[3] = {-1, -1, -1};
+    Py_ssize_t values[3] = {nogil_limbs, (Py_ssize_t)parallel_threads,
+                            parallel_limbs};
+
+    if (gmp_parse_pyargs(&fnargs, argidx, args, nargs, kwnames) == -1) {
+        return NULL;
+    }
+
+    PyObject *old = Py_BuildValue("{s:n,s:n,s:n}", keywords[0], values[0],
+                                  keywords[1], values[1],
+                                  keywords[2], values[2]);
+
+    if (!old) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+    for (size_t i = 0; i < 3; i++) {
+        if (argidx[i] < 0 || args[argidx[i]] == Py_None) {
+            continue;
+        }
+        values[i] = PyLong_AsSsize_t(args[argidx[i]]);
+        if (values[i] == -1 && PyErr_Occurred()) {
+            Py_DECREF(old);
+            return NULL;
+        }
+        if (values[i] < 1) {
+            PyErr_Format(PyExc_ValueError, "%s must be positive",
+                         keywords[i]);
+            Py_DECREF(old);
+            return NULL;
+        }
+    }
+    nogil_limbs = (zz_size_t)values[0];
+    parallel_threads = (size_t)values[1];
+    parallel_limbs = (zz_size_t)values[2];
+    return old;
+}
+
+static PyObject *
+gmp_set_memory_limit(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    int64_t limit = 0;
+
+    if (!Py_IsNone(arg)) {
+        long long value = PyLong_AsLongLong(arg);
+
+        if (value == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (value < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "memory limit must be non-negative");
+            return NULL;
+        }
+        limit = (int64_t)value;
     }
-    global.gmp_cache_size = 0;
+    memory_limit = limit;
     Py_RETURN_NONE;
 }
 
+static PyObject *
+gmp_get_memory_limit(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
+{
+    return PyLong_FromLongLong(memory_limit);
+}
+
+static PyObject *
+gmp_get_memory_usage(PyObject *Py_UNUSED(module), PyObject *Py_UNUSED(args))
+{
+    return PyLong_FromLongLong(atomic_load(&memory_used));
+}
+
+static PyObject *
+gmp_cache_info(PyObject *module, PyObject *Py_UNUSED(args))
+{
+    gmp_state *state = PyModule_GetState(module);
+    PyObject *res = PyStructSequence_New(state->CacheInfo_Type);
+
+    if (!res) {
+        return NULL; /* LCOV_EXCL_LINE */
+    }
+
+    size_t buffers = 0, bytes = global.gmp_cache_size*sizeof(MPZ_Object);
+
+    for (size_t k = 0; k < CACHE_CLASSES; k++) {
+        buffers += global.gmp_limbs_size[k];
+        for (size_t i = 0; i < global.gmp_limbs_size[k]; i++) {
+            bytes += (size_t)global.gmp_limbs[k][i].alloc*sizeof(zz_limb_t);
+        }
+    }
+
+    size_t values[] = {cache_size, (size_t)cache_max_limbs,
+                       global.gmp_cache_hits, global.gmp_cache_misses,
+                       global.gmp_cache_evictions, global.gmp_cache_size,
+                       buffers, bytes};
+
+    for (Py_ssize_t i = 0; i < (Py_ssize_t)Py_ARRAY_LENGTH(values); i++) {
+        PyStructSequence_SET_ITEM(res, i, PyLong_FromSize_t(values[i]));
+    }
+    if (PyErr_Occurred()) {
+        /* LCOV_EXCL_START */
+        Py_DECREF(res);
+        return NULL;
+        /* LCOV_EXCL_STOP */
+    }
+    return res;
+}
+
 static PyMethodDef gmp_functions[] = {
     {"gcd", (PyCFunction)gmp_gcd, METH_FASTCALL,
      ("gcd($module, /, *integers)\n--\n\n"
@@ -2652,6 +7129,34 @@ static PyMethodDef gmp_functions[] = {
     {"lcm", (PyCFunction)gmp_lcm, METH_FASTCALL,
      ("lcm($module, /, *integers)\n--\n\n"
       "Least Common Multiple.")},
+    {"addmul", (PyCFunction)gmp_addmul, METH_FASTCALL,
+     ("addmul($module, acc, x, y, /)\n--\n\n"
+      "Return acc + x*y.\n\n"
+      "The product is not allocated as a separate integer.  If acc is\n"
+      "an xmpz, the result is stored in place and acc is returned.")},
+    {"submul", (PyCFunction)gmp_submul, METH_FASTCALL,
+     ("submul($module, acc, x, y, /)\n--\n\n"
+      "Return acc - x*y.\n\n"
+      "Same as addmul(), but the product is subtracted.")},
+    {"powm_batch", (PyCFunction)gmp_powm_batch,
+     METH_FASTCALL | METH_KEYWORDS,
+     ("powm_batch($module, bases, exps, mod, *, threads=1)\n--\n\n"
+      "Return the list of pow(b, e, mod) for pairs of bases and exps.\n\n"
+      "Each of bases and exps is either an iterable or an integer, that is\n"
+      "used for all pairs.  The mod is an integer or a ModContext.  The\n"
+      "computation releases the GIL and is split across the given number\n"
+      "of threads.")},
+    {"prod", (PyCFunction)gmp_prod, METH_FASTCALL | METH_KEYWORDS,
+     ("prod($module, iterable, /, *, start=1, threads=None)\n--\n\n"
+      "Return the product of integers from the iterable and start.\n\n"
+      "Values are multiplied with a balanced product tree, which may be\n"
+      "split across the given number of threads.  The None value uses\n"
+      "settings of thread_config().")},
+    {"mul", (PyCFunction)gmp_mul, METH_FASTCALL | METH_KEYWORDS,
+     ("mul($module, a, b, *, threads=None)\n--\n\n"
+      "Return the product of integers a and b.\n\n"
+      "The computation is split across the given number of threads.  The\n"
+      "None value uses settings of thread_config().")},
     {"isqrt", gmp_isqrt, METH_O,
      ("isqrt($module, n, /)\n--\n\n"
       "Return the integer part of the square root of n.")},
@@ -2678,6 +7183,53 @@ static PyMethodDef gmp_functions[] = {
      NULL},
     {"_mpmath_create", (PyCFunction)gmp__mpmath_create, METH_FASTCALL, NULL},
     {"_free_cache", gmp__free_cache, METH_NOARGS, "Free mpz's cache."},
+    {"compact", gmp_compact, METH_NOARGS,
+     ("compact($module, /)\n--\n\n"
+      "Free limb buffers, cached by the current thread for reuse.\n\n"
+      "On free-threaded builds, buffers in the cache, shared by threads,\n"
+      "are freed as well.")},
+    {"cache_config", (PyCFunction)gmp_cache_config,
+     METH_FASTCALL | METH_KEYWORDS,
+     ("cache_config($module, size=None, max_limbs=None)\n--\n\n"
+      "Set limits for the cache of mpz objects.\n\n"
+      "The size is the maximal number of freed objects, kept in the cache\n"
+      "of each thread for reuse.  Same number of limb buffers is kept for\n"
+      "small buffers, less for bigger ones.  Buffers with more than\n"
+      "max_limbs limbs are not cached.  The None value keeps the current\n"
+      "setting.  Use cache_info() to query the settings.")},
+    {"thread_config", (PyCFunction)gmp_thread_config,
+     METH_FASTCALL | METH_KEYWORDS,
+     ("thread_config($module, *, nogil_limbs=None, threads=None,\n"
+      "              parallel_limbs=None)\n--\n\n"
+      "Configure the use of threads.\n\n"
+      "The GIL is released for operations (like multiplication, division,\n"
+      "pow(), isqrt(), factorial() or conversion to and from strings),\n"
+      "that are estimated to be at least as costly as multiplication of\n"
+      "two integers with nogil_limbs limbs (64 by default), unless some\n"
+      "operands are xmpz.\n\n"
+      "Multiplication of integers, that both have at least parallel_limbs\n"
+      "limbs (8192 by default), is done on the given number of threads\n"
+      "(1 by default, i.e. no additional threads are used).  So are\n"
+      "factorial(), double_fac(), comb() and perm() with big enough\n"
+      "results and conversion of such integers to and from strings.  The\n"
+      "None value keeps the current setting.\n\n"
+      "Return a dict with previous settings, that can be passed back as\n"
+      "keyword arguments to restore them.")},
+    {"set_memory_limit", gmp_set_memory_limit, METH_O,
+     ("set_memory_limit($module, limit, /)\n--\n\n"
+      "Set the memory limit (in bytes) for limbs of mpz values.\n\n"
+      "Operations, whose results are estimated to not fit into the limit,\n"
+      "raise MemoryError before doing any work.  Only values, created while\n"
+      "the limit is set, are accounted.  Zero or None disables the limit.")},
+    {"get_memory_limit", gmp_get_memory_limit, METH_NOARGS,
+     ("get_memory_limit($module, /)\n--\n\n"
+      "Return the memory limit for limbs of mpz values.")},
+    {"get_memory_usage", gmp_get_memory_usage, METH_NOARGS,
+     ("get_memory_usage($module, /)\n--\n\n"
+      "Return memory (in bytes), used by limbs of accounted mpz values.")},
+    {"cache_info", gmp_cache_info, METH_NOARGS,
+     ("cache_info($module, /)\n--\n\n"
+      "Return settings and statistics for the cache of the current thread.")},
     {NULL} /* sentinel */
 };
 
@@ -2700,6 +7252,26 @@ static PyStructSequence_Field gmp_info_fields[] = {
 static PyStructSequence_Desc gmp_info_desc = {
     "gmp.gmplib_info", gmp_info__doc__, gmp_info_fields, 5};
 
+PyDoc_STRVAR(gmp_cache_info__doc__,
+             "gmp.cache_info\n\n\
+A named tuple that holds settings and statistics\n\
+of the mpz cache for the current thread.");
+
+static PyStructSequence_Field gmp_cache_info_fields[] = {
+    {"size", "maximal number of cached objects"},
+    {"max_limbs", "maximal size of cached buffers"},
+    {"hits", "number of objects and buffers, taken from the cache"},
+    {"misses", "number of objects and buffers, allocated anew"},
+    {"evictions", ("number of freed objects and buffers,"
+                   " that were not cached")},
+    {"objects", "number of cached objects"},
+    {"buffers", "number of cached buffers"},
+    {"bytes", "memory in bytes, held by the cache"},
+    {NULL}};
+
+static PyStructSequence_Desc gmp_cache_info_desc = {
+    "gmp.cache_info", gmp_cache_info__doc__, gmp_cache_info_fields, 8};
+
 static int
 gmp_exec(PyObject *m)
 {
@@ -2711,6 +7283,32 @@ gmp_exec(PyObject *m)
     if (PyModule_AddType(m, &MPZ_Type) < 0) {
         return -1; /* LCOV_EXCL_LINE */
     }
+    if (PyModule_AddType(m, &XMPZ_Type) < 0) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+    if (PyModule_AddType(m, &ModContext_Type) < 0) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
+#if !defined(PYPY_VERSION)
+    if (!small_ints_interp
+        && PyInterpreterState_Get() == PyInterpreterState_Main())
+    {
+        for (zz_slimb_t v = -NSMALLNEGINTS; v < NSMALLPOSINTS; v++) {
+            small_ints[v + NSMALLNEGINTS] = MPZ_new_small(v);
+            if (!small_ints[v + NSMALLNEGINTS]) {
+                return -1; /* LCOV_EXCL_LINE */
+            }
+        }
+        small_ints_interp = PyInterpreterState_Main();
+    }
+#endif
+
+    gmp_state *state = PyModule_GetState(m);
+
+    state->CacheInfo_Type = PyStructSequence_NewType(&gmp_cache_info_desc);
+    if (!state->CacheInfo_Type) {
+        return -1; /* LCOV_EXCL_LINE */
+    }
 
     PyTypeObject *GMP_InfoType = PyStructSequence_NewType(&gmp_info_desc);
 
@@ -2762,11 +7360,28 @@ gmp_exec(PyObject *m)
         /* LCOV_EXCL_STOP */
     }
 
+#if defined(TRACEMALLOC_DOMAIN)
+    if (PyModule_AddIntConstant(m, "TRACEMALLOC_DOMAIN",
+                                TRACEMALLOC_DOMAIN) < 0)
+    {
+        /* LCOV_EXCL_START */
+        Py_DECREF(ns);
+        return -1;
+        /* LCOV_EXCL_STOP */
+    }
+#endif
+
     const char *str = ("import numbers, importlib.metadata as imp\n"
                        "numbers.Integral.register(gmp.mpz)\n"
                        "gmp.fac = gmp.factorial\n"
-                       "gmp.__all__ = ['comb', 'factorial', 'gcd', 'isqrt',\n"
-                       "               'lcm', 'mpz', 'perm']\n"
+                       "gmp.__all__ = ['ModContext', 'addmul',\n"
+                       "               'cache_config', 'cache_info', 'comb',\n"
+                       "               'compact', 'factorial', 'gcd',\n"
+                       "               'get_memory_limit',\n"
+                       "               'get_memory_usage', 'isqrt', 'lcm',\n"
+                       "               'mpz', 'mul', 'perm', 'powm_batch',\n"
+                       "               'prod', 'set_memory_limit', 'submul',\n"
+                       "               'thread_config', 'xmpz']\n"
                        "gmp.__version__ = imp.version('python-gmp')\n");
     PyObject *res = PyRun_String(str, Py_file_input, ns, ns);
 
@@ -2795,13 +7410,40 @@ static PyModuleDef_Slot gmp_slots[] = {
 #  pragma GCC diagnostic pop
 #endif
 
+static int
+gmp_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    gmp_state *state = PyModule_GetState(m);
+
+    Py_VISIT(state->CacheInfo_Type);
+    return 0;
+}
+
+static int
+gmp_clear(PyObject *m)
+{
+    gmp_state *state = PyModule_GetState(m);
+
+    Py_CLEAR(state->CacheInfo_Type);
+    return 0;
+}
+
+static void
+gmp_free(void *m)
+{
+    (void)gmp_clear((PyObject *)m);
+}
+
 static struct PyModuleDef gmp_module = {
     PyModuleDef_HEAD_INIT,
     .m_name = "gmp",
     .m_doc = "Bindings to the GNU GMP for Python.",
-    .m_size = 0,
+    .m_size = sizeof(gmp_state),
     .m_methods = gmp_functions,
     .m_slots = gmp_slots,
+    .m_traverse = gmp_traverse,
+    .m_clear = gmp_clear,
+    .m_free = gmp_free,
 };
 
 PyMODINIT_FUNC
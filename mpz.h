@@ -31,15 +31,22 @@
 
 #include "zz/zz.h"
 
+/* Number of limbs, stored inline in the object. */
+#define MPZ_INLINE_LIMBS (2)
+
 typedef struct {
     PyObject_HEAD
     Py_hash_t hash_cache;
     zz_t z;
+    zz_size_t charge; /* limbs, charged to the memory limit */
+    zz_limb_t limbs[MPZ_INLINE_LIMBS];
 } MPZ_Object;
 
 extern PyTypeObject MPZ_Type;
+extern PyTypeObject XMPZ_Type;
 
 #define MPZ_CheckExact(u) Py_IS_TYPE((u), &MPZ_Type)
 #define MPZ_Check(u) PyObject_TypeCheck((u), &MPZ_Type)
+#define XMPZ_Check(u) PyObject_TypeCheck((u), &XMPZ_Type)
 
 #endif /* MPZ_H */
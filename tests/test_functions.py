@@ -1,13 +1,17 @@
 import inspect
 import math
 import platform
+import subprocess
 import sys
+import threading
 
 import gmp
 import pytest
 from gmp import (
+    ModContext,
     _mpmath_create,
     _mpmath_normalize,
+    addmul,
     comb,
     double_fac,
     fac,
@@ -19,7 +23,12 @@ from gmp import (
     isqrt_rem,
     lcm,
     mpz,
+    mul,
     perm,
+    powm_batch,
+    prod,
+    submul,
+    xmpz,
 )
 from hypothesis import example, given
 from hypothesis.strategies import booleans, integers, lists, sampled_from
@@ -29,6 +38,7 @@ from test_utils import (
     python_fib,
     python_gcdext,
     python_isqrtrem,
+    threads_used,
 )
 
 
@@ -78,6 +88,19 @@ def test_perm(x, y):
     assert perm(x) == rx
 
 
+@given(integers(min_value=0, max_value=5000),
+       integers(min_value=0, max_value=5000),
+       integers(min_value=2, max_value=8))
+@example(2, 1, 2)
+@example(4097, 2048, 3)
+def test_factorials_threads(x, y, threads):
+    with threads_used(threads=threads, parallel_limbs=1):
+        assert factorial(x) == math.factorial(x)
+        assert double_fac(x) == python_fac2(x)
+        assert comb(x, y) == math.comb(x, y)
+        assert perm(x, y) == math.perm(x, y)
+
+
 @given(bigints(), bigints(), bigints())
 @example(1<<(67*2), 1<<65, 1)
 @example(123, 1<<70, 1)
@@ -130,6 +153,124 @@ def test_lcm_nary(xs):
     assert lcm(*xs) == r
 
 
+@given(bigints(), bigints(), bigints())
+@example(0, 1<<67, 1<<67)
+@example(1, -(1<<67), 1<<67)
+@example(-1, 2, -3)
+def test_muladd(acc, x, y):
+    for f, r in [(addmul, acc + x*y), (submul, acc - x*y)]:
+        assert f(mpz(acc), mpz(x), mpz(y)) == r
+        assert f(acc, x, y) == r
+        assert type(f(acc, x, y)) is mpz
+        a = xmpz(acc)
+        b = a
+        assert f(a, mpz(x), y) is b
+        assert a == r
+        a = xmpz(x)
+        f(a, a, a)
+        assert a == f(x, x, x)
+
+
+@given(bigints(), bigints(), integers(min_value=-5, max_value=1<<70),
+       sampled_from([1, 2, 10, 7, (1<<61) - 1, 1<<62, (1<<63) - 25,
+                     1<<63, (1<<64) + 13, 10**40 + 7, (1<<8192) - 1,
+                     3**5200 + 2]))
+@example(3, 5, 1<<64, (1<<61) - 1)
+@example((1<<8192) - 2, (1<<8192) - 2, 2, (1<<8192) - 1)
+@example(3**5200 + 1, 3**5199, 3, 3**5200 + 2)
+@example(-7, 1<<100, -1, 1<<62)
+@example(0, 0, -1, 1)
+def test_modcontext(x, y, e, m):
+    ctx = ModContext(m)
+    assert ctx.modulus == m
+    for a, b in [(x, y), (mpz(x), y), (x, mpz(y))]:
+        assert ctx.add(a, b) == (x + y) % m
+        assert ctx.sub(a, b) == (x - y) % m
+        assert ctx.mul(a, b) == x*y % m
+        assert ctx.sqr(a) == x*x % m
+        assert type(ctx.mul(a, b)) is mpz
+    try:
+        r = pow(x, e, m)
+    except ValueError:
+        with pytest.raises(ValueError, match="base is not invertible"):
+            ctx.pow(x, e)
+    else:
+        assert ctx.pow(x, e) == r
+        assert ctx.pow(mpz(x), mpz(e)) == r
+    try:
+        r = pow(x, -1, m)
+    except ValueError:
+        with pytest.raises(ValueError, match="base is not invertible"):
+            ctx.inv(x)
+    else:
+        assert ctx.inv(x) == r
+    assert ctx.prod([x, mpz(y), e]) == x*y*e % m
+    assert ctx.prod(iter([])) == 1 % m
+
+
+@given(lists(bigints(), max_size=8), integers(min_value=-2, max_value=1<<70),
+       sampled_from([1, 7, -7, 10, (1<<61) - 1, 1<<62, (1<<64) + 13,
+                     -(10**40 + 7)]),
+       integers(min_value=1, max_value=4))
+@example([2, 3, 4], -1, 9, 2)
+def test_powm_batch(bases, e, m, threads):
+    def check(xs, ys, mod):
+        try:
+            r = [pow(x, y, m) for x, y in zip(xs, ys)]
+        except ValueError:
+            with pytest.raises(ValueError, match="base is not invertible"):
+                powm_batch(xs, ys, mod, threads=threads)
+        else:
+            assert powm_batch(xs, ys, mod, threads=threads) == r
+    exps = [e + i for i in range(len(bases))]
+    check(bases, exps, m)
+    check(list(map(mpz, bases)), list(map(mpz, exps)), mpz(m))
+    if m > 0:
+        check(bases, exps, ModContext(m))
+    try:
+        r = [pow(x, e, m) for x in bases]
+    except ValueError:
+        pass
+    else:
+        assert powm_batch(iter(bases), e, m, threads=threads) == r
+        assert powm_batch(bases, mpz(e), m) == r
+    if bases:
+        try:
+            r = [pow(bases[0], y, m) for y in exps]
+        except ValueError:
+            pass
+        else:
+            assert powm_batch(xmpz(bases[0]), tuple(exps), m) == r
+
+
+@given(bigints(), bigints(), integers(min_value=1, max_value=30))
+@example(1<<6400, (1<<3200) - 1, 9)
+@example(-(1<<640) + 1, 3**300, 3)
+@example((1<<640) + 1, 1<<6400, 64)
+def test_mul(x, y, threads):
+    r = x*y
+    assert mul(x, y, threads=threads) == r
+    assert mul(mpz(x), y) == r
+    assert mul(x, xmpz(y), threads=threads) == r
+    with threads_used(threads=threads, parallel_limbs=1):
+        assert mpz(x)*mpz(y) == r
+
+
+@given(lists(bigints(), max_size=40), bigints(),
+       integers(min_value=1, max_value=8))
+@example([], 1, 1)
+@example([1<<40, 1<<40, 3, -5], 1, 2)
+@example([(1<<64) + 1]*7, -1, 3)
+def test_prod(xs, start, threads):
+    r = math.prod(xs, start=start)
+    assert prod(xs, start=start) == r
+    assert prod(iter(map(mpz, xs)), start=mpz(start)) == r
+    assert prod(map(xmpz, xs), start=start, threads=threads) == r
+    assert prod(xs) == math.prod(xs)
+    with threads_used(threads=threads, parallel_limbs=1):
+        assert prod(xs, start=start) == r
+
+
 @given(booleans(), bigints(min_value=0), bigints(),
        integers(min_value=1, max_value=1<<30),
        sampled_from(["n", "f", "c", "u", "d"]))
@@ -238,9 +379,255 @@ def test_interfaces():
         _mpmath_normalize(1, mpz(111), 1j, 12, 13, "c")
     with pytest.raises(ValueError, match="invalid rounding mode specified"):
         _mpmath_normalize(1, mpz(111), 11, 12, 13, 1j)
+    with pytest.raises(TypeError):
+        addmul(1, 2)
+    with pytest.raises(TypeError):
+        submul(1, 2, 3, 4)
+    with pytest.raises(TypeError):
+        addmul(1, 2, 1.5)
+    with pytest.raises(TypeError):
+        addmul(1.5, 2, 3)
+    for m in [0, -7]:
+        with pytest.raises(ValueError, match="modulus must be positive"):
+            ModContext(m)
+    with pytest.raises(TypeError):
+        ModContext(1.5)
+    assert repr(ModContext(modulus=xmpz(7))) == "ModContext(7)"
+    for ctx in [ModContext(7), ModContext(1<<64)]:
+        with pytest.raises(TypeError):
+            ctx.mul(1)
+        with pytest.raises(TypeError):
+            ctx.pow(1, 2, 3)
+        with pytest.raises(TypeError):
+            ctx.add(1, 2.5)
+        with pytest.raises(TypeError):
+            ctx.inv(1j)
+        with pytest.raises(TypeError):
+            ctx.prod([1, "a"])
+        with pytest.raises(TypeError):
+            ctx.prod(1)
+    with pytest.raises(ValueError, match="must have the same length"):
+        powm_batch([1, 2], [3], 5)
+    with pytest.raises(ValueError, match="modulus must be nonzero"):
+        powm_batch(1, 2, 0)
+    with pytest.raises(ValueError, match="threads must be positive"):
+        powm_batch(1, 2, 5, threads=0)
+    with pytest.raises(TypeError):
+        powm_batch(1, 2, 5, 1)
+    with pytest.raises(TypeError):
+        powm_batch(1.5, 2, 5)
+    with pytest.raises(ValueError, match="threads must be positive"):
+        mul(1, 2, threads=0)
+    with pytest.raises(TypeError):
+        mul(1, 2, 3)
+    with pytest.raises(TypeError):
+        mul(1.5, 2)
+    with pytest.raises(TypeError, match="accepts only integers"):
+        prod([1, 2.5])
+    with pytest.raises(TypeError, match="accepts only integers"):
+        prod([1, 2], start=1.0)
+    with pytest.raises(TypeError):
+        prod(1)
+    with pytest.raises(TypeError):
+        prod([1], 2)
+    with pytest.raises(TypeError):
+        prod(iterable=[1])
+    with pytest.raises(ValueError, match="threads must be positive"):
+        prod([1], threads=0)
+
+    def gen():
+        yield 1<<100
+        raise ZeroDivisionError
+
+    with pytest.raises(ZeroDivisionError):
+        prod(gen())
+    with pytest.raises(TypeError):
+        powm_batch([1, "a"], 2, 5)
+    with pytest.raises(TypeError):
+        powm_batch(1, 2, 5.5)
+    assert powm_batch([], 2, 5) == []
     gmp._free_cache()  # just for coverage
 
 
+def test_memory_limit():
+    assert gmp.get_memory_limit() == 0
+    x = mpz(1 << 10000)
+    used = gmp.get_memory_usage()
+    try:
+        gmp.set_memory_limit(100000)
+        assert gmp.get_memory_limit() == 100000
+        y = x*x
+        assert gmp.get_memory_usage() >= used + 2*10000//8
+        del y
+        assert gmp.get_memory_usage() == used
+        with pytest.raises(MemoryError):
+            x**1000
+        with pytest.raises(MemoryError):
+            x << 10**6
+        with pytest.raises(MemoryError):
+            x*(x**70)
+        with pytest.raises(MemoryError):
+            factorial(10**5)
+        with pytest.raises(MemoryError):
+            double_fac(10**6)
+        with pytest.raises(MemoryError):
+            fib(10**7)
+        with pytest.raises(MemoryError):
+            comb(10**7, 10**6)
+        with pytest.raises(MemoryError):
+            perm(10**5, 2)
+        with pytest.raises(MemoryError):
+            addmul(1, x**40, x**40)
+        acc = xmpz(1 << 400000)
+        acc += 1
+        with pytest.raises(MemoryError):
+            addmul(acc, 1 << 900, 1 << 900)
+        assert acc.bit_length() == 400001
+        assert acc.bit_count() == 2
+        del acc
+        assert mpz(1)**10**12 == 1
+        assert mpz(-1)**10**12 == 1
+        assert mpz(-1)**(10**12 + 1) == -1
+        assert mpz(0)**10**12 == 0
+        acc = xmpz(-1)
+        acc **= 10**12 + 1
+        assert acc == -1
+        del acc
+        assert (mpz(2)**(8*50000)).bit_length() == 400001
+        with pytest.raises(MemoryError):
+            mpz(2)**(8*100000)
+        assert factorial(1000) == math.factorial(1000)
+        assert comb(1000, 10) == math.comb(1000, 10)
+    finally:
+        gmp.set_memory_limit(None)
+    assert gmp.get_memory_limit() == 0
+    assert x << 10**6 == (1 << (10**6 + 10000))
+    with pytest.raises(ValueError):
+        gmp.set_memory_limit(-1)
+    with pytest.raises(TypeError):
+        gmp.set_memory_limit(1.5)
+
+
+@pytest.mark.skipif(platform.python_implementation() != "CPython",
+                    reason="no tracemalloc")
+@pytest.mark.parametrize("options", [["-X", "tracemalloc"], []])
+def test_tracemalloc(options):
+    code = """if True:
+    import tracemalloc, gmp
+    if not tracemalloc.is_tracing():
+        tracemalloc.start()
+    def traced():
+        domain = tracemalloc.DomainFilter(True, gmp.TRACEMALLOC_DOMAIN)
+        snap = tracemalloc.take_snapshot().filter_traces([domain])
+        return sum(s.size for s in snap.statistics("lineno"))
+    x = gmp.mpz(1) << 100000
+    assert traced() >= 100000//8
+    del x
+    assert traced() == 0
+    """
+    subprocess.run([sys.executable, *options, "-c", code], check=True)
+
+
+@pytest.mark.skipif(platform.python_implementation() == "PyPy",
+                    reason="no cache on PyPy")
+def test_cache_config():
+    info = gmp.cache_info()
+    size, max_limbs = info.size, info.max_limbs
+    try:
+        gmp.cache_config(size=10, max_limbs=4)
+        gmp._free_cache()
+        info = gmp.cache_info()
+        assert (info.size, info.max_limbs) == (10, 4)
+        assert (info.objects, info.buffers, info.bytes) == (0, 0, 0)
+        xs = [mpz(1 << (64*i + 1000)) for i in range(20)]
+        del xs
+        info = gmp.cache_info()
+        assert info.objects == 10
+        assert info.evictions >= 10
+        assert info.bytes >= info.objects*sys.getsizeof(mpz(0))
+        hits = info.hits
+        x = mpz(1 << 1000) + 1
+        assert gmp.cache_info().hits > hits
+        del x
+        xs = [mpz(1 << (64*i + 100)) for i in range(3)]
+        del xs
+        assert gmp.cache_info().buffers > 0
+        gmp.compact()
+        info = gmp.cache_info()
+        assert info.objects > 0
+        assert info.buffers == 0
+        assert info.bytes == info.objects*sys.getsizeof(mpz(0))
+        gmp.cache_config(0)
+        info = gmp.cache_info()
+        assert (info.size, info.max_limbs) == (0, 4)
+        assert (info.objects, info.buffers, info.bytes) == (0, 0, 0)
+    finally:
+        gmp.cache_config(size, max_limbs)
+    assert gmp.cache_info()[:2] == (size, max_limbs)
+    with pytest.raises(ValueError):
+        gmp.cache_config(-1)
+    with pytest.raises(ValueError):
+        gmp.cache_config(size + 1)
+    with pytest.raises(ValueError):
+        gmp.cache_config(max_limbs=-1)
+    with pytest.raises(ValueError):
+        gmp.cache_config(max_limbs=max_limbs + 1)
+    with pytest.raises(TypeError):
+        gmp.cache_config(1.5)
+    with pytest.raises(TypeError):
+        gmp.cache_config(max_limbs="1")
+    with pytest.raises(TypeError):
+        gmp.cache_config(1, 2, 3)
+
+
+def test_thread_config():
+    x = mpz(3)**3000000
+
+    def runs_in_parallel():
+        started = threading.Event()
+        done = threading.Event()
+
+        def conv():
+            started.set()
+            assert mpz(str(x)) == x
+            done.set()
+
+        t = threading.Thread(target=conv)
+        t.start()
+        # With a long switch interval, this thread takes the GIL
+        # before the conversion is done only if it releases the GIL.
+        started.wait()
+        res = not done.is_set()
+        t.join()
+        return res
+
+    interval = sys.getswitchinterval()
+    try:
+        sys.setswitchinterval(1000)
+        with threads_used(nogil_limbs=1):
+            assert runs_in_parallel()
+        if getattr(sys, "_is_gil_enabled", lambda: True)():
+            with threads_used(nogil_limbs=1<<30):
+                assert not runs_in_parallel()
+    finally:
+        sys.setswitchinterval(interval)
+    with pytest.raises(ValueError):
+        gmp.thread_config(nogil_limbs=0)
+    with pytest.raises(TypeError):
+        gmp.thread_config(1)
+    with pytest.raises(TypeError):
+        gmp.thread_config(nogil_limbs=1.5)
+    with pytest.raises(ValueError, match="threads must be positive"):
+        gmp.thread_config(threads=0)
+    with pytest.raises(ValueError, match="parallel_limbs must be positive"):
+        gmp.thread_config(parallel_limbs=-1)
+    old = gmp.thread_config()
+    assert old == {"nogil_limbs": 64, "threads": 1, "parallel_limbs": 8192}
+    assert gmp.thread_config(threads=2) == old
+    assert gmp.thread_config(**old)["threads"] == 2
+    assert gmp.thread_config() == old
+
+
 @pytest.mark.skipif(platform.python_implementation() != "CPython"
                     or sys.version_info < (3, 11),
                     reason="no way to specify a signature")
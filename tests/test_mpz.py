@@ -9,7 +9,7 @@ import warnings
 from concurrent.futures import ThreadPoolExecutor
 
 import pytest
-from gmp import mpz
+from gmp import mpz, xmpz
 from hypothesis import assume, example, given, settings
 from hypothesis.strategies import (
     booleans,
@@ -28,6 +28,7 @@ from test_utils import (
     fmt_str,
     numbers,
     python_truediv,
+    threads_used,
     to_digits,
 )
 
@@ -105,6 +106,25 @@ def test_underscores_auto(s):
         assert mpz(s, base=0) == i
 
 
+@given(bigints(), sampled_from([2, 8, 10, 16, 36]),
+       integers(min_value=2, max_value=8))
+@example(10**400 - 1, 10, 4)
+@example(10**400, 10, 3)
+@example(-(1<<2000), 2, 2)
+def test_str_threads(x, base, threads):
+    mx = mpz(x)
+    r = mx.digits(base)
+    rx = format(mx, "X")
+    with threads_used(threads=threads, parallel_limbs=1):
+        assert mx.digits(base) == r
+        assert format(mx, "X") == rx
+        assert str(mx) == str(x)
+        assert mpz(r, base) == x
+        assert mpz(str(x)) == x
+        with pytest.raises(ValueError, match="invalid literal"):
+            mpz(r + " 1", base)
+
+
 @given(bigints(), fmt_str())
 @example(69, "r<-6_b")
 @example(3351, "e=+8o")
@@ -353,6 +373,17 @@ def test_repr(x):
 
 
 @given(bigints(), floats())
+@example(2**53 + 1, 2.0**53)
+@example(-(2**53 + 1), -2.0**53)
+@example(2**64 + 1, 2.0**64)
+@example(10**1000, 1.1)
+@example(-10**1000, 1e308)
+@example(2**1024 - 2**970, sys.float_info.max)
+@example(2**1024 - 2**970 + 1, sys.float_info.max)
+@example(123, float("nan"))
+@example(10**1000, float("inf"))
+@example(0, -0.0)
+@example(0, 5e-324)
 def test_richcompare_mixed(x, y):
     mx = mpz(x)
     for op in [operator.eq, operator.ne, operator.lt, operator.le,
@@ -367,10 +398,17 @@ def test_richcompare_errors():
         mx > 1j
     with pytest.raises(TypeError):
         mx > object()
-    with pytest.raises(OverflowError):
-        mpz(10**1000) < 1.1
-    with pytest.raises(OverflowError):
-        mpz(10**1000) > 1.1
+
+
+@given(bigints())
+@example(sys.hash_info.modulus)
+@example(-sys.hash_info.modulus)
+@example(sys.hash_info.modulus << BITS_PER_LIMB)
+@example((1 << 2*BITS_PER_LIMB) - 1)
+def test_hash(x):
+    mx = mpz(x)
+    assert hash(mx) == hash(x)
+    assert mx == x
 
 
 def test_hash_caching():
@@ -379,6 +417,29 @@ def test_hash_caching():
     assert hash(mx) == 123  # in cache
 
 
+@pytest.mark.skipif(platform.python_implementation() == "PyPy",
+                    reason="no shared small integers on PyPy")
+def test_small_ints():
+    mx = mpz(123)
+    assert mpz(0) is mpz() is mpz("0") is mx.imag
+    assert mx.denominator is mx.as_integer_ratio()[1] is mpz(1)
+    assert mx - 123 is mpz(0)
+    assert -mpz(5) is mpz(-5)
+    assert mpz(-6) is not mpz(-6)
+    assert mx*2 is mpz(246)
+    assert mx*3 is not mpz(369)
+    assert divmod(mx, 100) == (1, 23)
+    assert divmod(mx, 100)[1] is mpz(23)
+    assert mx >> 7 is mpz(0)
+    assert hash(mpz(-1)) == hash(-1)
+    mn = mpz(-2)
+    assert round(mpz(12345), mn) == 12300
+    assert mn == -2
+    assert format(mpz(-5), "#x") == "-0x5"
+    with ThreadPoolExecutor(max_workers=2) as tpe:
+        assert tpe.submit(mpz, 1).result() is mpz(1)
+
+
 @given(bigints())
 @example(0)
 @example(-1)
@@ -409,6 +470,8 @@ def test_unary_bulk(x):
 @example(0, -1)
 @example(-1, 2)
 @example(0, 0)
+@example(-5, 3)
+@example(1<<70, -7)
 def test_binary_bulk(x, y):
     mx = mpz(x)
     my = mpz(y)
@@ -422,6 +485,34 @@ def test_binary_bulk(x, y):
         assert op(x, my) == r
 
 
+@given(integers(min_value=-(1<<64), max_value=1<<64),
+       integers(min_value=-(1<<64), max_value=1<<64))
+@example(-(1<<63), -1)
+@example((1<<63) - 1, 1)
+@example(-(1<<63), 1)
+@example(1<<62, 2)
+@example(-(1<<62), -2)
+@example(-7, 2)
+@example(7, -2)
+@example(1, 62)
+@example(-1, 63)
+@example(-5, 64)
+def test_binary_machine_ints(x, y):
+    mx = mpz(x)
+    my = mpz(y)
+    ops = [operator.add, operator.sub, operator.mul, operator.and_,
+           operator.or_, operator.xor]
+    if y:
+        ops.extend([operator.floordiv, operator.mod])
+    if 0 <= y <= 200:
+        ops.extend([operator.lshift, operator.rshift])
+    for op in ops:
+        r = op(x, y)
+        assert op(mx, my) == r
+        assert op(mx, y) == r
+        assert op(x, my) == r
+
+
 @given(bigints(), bigints())
 @example(1, 1<<67)
 @example(1, -(1<<67))
@@ -435,6 +526,181 @@ def test_binary_commutative(x, y):
         assert op(mx, my) == op(my, mx)
 
 
+@given(bigints(), bigints())
+@example(1, 1<<67)
+@example(-1, -(1<<67))
+@example(1<<67, -(1<<67))
+@example(12345, 0)
+@example(-2, 3)
+def test_binary_inplace(x, y):
+    mx = mpz(x)
+    my = mpz(y)
+    ops = [operator.iadd, operator.isub, operator.imul, operator.iand,
+           operator.ior, operator.ixor]
+    if y:
+        ops.extend([operator.ifloordiv, operator.imod])
+    if 0 <= y <= 12345:
+        ops.extend([operator.ilshift, operator.irshift])
+    for op in ops:
+        r = op(x, y)
+        # temporaries are not referenced elsewhere, so they are reused
+        assert op(mx + 0, my) == r
+        assert op(mx + 0, y) == r
+        assert op(mx, my) == r
+        assert mx == x
+        a = mx + 0
+        b = a
+        a = op(a, my)
+        assert a == r
+        assert b == x
+    if not y:
+        with pytest.raises(ZeroDivisionError):
+            operator.ifloordiv(mx + 0, my)
+    if y < 0:
+        with pytest.raises(ValueError):
+            operator.ilshift(mx + 0, my)
+    assert operator.iadd(mx + 0, 1.5) == x + 1.5
+    # borrowed references on the stack are not counted on CPython 3.14+
+    assert [mx, operator.iadd(mx, y)] == [x, x + y]
+    assert mx == x
+
+
+@given(bigints(), bigints())
+@example(1, 1<<67)
+@example(-1, -(1<<67))
+@example(12345, 0)
+@example(-2, 3)
+def test_xmpz_inplace(x, y):
+    my = mpz(y)
+    ops = [operator.iadd, operator.isub, operator.imul, operator.iand,
+           operator.ior, operator.ixor]
+    if y:
+        ops.extend([operator.ifloordiv, operator.imod])
+    if 0 <= y <= 12345:
+        ops.extend([operator.ilshift, operator.irshift])
+    if 0 <= y <= 10 and abs(x) < 1<<1000:
+        ops.append(operator.ipow)
+    for op in ops:
+        r = op(x, y)
+        for other in [y, my, xmpz(y)]:
+            a = xmpz(x)
+            b = a
+            a = op(a, other)
+            assert a is b
+            assert type(a) is xmpz
+            assert a == r
+    if not y:
+        a = xmpz(x)
+        with pytest.raises(ZeroDivisionError):
+            a //= y
+        assert a == x
+    if y < 0:
+        a = xmpz(x)
+        with pytest.raises(ValueError):
+            a <<= y
+        assert a == x
+    a = xmpz(x)
+    a += a
+    assert a == 2*x
+
+
+def test_xmpz_interface():
+    x = xmpz(123)
+    assert isinstance(x, mpz)
+    assert repr(x) == "xmpz(123)"
+    assert str(x) == "123"
+    assert xmpz() == 0
+    assert xmpz("ff", 16) == 255
+    with pytest.raises(TypeError):
+        hash(x)
+    assert type(x + 1) is mpz
+    assert type(-x) is mpz
+    assert type(x.numerator) is mpz
+    y = mpz(x)
+    assert type(y) is mpz
+    assert y == x
+    x += 1
+    assert y == 123
+    assert type(xmpz(y)) is xmpz
+    x += 1.5
+    assert type(x) is float
+    x = xmpz(2)
+    x **= -1
+    assert x == 0.5
+    x = xmpz(3)
+    x **= 2
+    assert x == 9
+    x = pow(x, 2, 5)
+    assert type(x) is mpz
+    for protocol in range(pickle.HIGHEST_PROTOCOL + 1):
+        z = pickle.loads(pickle.dumps(xmpz(-123), protocol))
+        assert type(z) is xmpz
+        assert z == -123
+
+
+def test_xmpz_reserve():
+    x = xmpz(1)
+    size = x.__sizeof__()
+    x.reserve(0)
+    x.reserve(BITS_PER_LIMB)
+    assert x.__sizeof__() == size
+    x.reserve(1000*BITS_PER_LIMB)
+    size = x.__sizeof__()
+    assert size >= 1000*SIZEOF_LIMB
+    assert x == 1
+    x <<= 999*BITS_PER_LIMB - 1
+    x *= 3
+    assert x.__sizeof__() == size
+    assert x == 3 << (999*BITS_PER_LIMB - 1)
+    with pytest.raises(ValueError):
+        x.reserve(-1)
+    with pytest.raises(TypeError):
+        x.reserve(1.5)
+
+
+def test_xmpz_threads():
+    x = xmpz(0)
+    y = xmpz(1 << 100)
+    def f(n):
+        nonlocal x
+        for _ in range(n):
+            x.reserve(300)
+            x += 1
+            x += y
+            x -= y
+            x *= 1
+    with ThreadPoolExecutor(max_workers=7) as tpe:
+        futures = [tpe.submit(f, 1000) for _ in range(7)]
+        assert all(f.result() is None for f in futures)
+    assert x == 7000
+
+
+def test_xmpz_threads_read():
+    x = xmpz(1)
+    big = mpz(1) << 10000
+    values = [1, big]
+    def grow(n):
+        nonlocal x
+        for i in range(n):
+            x.reserve(10000 + 64*i)
+            x <<= 10000
+            x >>= 10000
+    def read(n):
+        for _ in range(n):
+            assert x + 0 in values
+            assert 2*x - x in values
+            assert x*1 in values
+            assert x % big in [1, 0]
+            assert mpz(x) in values
+            assert x.bit_length() in [1, 10001]
+            assert int(str(x)) in values
+    with ThreadPoolExecutor(max_workers=4) as tpe:
+        futures = [tpe.submit(read, 300) for _ in range(3)]
+        futures.append(tpe.submit(grow, 300))
+        assert all(f.result() is None for f in futures)
+    assert x == 1
+
+
 def test_add_int_subclasses():
     x = 123
     mx = mpz(x)
@@ -522,17 +788,32 @@ def test_divmod_bulk(x, y):
     assert x % my == r
     r = divmod(x, y)
     assert divmod(mx, my) == r
+    assert divmod(mx, y) == r
+    assert divmod(x, my) == r
 
 
 @given(bigints(), floats())
+@example(0, 1.5)
+@example(-7, float("inf"))
+@example(7, -0.0)
 def test_divmod_mixed(x, y):
     mx = mpz(x)
     if not y:
         with pytest.raises(ZeroDivisionError):
             mx // y
+        with pytest.raises(ZeroDivisionError):
+            divmod(mx, y)
     else:
         assert str(mx // y) == str(x // y)
         assert str(mx % y) == str(x % y)
+        assert str(divmod(mx, y)) == str(divmod(x, y))
+    if not x:
+        with pytest.raises(ZeroDivisionError):
+            divmod(y, mx)
+    else:
+        assert str(y // mx) == str(y // x)
+        assert str(y % mx) == str(y % x)
+        assert str(divmod(y, mx)) == str(divmod(y, x))
 
 
 def test_divmod_errors():
@@ -621,6 +902,7 @@ def test_truediv_errors():
 @example(-56, 321)
 @example(10**1000, -1)
 @example(10, -10**1000)
+@example(-3, 41)
 def test_power_bulk(x, y):
     if y > 0 and abs(x) > 1000000:
         return
@@ -735,6 +1017,8 @@ def test_power_errors():
 @example(18446744073709551618, 64)
 @example(1, 1<<128)
 @example(90605555449081991889354259339521952450308780844225461, 64)
+@example(-5, 3)
+@example(3, -1)
 def test_lshift(x, y):
     mx = mpz(x)
     my = mpz(y)
@@ -766,6 +1050,8 @@ def test_lshift(x, y):
 @example(-340282366920938463444927863358058659840, 64)
 @example(-514220174162876888173427869549172032807104958010493707296440352, 206)
 @example(-6277101735386680763495507056286727952638980837032266301441, 128)
+@example(-5, 1)
+@example(5, -2)
 def test_rshift(x, y):
     # XXX: mp_size_t might be smaller than mp_limb_t
     if abs(y) >= 2**32 and platform.system() == "Windows":
@@ -984,6 +1270,12 @@ def test_sizeof():
     for i in [1, 20, 300]:
         ms = mpz(1 << i*BITS_PER_LIMB)
         assert sys.getsizeof(ms) >= i*SIZEOF_LIMB
+    # short values are stored inline
+    assert sys.getsizeof(mpz(1000)) == sys.getsizeof(mpz(1 << BITS_PER_LIMB))
+    assert sys.getsizeof(mpz(1000)) < sys.getsizeof(mpz(1 << 3*BITS_PER_LIMB))
+    # oversized buffers of results are shrinked
+    ms = mpz(1 << 1000*BITS_PER_LIMB) >> 990*BITS_PER_LIMB
+    assert sys.getsizeof(ms) < sys.getsizeof(mpz(0)) + 100*SIZEOF_LIMB
 
 
 @given(bigints(), integers(min_value=2, max_value=36))
@@ -1,9 +1,10 @@
 import math
 import string
 import sys
+from contextlib import contextmanager
 from functools import lru_cache
 
-from gmp import gmp_info
+from gmp import gmp_info, thread_config
 from hypothesis.strategies import (
     booleans,
     complex_numbers,
@@ -19,6 +20,16 @@ SIEZEOF_LIMBCNT = gmp_info[2]
 MAX_FACTORIAL_CACHE = 1000
 
 
+@contextmanager
+def threads_used(**kwargs):
+    """Change settings of thread_config() for the block."""
+    old = thread_config(**kwargs)
+    try:
+        yield
+    finally:
+        thread_config(**old)
+
+
 def python_gcdext(a, b):
     if not a and not b:
         return 0, 0, 0
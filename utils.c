@@ -1,5 +1,17 @@
 #include "utils.h"
 
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#  include <process.h>
+#  define fetch_add(p, v) _InterlockedExchangeAdd64((p), (v))
+#else
+#  include <pthread.h>
+#  define fetch_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#endif
+
 int
 gmp_parse_pyargs(const gmp_pyargs *fnargs, Py_ssize_t argidx[],
                  PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
@@ -19,7 +31,7 @@ gmp_parse_pyargs(const gmp_pyargs *fnargs, Py_ssize_t argidx[],
     if (kwnames) {
         nkws = PyTuple_GET_SIZE(kwnames);
     }
-    if (nkws > fnargs->maxpos) {
+    if (nkws > fnargs->maxargs) {
         PyErr_Format(PyExc_TypeError,
                      "%s() takes at most %zu keyword arguments", fnargs->fname,
                      fnargs->maxargs);
@@ -110,3 +122,81 @@ gmp_PyUnicode_TransformDecimalAndSpaceToASCII(PyObject *unicode)
     }
     return result;
 }
+
+typedef struct {
+    int64_t n;
+    int64_t next;
+    void (*task)(void *, size_t);
+    void *data;
+} parallel_state;
+
+static void
+parallel_run(parallel_state *state)
+{
+    int64_t i;
+
+    while ((i = fetch_add(&state->next, 1)) < state->n) {
+        state->task(state->data, (size_t)i);
+    }
+}
+
+#if defined(_WIN32)
+typedef HANDLE parallel_thread;
+
+static unsigned __stdcall
+parallel_worker(void *arg)
+{
+    parallel_run(arg);
+    return 0;
+}
+#else
+typedef pthread_t parallel_thread;
+
+static void *
+parallel_worker(void *arg)
+{
+    parallel_run(arg);
+    return NULL;
+}
+#endif
+
+void
+gmp_parallel_for(size_t n, size_t nthreads,
+                 void (*task)(void *data, size_t i), void *data)
+{
+    parallel_state state = {(int64_t)n, 0, task, data};
+    parallel_thread *threads = NULL;
+    size_t started = 0;
+
+    if (nthreads > n) {
+        nthreads = n;
+    }
+    if (nthreads > 1) {
+        threads = malloc((nthreads - 1)*sizeof(parallel_thread));
+    }
+    for (; threads && started < nthreads - 1; started++) {
+#if defined(_WIN32)
+        threads[started] = (HANDLE)_beginthreadex(NULL, 0, parallel_worker,
+                                                  &state, 0, NULL);
+        if (!threads[started]) {
+            break;
+        }
+#else
+        if (pthread_create(&threads[started], NULL, parallel_worker,
+                           &state))
+        {
+            break;
+        }
+#endif
+    }
+    parallel_run(&state);
+    for (size_t i = 0; i < started; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+    free(threads);
+}
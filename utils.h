@@ -43,4 +43,11 @@ int gmp_parse_pyargs(const gmp_pyargs *fnargs, Py_ssize_t argidx[],
 
 PyObject * gmp_PyUnicode_TransformDecimalAndSpaceToASCII(PyObject *unicode);
 
+/* Run task(data, i) for all i in [0, n) on at most nthreads threads,
+   including the calling one.  Items are picked up dynamically by idle
+   threads.  If a thread can't be started, its share is done by others.
+   Tasks must not use the Python C-API. */
+void gmp_parallel_for(size_t n, size_t nthreads,
+                      void (*task)(void *data, size_t i), void *data);
+
 #endif /* UTILS_H */